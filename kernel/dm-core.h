@@ -19,6 +19,8 @@
 
 #define DM_RESERVED_MAX_IOS		1024
 
+struct dm_io_cache;
+
 struct dm_kobject_holder {
 	struct kobject kobj;
 	struct completion completion;
@@ -96,6 +98,15 @@ struct mapped_device {
 
 	struct bio_set *bs;
 
+	/*
+	 * bio-based: dm_ios with their first clone inline, and per-cpu
+	 * caches of free ones and of free clones from bs.
+	 */
+	struct bio_set *io_bs;
+	unsigned io_tio_offset;
+	struct dm_io_cache __percpu *io_cache;
+	struct list_head io_cache_list;
+
 	/*
 	 * freeze/thaw support require holding onto a super block
 	 */
@@ -125,6 +136,7 @@ struct mapped_device {
 
 	/* for blk-mq request-based DM support */
 	struct blk_mq_tag_set *tag_set;
+	struct dm_mq_hw_stats __percpu *mq_stats;
 	bool use_blk_mq:1;
 	bool init_tio_pdu:1;
 
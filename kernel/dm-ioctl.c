@@ -16,12 +16,59 @@
 #include <linux/dm-ioctl.h>
 #include <linux/hdreg.h>
 #include <linux/compat.h>
+#include <linux/sort.h>
 
 #include <asm/uaccess.h>
 
 #define DM_MSG_PREFIX "ioctl"
 #define DM_DRIVER_EMAIL "dm-devel@redhat.com"
 
+#ifndef DM_LIST_STATUS_CMD
+/*
+ * DM_LIST_STATUS: name, uuid, event number, open count and target
+ * status of many devices in one call.
+ *
+ * In:	dev	 first device to report (0 to start), devices are
+ *		 reported in device number order
+ *	name	 optional target type: only devices whose live table
+ *		 has a target of that type are reported
+ *	flags	 DM_STATUS_TABLE_FLAG, DM_NOFLUSH_FLAG as for
+ *		 DM_TABLE_STATUS
+ * Out:	a chain of struct dm_status_list, each followed by
+ *	target_count struct dm_target_spec and status strings laid out
+ *	as for DM_TABLE_STATUS.  If DM_BUFFER_FULL_FLAG is set, dev is
+ *	the device to resume from.  target_count is the number of
+ *	devices returned.
+ *
+ * The caller must ask for at least interface minor DM_LIST_STATUS_MINOR.
+ * The command number comes from the top of the range, well clear of
+ * the ones upstream hands out in sequence.
+ */
+#define DM_LIST_STATUS_CMD	0xf0
+#define DM_LIST_STATUS_MINOR	(DM_VERSION_MINOR + 1)
+
+/* The interface minor we report, one up for DM_LIST_STATUS */
+#define DM_IOCTL_VERSION_MINOR	DM_LIST_STATUS_MINOR
+
+struct dm_status_list {
+	__u64 dev;
+	__u32 next;		/* offset to the next record from this one */
+	__u32 event_nr;
+	__s32 open_count;
+	__u32 flags;		/* DM_SUSPEND_FLAG, DM_ACTIVE_PRESENT_FLAG */
+	__u32 target_count;
+	__u32 data_size;	/* bytes of target specs and status */
+	char name[DM_NAME_LEN];
+	char uuid[DM_UUID_LEN];
+	char data[0] __aligned(8);
+};
+#else
+#ifndef DM_LIST_STATUS_MINOR
+#define DM_LIST_STATUS_MINOR	DM_VERSION_MINOR
+#endif
+#define DM_IOCTL_VERSION_MINOR	DM_VERSION_MINOR
+#endif
+
 struct dm_file {
 	/*
 	 * poll will wait until the global event number is greater than
@@ -1107,19 +1154,22 @@ static int dev_status(struct file *filp, struct dm_ioctl *param, size_t param_si
 /*
  * Build up the status struct for each target
  */
-static void retrieve_status(struct dm_table *table,
-			    struct dm_ioctl *param, size_t param_size)
+/*
+ * Fill outbuf with the target specs and status of a table.  Returns
+ * the bytes used, setting DM_BUFFER_FULL_FLAG in *flags if they did
+ * not all fit.
+ */
+static size_t __retrieve_status(struct dm_table *table, char *outbuf,
+				size_t len, uint32_t *flags)
 {
 	unsigned int i, num_targets;
 	struct dm_target_spec *spec;
-	char *outbuf, *outptr;
+	char *outptr = outbuf;
 	status_type_t type;
-	size_t remaining, len, used = 0;
+	size_t remaining, used = 0;
 	unsigned status_flags = 0;
 
-	outptr = outbuf = get_result_buffer(param, param_size, &len);
-
-	if (param->flags & DM_STATUS_TABLE_FLAG)
+	if (*flags & DM_STATUS_TABLE_FLAG)
 		type = STATUSTYPE_TABLE;
 	else
 		type = STATUSTYPE_INFO;
@@ -1132,7 +1182,7 @@ static void retrieve_status(struct dm_table *table,
 
 		remaining = len - (outptr - outbuf);
 		if (remaining <= sizeof(struct dm_target_spec)) {
-			param->flags |= DM_BUFFER_FULL_FLAG;
+			*flags |= DM_BUFFER_FULL_FLAG;
 			break;
 		}
 
@@ -1147,13 +1197,13 @@ static void retrieve_status(struct dm_table *table,
 		outptr += sizeof(struct dm_target_spec);
 		remaining = len - (outptr - outbuf);
 		if (remaining <= 0) {
-			param->flags |= DM_BUFFER_FULL_FLAG;
+			*flags |= DM_BUFFER_FULL_FLAG;
 			break;
 		}
 
 		/* Get the status/table string from the target driver */
 		if (ti->type->status) {
-			if (param->flags & DM_NOFLUSH_FLAG)
+			if (*flags & DM_NOFLUSH_FLAG)
 				status_flags |= DM_STATUS_NOFLUSH_FLAG;
 			ti->type->status(ti, type, status_flags, outptr, remaining);
 		} else
@@ -1161,21 +1211,156 @@ static void retrieve_status(struct dm_table *table,
 
 		l = strlen(outptr) + 1;
 		if (l == remaining) {
-			param->flags |= DM_BUFFER_FULL_FLAG;
+			*flags |= DM_BUFFER_FULL_FLAG;
 			break;
 		}
 
 		outptr += l;
-		used = param->data_start + (outptr - outbuf);
+		used = outptr - outbuf;
 
 		outptr = align_ptr(outptr);
 		spec->next = outptr - outbuf;
 	}
 
+	return used;
+}
+
+static void retrieve_status(struct dm_table *table,
+			    struct dm_ioctl *param, size_t param_size)
+{
+	size_t len, used;
+	char *outbuf = get_result_buffer(param, param_size, &len);
+
+	used = __retrieve_status(table, outbuf, len, &param->flags);
 	if (used)
-		param->data_size = used;
+		param->data_size = param->data_start + used;
+
+	param->target_count = dm_table_get_num_targets(table);
+}
+
+static bool table_has_target_type(struct dm_table *table, const char *type)
+{
+	unsigned int i, num_targets = dm_table_get_num_targets(table);
 
-	param->target_count = num_targets;
+	for (i = 0; i < num_targets; i++)
+		if (!strcmp(dm_table_get_target(table, i)->type->name, type))
+			return true;
+
+	return false;
+}
+
+static int cmp_md_devt(const void *a, const void *b)
+{
+	dev_t da = disk_devt(dm_disk(*(struct mapped_device **)a));
+	dev_t db = disk_devt(dm_disk(*(struct mapped_device **)b));
+
+	return da < db ? -1 : da > db;
+}
+
+/*
+ * Status of many devices in one call, see DM_LIST_STATUS_CMD.  The
+ * devices are pinned under _hash_lock and their status gathered after
+ * dropping it, so slow target status methods do not hold up other
+ * ioctls.
+ */
+static int list_status(struct file *filp, struct dm_ioctl *param, size_t param_size)
+{
+	dev_t cursor = huge_decode_dev(param->dev);
+	const char *type = *param->name ? param->name : NULL;
+	struct mapped_device **mds;
+	struct dm_status_list *sl, *old_sl = NULL;
+	struct hash_cell *hc;
+	unsigned int i, nr = 0, max = 0, returned = 0;
+	char *outbuf;
+	size_t len, pos = 0, used = 0;
+
+	/* callers built for an older interface can't parse the result */
+	if (param->version[1] < DM_LIST_STATUS_MINOR) {
+		DMWARN("list_status: needs interface version %u.%u",
+		       DM_VERSION_MAJOR, DM_LIST_STATUS_MINOR);
+		return -EINVAL;
+	}
+
+	down_read(&_hash_lock);
+	for (i = 0; i < NUM_BUCKETS; i++)
+		list_for_each_entry(hc, _name_buckets + i, name_list)
+			max++;
+	mds = kvmalloc(max_t(size_t, max, 1) * sizeof(*mds), GFP_KERNEL);
+	if (!mds) {
+		up_read(&_hash_lock);
+		return -ENOMEM;
+	}
+	for (i = 0; i < NUM_BUCKETS; i++)
+		list_for_each_entry(hc, _name_buckets + i, name_list) {
+			if (disk_devt(dm_disk(hc->md)) < cursor)
+				continue;
+			dm_get(hc->md);
+			mds[nr++] = hc->md;
+		}
+	up_read(&_hash_lock);
+
+	sort(mds, nr, sizeof(*mds), cmp_md_devt, NULL);
+
+	outbuf = get_result_buffer(param, param_size, &len);
+	param->dev = 0;
+
+	for (i = 0; i < nr; i++) {
+		struct mapped_device *md = mds[i];
+		struct dm_table *table;
+		uint32_t flags = param->flags & (DM_STATUS_TABLE_FLAG |
+						 DM_NOFLUSH_FLAG);
+		int srcu_idx;
+
+		table = dm_get_live_table(md, &srcu_idx);
+		if (type && (!table || !table_has_target_type(table, type)))
+			goto next;
+
+		if (len - pos <= sizeof(*sl))
+			flags |= DM_BUFFER_FULL_FLAG;
+		else {
+			sl = (struct dm_status_list *)(outbuf + pos);
+			if (dm_copy_name_and_uuid(md, sl->name, sl->uuid))
+				goto next;	/* removed since we looked */
+			sl->dev = huge_encode_dev(disk_devt(dm_disk(md)));
+			sl->next = 0;
+			sl->event_nr = dm_get_event_nr(md);
+			sl->open_count = dm_open_count(md);
+			sl->flags = dm_suspended_md(md) ? DM_SUSPEND_FLAG : 0;
+			sl->target_count = 0;
+			sl->data_size = 0;
+			if (table) {
+				sl->flags |= DM_ACTIVE_PRESENT_FLAG;
+				sl->target_count = dm_table_get_num_targets(table);
+				sl->data_size = __retrieve_status(table, sl->data,
+						len - pos - sizeof(*sl), &flags);
+			}
+		}
+
+		if (flags & DM_BUFFER_FULL_FLAG) {
+			/* resume from this device next time */
+			dm_put_live_table(md, srcu_idx);
+			param->flags |= DM_BUFFER_FULL_FLAG;
+			param->dev = huge_encode_dev(disk_devt(dm_disk(md)));
+			break;
+		}
+
+		if (old_sl)
+			old_sl->next = (void *)sl - (void *)old_sl;
+		old_sl = sl;
+		returned++;
+		used = pos + sizeof(*sl) + sl->data_size;
+		pos = (char *)align_ptr(outbuf + used) - outbuf;
+next:
+		dm_put_live_table(md, srcu_idx);
+	}
+
+	for (i = 0; i < nr; i++)
+		dm_put(mds[i]);
+	kvfree(mds);
+
+	param->data_size = param->data_start + used;
+	param->target_count = returned;
+	return 0;
 }
 
 /*
@@ -1664,6 +1849,11 @@ static ioctl_fn lookup_ioctl(unsigned int cmd, int *ioctl_flags)
 		{DM_DEV_ARM_POLL, IOCTL_FLAGS_NO_PARAMS, dev_arm_poll},
 	};
 
+	if (cmd == DM_LIST_STATUS_CMD) {
+		*ioctl_flags = 0;
+		return list_status;
+	}
+
 	if (unlikely(cmd >= ARRAY_SIZE(_ioctls)))
 		return NULL;
 
@@ -1684,10 +1874,10 @@ static int check_version(unsigned int cmd, struct dm_ioctl __user *user)
 		return -EFAULT;
 
 	if ((DM_VERSION_MAJOR != version[0]) ||
-	    (DM_VERSION_MINOR < version[1])) {
+	    (DM_IOCTL_VERSION_MINOR < version[1])) {
 		DMWARN("ioctl interface mismatch: "
 		       "kernel(%u.%u.%u), user(%u.%u.%u), cmd(%d)",
-		       DM_VERSION_MAJOR, DM_VERSION_MINOR,
+		       DM_VERSION_MAJOR, DM_IOCTL_VERSION_MINOR,
 		       DM_VERSION_PATCHLEVEL,
 		       version[0], version[1], version[2], cmd);
 		r = -EINVAL;
@@ -1697,7 +1887,7 @@ static int check_version(unsigned int cmd, struct dm_ioctl __user *user)
 	 * Fill in the kernel version.
 	 */
 	version[0] = DM_VERSION_MAJOR;
-	version[1] = DM_VERSION_MINOR;
+	version[1] = DM_IOCTL_VERSION_MINOR;
 	version[2] = DM_VERSION_PATCHLEVEL;
 	if (copy_to_user(user->version, version, sizeof(version)))
 		return -EFAULT;
@@ -1980,7 +2170,7 @@ int __init dm_interface_init(void)
 	}
 
 	DMINFO("%d.%d.%d%s initialised: %s", DM_VERSION_MAJOR,
-	       DM_VERSION_MINOR, DM_VERSION_PATCHLEVEL, DM_VERSION_EXTRA,
+	       DM_IOCTL_VERSION_MINOR, DM_VERSION_PATCHLEVEL, DM_VERSION_EXTRA,
 	       DM_DRIVER_EMAIL);
 	return 0;
 }
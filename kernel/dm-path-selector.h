@@ -13,6 +13,7 @@
 #define	DM_PATH_SELECTOR_H
 
 #include <linux/device-mapper.h>
+#include <linux/blkdev.h>
 
 #include "dm-mpath.h"
 
@@ -77,6 +78,15 @@ struct path_selector_type {
 		       size_t nr_bytes);
 };
 
+/*
+ * NUMA node the queue of a path lives on, NUMA_NO_NODE if unknown.
+ * Selectors use it to prefer paths local to the submitting cpu.
+ */
+static inline int dm_path_numa_node(struct dm_path *path)
+{
+	return bdev_get_queue(path->dev->bdev)->node;
+}
+
 /* Register a path selector */
 int dm_register_path_selector(struct path_selector_type *type);
 
@@ -24,7 +24,7 @@
 
 #define DM_MSG_PREFIX	"multipath queue-length"
 #define QL_MIN_IO	1
-#define QL_VERSION	"0.2.0"
+#define QL_VERSION	"0.3.0"
 
 struct selector {
 	struct list_head	valid_paths;
@@ -37,6 +37,7 @@ struct path_info {
 	struct dm_path		*path;
 	unsigned		repeat_count;
 	atomic_t		qlen;	/* the number of in-flight I/Os */
+	int			node;	/* NUMA node of the path's queue */
 };
 
 static struct selector *alloc_selector(void)
@@ -145,6 +146,7 @@ static int ql_add_path(struct path_selector *ps, struct dm_path *path,
 	}
 
 	pi->path = path;
+	pi->node = dm_path_numa_node(path);
 	pi->repeat_count = repeat_count;
 	atomic_set(&pi->qlen, 0);
 
@@ -189,6 +191,7 @@ static struct dm_path *ql_select_path(struct path_selector *ps, size_t nr_bytes)
 	struct selector *s = ps->context;
 	struct path_info *pi = NULL, *best = NULL;
 	struct dm_path *ret = NULL;
+	int node = numa_node_id();
 	unsigned long flags;
 
 	spin_lock_irqsave(&s->lock, flags);
@@ -202,8 +205,12 @@ static struct dm_path *ql_select_path(struct path_selector *ps, size_t nr_bytes)
 		if (!best ||
 		    (atomic_read(&pi->qlen) < atomic_read(&best->qlen)))
 			best = pi;
+		/* On a tie, prefer a path on the submitting cpu's node */
+		else if (atomic_read(&pi->qlen) == atomic_read(&best->qlen) &&
+			 best->node != node && pi->node == node)
+			best = pi;
 
-		if (!atomic_read(&best->qlen))
+		if (!atomic_read(&best->qlen) && best->node == node)
 			break;
 	}
 
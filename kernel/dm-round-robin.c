@@ -18,15 +18,17 @@
 
 #define DM_MSG_PREFIX "multipath round-robin"
 #define RR_MIN_IO     1
-#define RR_VERSION    "1.2.0"
+#define RR_VERSION    "1.3.0"
 
 /*-----------------------------------------------------------------
  * Path-handling code, paths are held in lists
  *---------------------------------------------------------------*/
 struct path_info {
 	struct list_head list;
+	struct list_head node_list;	/* on node's valid_paths when valid */
 	struct dm_path *path;
 	unsigned repeat_count;
+	int node;
 };
 
 static void free_paths(struct list_head *paths)
@@ -41,27 +43,77 @@ static void free_paths(struct list_head *paths)
 
 /*-----------------------------------------------------------------
  * Round-robin selector
+ *
+ * Valid paths are also kept on a list per NUMA node, each under its own
+ * lock, and a cpu rotates through the paths of its node before falling
+ * back to all of them.  Lock order is selector->lock, then node->lock.
  *---------------------------------------------------------------*/
 
+struct rr_node {
+	spinlock_t lock;
+	struct list_head valid_paths;
+} ____cacheline_aligned_in_smp;
+
 struct selector {
 	struct list_head valid_paths;
 	struct list_head invalid_paths;
 	spinlock_t lock;
+	struct rr_node *nodes;		/* nr_node_ids entries */
 };
 
 static struct selector *alloc_selector(void)
 {
 	struct selector *s = kmalloc(sizeof(*s), GFP_KERNEL);
+	int n;
+
+	if (!s)
+		return NULL;
+
+	s->nodes = kcalloc(nr_node_ids, sizeof(*s->nodes), GFP_KERNEL);
+	if (!s->nodes) {
+		kfree(s);
+		return NULL;
+	}
 
-	if (s) {
-		INIT_LIST_HEAD(&s->valid_paths);
-		INIT_LIST_HEAD(&s->invalid_paths);
-		spin_lock_init(&s->lock);
+	INIT_LIST_HEAD(&s->valid_paths);
+	INIT_LIST_HEAD(&s->invalid_paths);
+	spin_lock_init(&s->lock);
+	for (n = 0; n < nr_node_ids; n++) {
+		spin_lock_init(&s->nodes[n].lock);
+		INIT_LIST_HEAD(&s->nodes[n].valid_paths);
 	}
 
 	return s;
 }
 
+/* Called with s->lock held */
+static void rr_node_add(struct selector *s, struct path_info *pi)
+{
+	struct rr_node *rn;
+
+	if (pi->node == NUMA_NO_NODE)
+		return;
+
+	rn = &s->nodes[pi->node];
+	spin_lock(&rn->lock);
+	list_add_tail(&pi->node_list, &rn->valid_paths);
+	spin_unlock(&rn->lock);
+}
+
+/* Called with s->lock held */
+static void rr_node_del(struct selector *s, struct path_info *pi)
+{
+	struct rr_node *rn;
+
+	if (pi->node == NUMA_NO_NODE || list_empty(&pi->node_list))
+		return;
+
+	rn = &s->nodes[pi->node];
+	spin_lock(&rn->lock);
+	list_del_init(&pi->node_list);
+	spin_unlock(&rn->lock);
+}
+
 static int rr_create(struct path_selector *ps, unsigned argc, char **argv)
 {
 	struct selector *s;
@@ -80,6 +132,7 @@ static void rr_destroy(struct path_selector *ps)
 
 	free_paths(&s->valid_paths);
 	free_paths(&s->invalid_paths);
+	kfree(s->nodes);
 	kfree(s);
 	ps->context = NULL;
 }
@@ -144,11 +197,16 @@ static int rr_add_path(struct path_selector *ps, struct dm_path *path,
 
 	pi->path = path;
 	pi->repeat_count = repeat_count;
+	pi->node = dm_path_numa_node(path);
+	if (pi->node >= nr_node_ids)
+		pi->node = NUMA_NO_NODE;
+	INIT_LIST_HEAD(&pi->node_list);
 
 	path->pscontext = pi;
 
 	spin_lock_irqsave(&s->lock, flags);
 	list_add_tail(&pi->list, &s->valid_paths);
+	rr_node_add(s, pi);
 	spin_unlock_irqrestore(&s->lock, flags);
 
 	return 0;
@@ -162,6 +220,7 @@ static void rr_fail_path(struct path_selector *ps, struct dm_path *p)
 
 	spin_lock_irqsave(&s->lock, flags);
 	list_move(&pi->list, &s->invalid_paths);
+	rr_node_del(s, pi);
 	spin_unlock_irqrestore(&s->lock, flags);
 }
 
@@ -173,6 +232,8 @@ static int rr_reinstate_path(struct path_selector *ps, struct dm_path *p)
 
 	spin_lock_irqsave(&s->lock, flags);
 	list_move(&pi->list, &s->valid_paths);
+	if (list_empty(&pi->node_list))
+		rr_node_add(s, pi);
 	spin_unlock_irqrestore(&s->lock, flags);
 
 	return 0;
@@ -183,6 +244,20 @@ static struct dm_path *rr_select_path(struct path_selector *ps, size_t nr_bytes)
 	unsigned long flags;
 	struct selector *s = ps->context;
 	struct path_info *pi = NULL;
+	struct rr_node *rn = &s->nodes[numa_node_id()];
+
+	/* Prefer a path on the submitting cpu's node */
+	if (!list_empty(&rn->valid_paths)) {
+		spin_lock_irqsave(&rn->lock, flags);
+		if (!list_empty(&rn->valid_paths)) {
+			pi = list_entry(rn->valid_paths.next, struct path_info,
+					node_list);
+			list_move_tail(&pi->node_list, &rn->valid_paths);
+		}
+		spin_unlock_irqrestore(&rn->lock, flags);
+		if (pi)
+			return pi->path;
+	}
 
 	spin_lock_irqsave(&s->lock, flags);
 	if (!list_empty(&s->valid_paths)) {
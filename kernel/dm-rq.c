@@ -16,6 +16,7 @@
 #define DM_MQ_QUEUE_DEPTH 2048
 static unsigned dm_mq_nr_hw_queues = DM_MQ_NR_HW_QUEUES;
 static unsigned dm_mq_queue_depth = DM_MQ_QUEUE_DEPTH;
+static bool dm_mq_numa_map = true;
 
 /*
  * Request-based DM's mempools' reserved IOs set by the user.
@@ -48,6 +49,21 @@ static unsigned dm_get_blk_mq_nr_hw_queues(void)
 	return __dm_get_module_param(&dm_mq_nr_hw_queues, 1, 32);
 }
 
+/*
+ * With dm_mq_numa_map every online node gets the same number of
+ * hardware queues, so that a queue is only ever run by cpus of one node.
+ */
+static unsigned dm_get_blk_mq_nr_hw_queues_numa(void)
+{
+	unsigned nr = dm_get_blk_mq_nr_hw_queues();
+	unsigned nodes = num_online_nodes();
+
+	if (!dm_mq_numa_map || nodes < 2 || nodes > 32)
+		return nr;
+
+	return max(nr / nodes, 1U) * nodes;
+}
+
 static unsigned dm_get_blk_mq_queue_depth(void)
 {
 	return __dm_get_module_param(&dm_mq_queue_depth,
@@ -636,6 +652,8 @@ static int map_request(struct dm_rq_target_io *tio)
 	struct mapped_device *md = tio->md;
 	struct request *rq = tio->orig;
 	struct request *clone = NULL;
+	unsigned hctx_idx;
+	bool remote;
 	int ret;
 
 	if (tio->clone) {
@@ -666,6 +684,10 @@ check_again:
 		/* The target has remapped the I/O so dispatch it */
 		trace_block_rq_remap(clone->q, clone, disk_devt(dm_disk(md)),
 				     blk_rq_pos(rq));
+		/* the clone may be completed and gone once dispatched */
+		hctx_idx = tio->hctx_idx;
+		remote = md->mq_stats && clone->q->node != NUMA_NO_NODE &&
+			 clone->q->node != numa_node_id();
 		ret = dm_dispatch_clone_request(clone, rq);
 		if (ret == BLK_MQ_RQ_QUEUE_BUSY || r == BLK_MQ_RQ_QUEUE_DEV_BUSY) {
 			blk_rq_unprep_clone(clone);
@@ -677,6 +699,8 @@ check_again:
 				r = DM_MAPIO_REQUEUE;
 			goto check_again;
 		}
+		if (remote)
+			this_cpu_inc(md->mq_stats[hctx_idx].remote);
 		break;
 	case DM_MAPIO_REQUEUE:
 		/* The target wants to requeue the I/O */
@@ -901,8 +925,10 @@ static int dm_mq_queue_rq(struct blk_mq_hw_ctx *hctx,
 		dm_put_live_table(md, srcu_idx);
 	}
 
-	if (ti->type->busy && ti->type->busy(ti))
+	if (ti->type->busy && ti->type->busy(ti)) {
+		this_cpu_inc(md->mq_stats[hctx->queue_num].busy);
 		return BLK_MQ_RQ_QUEUE_BUSY;
+	}
 
 	dm_start_request(md, rq);
 
@@ -913,24 +939,99 @@ static int dm_mq_queue_rq(struct blk_mq_hw_ctx *hctx,
 	 * Establish tio->ti before calling map_request().
 	 */
 	tio->ti = ti;
+	tio->hctx_idx = hctx->queue_num;
 
 	/* Direct call is fine since .queue_rq allows allocations */
 	if (map_request(tio) == DM_MAPIO_REQUEUE) {
 		/* Undo dm_start_request() before requeuing */
 		rq_end_stats(md, rq);
 		rq_completed(md, rq_data_dir(rq), false);
+		this_cpu_inc(md->mq_stats[hctx->queue_num].busy);
 		return BLK_MQ_RQ_QUEUE_BUSY;
 	}
 
+	this_cpu_inc(md->mq_stats[hctx->queue_num].dispatched);
 	return BLK_MQ_RQ_QUEUE_OK;
 }
 
+static unsigned dm_mq_node_index(int node)
+{
+	unsigned idx = 0;
+	int n;
+
+	for_each_online_node(n) {
+		if (n == node)
+			return idx;
+		idx++;
+	}
+
+	/* cpu of an offline node */
+	return node % num_online_nodes();
+}
+
+/*
+ * Give each node its own set of hardware queues and spread the node's
+ * cpus over them.  blk-mq then allocates every hctx, and runs it, on the
+ * node whose cpus feed it, which is what path selectors look at to
+ * prefer a node-local path.
+ */
+static int dm_mq_map_queues(struct blk_mq_tag_set *set)
+{
+	unsigned nodes = num_online_nodes();
+	unsigned per_node, *next;
+	unsigned cpu, idx;
+
+	if (!dm_mq_numa_map || nodes < 2 || set->nr_hw_queues % nodes)
+		return blk_mq_map_queues(set);
+
+	next = kcalloc(nodes, sizeof(*next), GFP_KERNEL);
+	if (!next)
+		return blk_mq_map_queues(set);
+
+	per_node = set->nr_hw_queues / nodes;
+	for_each_possible_cpu(cpu) {
+		idx = dm_mq_node_index(cpu_to_node(cpu));
+		set->mq_map[cpu] = idx * per_node + next[idx]++ % per_node;
+	}
+
+	kfree(next);
+	return 0;
+}
+
 static struct blk_mq_ops dm_mq_ops = {
 	.queue_rq = dm_mq_queue_rq,
+	.map_queues = dm_mq_map_queues,
 	.complete = dm_softirq_done,
 	.init_request = dm_mq_init_request,
 };
 
+ssize_t dm_attr_mq_stats_show(struct mapped_device *md, char *buf)
+{
+	struct blk_mq_hw_ctx *hctx;
+	struct dm_mq_hw_stats *s, sum;
+	ssize_t sz = 0;
+	unsigned i;
+	int cpu;
+
+	if (!md->mq_stats)
+		return 0;
+
+	queue_for_each_hw_ctx(md->queue, hctx, i) {
+		memset(&sum, 0, sizeof(sum));
+		for_each_possible_cpu(cpu) {
+			s = per_cpu_ptr(md->mq_stats, cpu) + i;
+			sum.dispatched += s->dispatched;
+			sum.busy += s->busy;
+			sum.remote += s->remote;
+		}
+		sz += scnprintf(buf + sz, PAGE_SIZE - sz, "%u %d %lu %lu %lu\n",
+				i, hctx->numa_node, sum.dispatched,
+				sum.busy, sum.remote);
+	}
+
+	return sz;
+}
+
 int dm_mq_init_request_queue(struct mapped_device *md, struct dm_table *t)
 {
 	struct request_queue *q;
@@ -950,7 +1051,7 @@ int dm_mq_init_request_queue(struct mapped_device *md, struct dm_table *t)
 	md->tag_set->queue_depth = dm_get_blk_mq_queue_depth();
 	md->tag_set->numa_node = md->numa_node_id;
 	md->tag_set->flags = BLK_MQ_F_SHOULD_MERGE | BLK_MQ_F_SG_MERGE;
-	md->tag_set->nr_hw_queues = dm_get_blk_mq_nr_hw_queues();
+	md->tag_set->nr_hw_queues = dm_get_blk_mq_nr_hw_queues_numa();
 	md->tag_set->driver_data = md;
 
 	md->tag_set->cmd_size = sizeof(struct dm_rq_target_io);
@@ -961,9 +1062,17 @@ int dm_mq_init_request_queue(struct mapped_device *md, struct dm_table *t)
 		md->init_tio_pdu = true;
 	}
 
+	md->mq_stats = __alloc_percpu(sizeof(struct dm_mq_hw_stats) *
+				      md->tag_set->nr_hw_queues,
+				      __alignof__(struct dm_mq_hw_stats));
+	if (!md->mq_stats) {
+		err = -ENOMEM;
+		goto out_kfree_tag_set;
+	}
+
 	err = blk_mq_alloc_tag_set(md->tag_set);
 	if (err)
-		goto out_kfree_tag_set;
+		goto out_free_stats;
 
 	q = blk_mq_init_allocated_queue(md->tag_set, md->queue);
 	if (IS_ERR(q)) {
@@ -977,6 +1086,9 @@ int dm_mq_init_request_queue(struct mapped_device *md, struct dm_table *t)
 
 out_tag_set:
 	blk_mq_free_tag_set(md->tag_set);
+out_free_stats:
+	free_percpu(md->mq_stats);
+	md->mq_stats = NULL;
 out_kfree_tag_set:
 	kfree(md->tag_set);
 
@@ -989,6 +1101,7 @@ void dm_mq_cleanup_mapped_device(struct mapped_device *md)
 		blk_mq_free_tag_set(md->tag_set);
 		kfree(md->tag_set);
 	}
+	free_percpu(md->mq_stats);
 }
 
 module_param(reserved_rq_based_ios, uint, S_IRUGO | S_IWUSR);
@@ -1002,3 +1115,6 @@ MODULE_PARM_DESC(dm_mq_nr_hw_queues, "Number of hardware queues for request-base
 
 module_param(dm_mq_queue_depth, uint, S_IRUGO | S_IWUSR);
 MODULE_PARM_DESC(dm_mq_queue_depth, "Queue depth for request-based dm-mq devices");
+
+module_param(dm_mq_numa_map, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(dm_mq_numa_map, "Map request-based dm-mq hardware queues to NUMA nodes");
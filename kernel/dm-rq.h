@@ -30,6 +30,17 @@ struct dm_rq_target_io {
 	unsigned long duration_jiffies;
 	unsigned n_sectors;
 	unsigned completed;
+	unsigned hctx_idx;
+};
+
+/*
+ * Per hardware queue dispatch counters of a blk-mq dm device, kept per
+ * cpu and summed when read through sysfs.
+ */
+struct dm_mq_hw_stats {
+	unsigned long dispatched;	/* clones handed to a path */
+	unsigned long busy;		/* requests bounced back to blk-mq */
+	unsigned long remote;		/* clones sent to a path on another node */
 };
 
 /*
@@ -63,5 +74,6 @@ unsigned dm_get_reserved_rq_based_ios(void);
 ssize_t dm_attr_rq_based_seq_io_merge_deadline_show(struct mapped_device *md, char *buf);
 ssize_t dm_attr_rq_based_seq_io_merge_deadline_store(struct mapped_device *md,
 						     const char *buf, size_t count);
+ssize_t dm_attr_mq_stats_show(struct mapped_device *md, char *buf);
 
 #endif
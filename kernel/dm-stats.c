@@ -8,6 +8,7 @@
 #include <linux/vmalloc.h>
 #include <linux/mm.h>
 #include <linux/module.h>
+#include <linux/log2.h>
 #include <linux/device-mapper.h>
 
 #include "dm-core.h"
@@ -38,6 +39,31 @@ struct dm_stat_shared {
 	struct dm_stat_percpu tmp;
 };
 
+/*
+ * Raw I/O samples of a region, written at completion into a ring per cpu.
+ * Only the owning cpu writes a ring, with interrupts off, and publishes a
+ * record by advancing head.  The reader (under stats->mutex) copies
+ * records behind head and rechecks head to drop any that got overwritten
+ * meanwhile.
+ */
+struct dm_stat_trace_record {
+	unsigned long long start_ns;
+	unsigned long long end_ns;
+	unsigned long long sector;
+	unsigned long rw;
+	unsigned sectors;
+};
+
+struct dm_stat_trace {
+	unsigned long long head;	/* next record to write */
+	unsigned long long tail;	/* next record to read */
+	unsigned long long lost;	/* overwritten before being read */
+	unsigned countdown;		/* completions until the next sample */
+	struct dm_stat_trace_record rec[0];
+};
+
+#define DM_STAT_TRACE_MAX_RECORDS	(1U << 20)
+
 struct dm_stat {
 	struct list_head list_entry;
 	int id;
@@ -54,6 +80,10 @@ struct dm_stat {
 	size_t shared_alloc_size;
 	size_t percpu_alloc_size;
 	size_t histogram_alloc_size;
+	unsigned trace_records;		/* per cpu, power of 2; 0 if off */
+	unsigned trace_sampling;	/* record 1 in trace_sampling I/Os */
+	size_t trace_alloc_size;
+	struct dm_stat_trace **trace;	/* nr_cpu_ids entries */
 	struct dm_stat_percpu *stat_percpu[NR_CPUS];
 	struct dm_stat_shared stat_shared[0];
 };
@@ -176,7 +206,10 @@ static void dm_stat_free(struct rcu_head *head)
 	for_each_possible_cpu(cpu) {
 		dm_kvfree(s->stat_percpu[cpu][0].histogram, s->histogram_alloc_size);
 		dm_kvfree(s->stat_percpu[cpu], s->percpu_alloc_size);
+		if (s->trace)
+			dm_kvfree(s->trace[cpu], s->trace_alloc_size);
 	}
+	kfree(s->trace);
 	dm_kvfree(s->stat_shared[0].tmp.histogram, s->histogram_alloc_size);
 	dm_kvfree(s, s->shared_alloc_size);
 }
@@ -233,6 +266,7 @@ static int dm_stats_create(struct dm_stats *stats, sector_t start, sector_t end,
 			   sector_t step, unsigned stat_flags,
 			   unsigned n_histogram_entries,
 			   unsigned long long *histogram_boundaries,
+			   unsigned trace_records, unsigned trace_sampling,
 			   const char *program_id, const char *aux_data,
 			   void (*suspend_callback)(struct mapped_device *),
 			   void (*resume_callback)(struct mapped_device *),
@@ -245,7 +279,9 @@ static int dm_stats_create(struct dm_stats *stats, sector_t start, sector_t end,
 	size_t shared_alloc_size;
 	size_t percpu_alloc_size;
 	size_t histogram_alloc_size;
+	size_t trace_alloc_size = 0;
 	struct dm_stat_percpu *p;
+	struct dm_stat_trace *t;
 	int cpu;
 	int ret_id;
 	int r;
@@ -272,8 +308,13 @@ static int dm_stats_create(struct dm_stats *stats, sector_t start, sector_t end,
 	if (histogram_alloc_size / (n_histogram_entries + 1) != (size_t)n_entries * sizeof(unsigned long long))
 		return -EOVERFLOW;
 
+	if (trace_records)
+		trace_alloc_size = sizeof(struct dm_stat_trace) +
+			(size_t)trace_records * sizeof(struct dm_stat_trace_record);
+
 	if (!check_shared_memory(shared_alloc_size + histogram_alloc_size +
-				 num_possible_cpus() * (percpu_alloc_size + histogram_alloc_size)))
+				 num_possible_cpus() * (percpu_alloc_size + histogram_alloc_size +
+							trace_alloc_size)))
 		return -ENOMEM;
 
 	s = dm_kvzalloc(shared_alloc_size, NUMA_NO_NODE);
@@ -288,6 +329,9 @@ static int dm_stats_create(struct dm_stats *stats, sector_t start, sector_t end,
 	s->shared_alloc_size = shared_alloc_size;
 	s->percpu_alloc_size = percpu_alloc_size;
 	s->histogram_alloc_size = histogram_alloc_size;
+	s->trace_records = trace_records;
+	s->trace_sampling = trace_sampling;
+	s->trace_alloc_size = trace_alloc_size;
 
 	s->n_histogram_entries = n_histogram_entries;
 	s->histogram_boundaries = kmemdup(histogram_boundaries,
@@ -347,6 +391,23 @@ static int dm_stats_create(struct dm_stats *stats, sector_t start, sector_t end,
 		}
 	}
 
+	if (s->trace_records) {
+		s->trace = kcalloc(nr_cpu_ids, sizeof(*s->trace), GFP_KERNEL);
+		if (!s->trace) {
+			r = -ENOMEM;
+			goto out;
+		}
+		for_each_possible_cpu(cpu) {
+			t = dm_kvzalloc(s->trace_alloc_size, cpu_to_node(cpu));
+			if (!t) {
+				r = -ENOMEM;
+				goto out;
+			}
+			t->countdown = 1;
+			s->trace[cpu] = t;
+		}
+	}
+
 	/*
 	 * Suspend/resume to make sure there is no i/o in flight,
 	 * so that newly created statistics will be exact.
@@ -423,7 +484,8 @@ static int dm_stats_delete(struct dm_stats *stats, int id)
 	 */
 	for_each_possible_cpu(cpu)
 		if (is_vmalloc_addr(s->stat_percpu) ||
-		    is_vmalloc_addr(s->stat_percpu[cpu][0].histogram))
+		    is_vmalloc_addr(s->stat_percpu[cpu][0].histogram) ||
+		    (s->trace && is_vmalloc_addr(s->trace[cpu])))
 			goto do_sync_free;
 	if (is_vmalloc_addr(s) ||
 	    is_vmalloc_addr(s->stat_shared[0].tmp.histogram)) {
@@ -470,6 +532,9 @@ static int dm_stats_list(struct dm_stats *stats, const char *program,
 					DMEMIT("%llu", s->histogram_boundaries[i]);
 				}
 			}
+			if (s->trace_records)
+				DMEMIT(" trace:%u trace_sampling:%u",
+				       s->trace_records, ACCESS_ONCE(s->trace_sampling));
 			DMEMIT("\n");
 		}
 	}
@@ -618,6 +683,34 @@ static void __dm_stat_bio(struct dm_stat *s, unsigned long bi_rw,
 	} while (unlikely(todo != 0));
 }
 
+static void dm_stat_trace_io(struct dm_stat *s, unsigned long bi_rw,
+			     sector_t bi_sector, unsigned bi_sectors,
+			     unsigned long long now_ns,
+			     struct dm_stats_aux *stats_aux)
+{
+	struct dm_stat_trace *t;
+	struct dm_stat_trace_record *rec;
+	unsigned long flags;
+
+	/* completions may come from process and interrupt context */
+	local_irq_save(flags);
+	t = s->trace[smp_processor_id()];
+	if (--t->countdown)
+		goto out;
+	t->countdown = ACCESS_ONCE(s->trace_sampling);
+
+	rec = &t->rec[t->head & (s->trace_records - 1)];
+	rec->start_ns = now_ns - stats_aux->duration_ns;
+	rec->end_ns = now_ns;
+	rec->sector = bi_sector;
+	rec->sectors = bi_sectors;
+	rec->rw = bi_rw;
+	smp_wmb();
+	ACCESS_ONCE(t->head) = t->head + 1;
+out:
+	local_irq_restore(flags);
+}
+
 void dm_stats_account_io(struct dm_stats *stats, unsigned long bi_rw,
 			 sector_t bi_sector, unsigned bi_sectors, bool end,
 			 unsigned long duration_jiffies,
@@ -627,6 +720,7 @@ void dm_stats_account_io(struct dm_stats *stats, unsigned long bi_rw,
 	sector_t end_sector;
 	struct dm_stats_last_position *last;
 	bool got_precise_time;
+	unsigned long long now_ns = 0;
 
 	if (unlikely(!bi_sectors))
 		return;
@@ -652,14 +746,20 @@ void dm_stats_account_io(struct dm_stats *stats, unsigned long bi_rw,
 
 	got_precise_time = false;
 	list_for_each_entry_rcu(s, &stats->list, list_entry) {
-		if (s->stat_flags & STAT_PRECISE_TIMESTAMPS && !got_precise_time) {
+		if ((s->stat_flags & STAT_PRECISE_TIMESTAMPS || s->trace_records) &&
+		    !got_precise_time) {
+			now_ns = ktime_to_ns(ktime_get());
 			if (!end)
-				stats_aux->duration_ns = ktime_to_ns(ktime_get());
+				stats_aux->duration_ns = now_ns;
 			else
-				stats_aux->duration_ns = ktime_to_ns(ktime_get()) - stats_aux->duration_ns;
+				stats_aux->duration_ns = now_ns - stats_aux->duration_ns;
 			got_precise_time = true;
 		}
 		__dm_stat_bio(s, bi_rw, bi_sector, end_sector, end, duration_jiffies, stats_aux);
+		if (s->trace_records && end &&
+		    end_sector > s->start && bi_sector < s->end)
+			dm_stat_trace_io(s, bi_rw, bi_sector, bi_sectors,
+					 now_ns, stats_aux);
 	}
 
 	rcu_read_unlock();
@@ -875,6 +975,107 @@ buffer_overflow:
 	return 1;
 }
 
+/*
+ * Move up to max_records trace records of a region into the result, in
+ * per cpu order.  Records only leave the rings once they have been
+ * emitted in full, so a short buffer just means more calls.
+ */
+static int dm_stats_trace(struct dm_stats *stats, int id, unsigned long max_records,
+			  char *result, unsigned maxlen)
+{
+	unsigned sz = 0, old_sz;
+	struct dm_stat *s;
+	struct dm_stat_trace *t;
+	struct dm_stat_trace_record rec;
+	unsigned long long head, lost = 0;
+	unsigned long n = 0;
+	int cpu;
+
+	/*
+	 * Output format:
+	 *   <cpu> <start_ns> <end_ns> <sector> <sectors> <R|W|D>
+	 *   ...
+	 *   lost: <records overwritten before they were read, ever>
+	 */
+
+	mutex_lock(&stats->mutex);
+
+	s = __dm_stats_find(stats, id);
+	if (!s) {
+		mutex_unlock(&stats->mutex);
+		return -ENOENT;
+	}
+	if (!s->trace_records) {
+		mutex_unlock(&stats->mutex);
+		return -EINVAL;
+	}
+
+	for_each_possible_cpu(cpu) {
+		t = s->trace[cpu];
+		head = ACCESS_ONCE(t->head);
+		while (t->tail != head && n < max_records) {
+			/* the slot at head may be being written right now */
+			if (head - t->tail >= s->trace_records) {
+				t->lost += head - t->tail - s->trace_records + 1;
+				t->tail = head - s->trace_records + 1;
+				continue;
+			}
+			smp_rmb();
+			rec = t->rec[t->tail & (s->trace_records - 1)];
+			smp_rmb();
+			head = ACCESS_ONCE(t->head);
+			if (head - t->tail >= s->trace_records)
+				continue;
+
+			old_sz = sz;
+			DMEMIT("%d %llu %llu %llu %u %c\n", cpu,
+			       rec.start_ns, rec.end_ns, rec.sector, rec.sectors,
+			       rec.rw & REQ_DISCARD ? 'D' :
+			       rec.rw & REQ_WRITE ? 'W' : 'R');
+			if (unlikely(sz + 1 >= maxlen)) {
+				result[old_sz] = '\0';
+				goto out;
+			}
+			t->tail++;
+			n++;
+		}
+		lost += t->lost;
+	}
+
+	old_sz = sz;
+	DMEMIT("lost: %llu\n", lost);
+	if (unlikely(sz + 1 >= maxlen))
+		result[old_sz] = '\0';
+out:
+	mutex_unlock(&stats->mutex);
+
+	return 1;
+}
+
+static int dm_stats_set_trace_sampling(struct dm_stats *stats, int id,
+				       unsigned sampling)
+{
+	struct dm_stat *s;
+
+	mutex_lock(&stats->mutex);
+
+	s = __dm_stats_find(stats, id);
+	if (!s) {
+		mutex_unlock(&stats->mutex);
+		return -ENOENT;
+	}
+	if (!s->trace_records) {
+		mutex_unlock(&stats->mutex);
+		return -EINVAL;
+	}
+
+	ACCESS_ONCE(s->trace_sampling) = sampling;
+
+	mutex_unlock(&stats->mutex);
+
+	return 0;
+}
+
 static int dm_stats_set_aux(struct dm_stats *stats, int id, const char *aux_data)
 {
 	struct dm_stat *s;
@@ -949,6 +1150,7 @@ static int message_stats_create(struct mapped_device *md,
 	unsigned divisor;
 	const char *program_id, *aux_data;
 	unsigned stat_flags = 0;
+	unsigned trace_records = 0, trace_sampling = 1;
 
 	unsigned n_histogram_entries = 0;
 	unsigned long long *histogram_boundaries = NULL;
@@ -1010,6 +1212,15 @@ static int message_stats_create(struct mapped_device *md,
 					goto ret_einval;
 				if ((r = parse_histogram(a + 10, &n_histogram_entries, &histogram_boundaries)))
 					goto ret;
+			} else if (!strncasecmp(a, "trace:", 6)) {
+				if (sscanf(a + 6, "%u%c", &trace_records, &dummy) != 1 ||
+				    !trace_records || trace_records > DM_STAT_TRACE_MAX_RECORDS)
+					goto ret_einval;
+				trace_records = roundup_pow_of_two(trace_records);
+			} else if (!strncasecmp(a, "trace_sampling:", 15)) {
+				if (sscanf(a + 15, "%u%c", &trace_sampling, &dummy) != 1 ||
+				    !trace_sampling)
+					goto ret_einval;
 			} else
 				goto ret_einval;
 		}
@@ -1044,7 +1255,8 @@ static int message_stats_create(struct mapped_device *md,
 	}
 
 	id = dm_stats_create(dm_get_stats(md), start, end, step, stat_flags,
-			     n_histogram_entries, histogram_boundaries, program_id, aux_data,
+			     n_histogram_entries, histogram_boundaries,
+			     trace_records, trace_sampling, program_id, aux_data,
 			     dm_internal_suspend_fast, dm_internal_resume_fast, md);
 	if (id < 0) {
 		r = id;
@@ -1143,6 +1355,46 @@ static int message_stats_print(struct mapped_device *md,
 			      result, maxlen);
 }
 
+static int message_stats_trace(struct mapped_device *md,
+			       unsigned argc, char **argv,
+			       char *result, unsigned maxlen)
+{
+	int id;
+	char dummy;
+	unsigned long max_records = ULONG_MAX;
+
+	if (argc != 2 && argc != 3)
+		return -EINVAL;
+
+	if (sscanf(argv[1], "%d%c", &id, &dummy) != 1 || id < 0)
+		return -EINVAL;
+
+	if (argc > 2 && strcmp(argv[2], "-") &&
+	    sscanf(argv[2], "%lu%c", &max_records, &dummy) != 1)
+		return -EINVAL;
+
+	return dm_stats_trace(dm_get_stats(md), id, max_records, result, maxlen);
+}
+
+static int message_stats_set_trace_sampling(struct mapped_device *md,
+					    unsigned argc, char **argv)
+{
+	int id;
+	unsigned sampling;
+	char dummy;
+
+	if (argc != 3)
+		return -EINVAL;
+
+	if (sscanf(argv[1], "%d%c", &id, &dummy) != 1 || id < 0)
+		return -EINVAL;
+
+	if (sscanf(argv[2], "%u%c", &sampling, &dummy) != 1 || !sampling)
+		return -EINVAL;
+
+	return dm_stats_set_trace_sampling(dm_get_stats(md), id, sampling);
+}
+
 static int message_stats_set_aux(struct mapped_device *md,
 				 unsigned argc, char **argv)
 {
@@ -1178,6 +1430,10 @@ int dm_stats_message(struct mapped_device *md, unsigned argc, char **argv,
 		r = message_stats_print(md, argc, argv, true, result, maxlen);
 	else if (!strcasecmp(argv[0], "@stats_set_aux"))
 		r = message_stats_set_aux(md, argc, argv);
+	else if (!strcasecmp(argv[0], "@stats_trace"))
+		r = message_stats_trace(md, argc, argv, result, maxlen);
+	else if (!strcasecmp(argv[0], "@stats_set_trace_sampling"))
+		r = message_stats_set_trace_sampling(md, argc, argv);
 	else
 		return 2; /* this wasn't a stats message */
 
@@ -101,6 +101,7 @@ static DM_ATTR_RO(name);
 static DM_ATTR_RO(uuid);
 static DM_ATTR_RO(suspended);
 static DM_ATTR_RO(use_blk_mq);
+static DM_ATTR_RO(mq_stats);
 static DM_ATTR_RW(rq_based_seq_io_merge_deadline);
 
 static struct attribute *dm_attrs[] = {
@@ -108,6 +109,7 @@ static struct attribute *dm_attrs[] = {
 	&dm_attr_uuid.attr,
 	&dm_attr_suspended.attr,
 	&dm_attr_use_blk_mq.attr,
+	&dm_attr_mq_stats.attr,
 	&dm_attr_rq_based_seq_io_merge_deadline.attr,
 	NULL,
 };
@@ -17,6 +17,7 @@
 #include <linux/slab.h>
 #include <linux/interrupt.h>
 #include <linux/mutex.h>
+#include <linux/prefetch.h>
 #include <linux/delay.h>
 #include <linux/atomic.h>
 #include <linux/blk-mq.h>
@@ -30,6 +31,15 @@
 #define KEYS_PER_NODE (NODE_SIZE / sizeof(sector_t))
 #define CHILDREN_PER_NODE (KEYS_PER_NODE + 1)
 
+/*
+ * Tables that need more than one btree node but whose highs still fit
+ * in L2 are indexed with a flat Eytzinger array instead of the btree.
+ * Past that every level of the binary descent misses, while the btree
+ * misses once per node.  See user/dm-table-bench.
+ */
+#define EYTZINGER_MIN_TARGETS (KEYS_PER_NODE + 1)
+#define EYTZINGER_MAX_TARGETS (128 * 1024)
+
 struct dm_table {
 	struct mapped_device *md;
 	enum dm_queue_mode type;
@@ -39,6 +49,14 @@ struct dm_table {
 	unsigned int counts[MAX_DEPTH];	/* in nodes */
 	sector_t *index[MAX_DEPTH];
 
+	/*
+	 * Eytzinger table for large tables: eyt_highs[1..num_targets] holds
+	 * the highs in breadth-first order of a complete binary search
+	 * tree, eyt_targets[] the matching target numbers.
+	 */
+	sector_t *eyt_highs;
+	unsigned int *eyt_targets;
+
 	unsigned int num_targets;
 	unsigned int num_allocated;
 	sector_t *highs;
@@ -241,6 +259,8 @@ void dm_table_destroy(struct dm_table *t)
 	/* free the indexes */
 	if (t->depth >= 2)
 		vfree(t->index[t->depth - 2]);
+	vfree(t->eyt_highs);
+	vfree(t->eyt_targets);
 
 	/* free the targets */
 	for (i = 0; i < t->num_targets; i++) {
@@ -1111,6 +1131,46 @@ static int setup_indexes(struct dm_table *t)
 	return 0;
 }
 
+/*
+ * In-order walk of the implicit tree, handing out the sorted highs.
+ */
+static void setup_eytzinger(struct dm_table *t, unsigned int *i,
+			    unsigned int k)
+{
+	if (k > t->num_targets)
+		return;
+
+	setup_eytzinger(t, i, 2 * k);
+	t->eyt_highs[k] = t->highs[*i];
+	t->eyt_targets[k] = (*i)++;
+	setup_eytzinger(t, i, 2 * k + 1);
+}
+
+/*
+ * A btree lookup touches one node per level but scans it linearly and
+ * computes child positions on the way.  While the table stays in cache
+ * a branch-free descent of an Eytzinger array, prefetching the cache
+ * line that holds the node's descendants a few levels down, is cheaper.
+ */
+static int build_eytzinger_index(struct dm_table *t)
+{
+	unsigned int i = 0;
+
+	/* vmalloc'ed, so eyt_highs[0] starts a cache line */
+	t->eyt_highs = dm_vcalloc(t->num_targets + 1, sizeof(sector_t));
+	t->eyt_targets = dm_vcalloc(t->num_targets + 1, sizeof(unsigned int));
+	if (!t->eyt_highs || !t->eyt_targets) {
+		vfree(t->eyt_highs);
+		vfree(t->eyt_targets);
+		t->eyt_highs = NULL;
+		t->eyt_targets = NULL;
+		return -ENOMEM;
+	}
+
+	setup_eytzinger(t, &i, 1);
+	return 0;
+}
+
 /*
  * Builds the btree to index the map.
  */
@@ -1119,6 +1179,10 @@ static int dm_table_build_index(struct dm_table *t)
 	int r = 0;
 	unsigned int leaf_nodes;
 
+	if (t->num_targets >= EYTZINGER_MIN_TARGETS &&
+	    t->num_targets <= EYTZINGER_MAX_TARGETS)
+		return build_eytzinger_index(t);
+
 	/* how many indexes will the btree have ? */
 	leaf_nodes = dm_div_up(t->num_targets, KEYS_PER_NODE);
 	t->depth = 1 + int_log(leaf_nodes, CHILDREN_PER_NODE);
@@ -1289,11 +1353,31 @@ struct dm_target *dm_table_get_target(struct dm_table *t, unsigned int index)
  * Caller should check returned pointer with dm_target_is_valid()
  * to trap I/O beyond end of device.
  */
+static struct dm_target *eytzinger_find_target(struct dm_table *t,
+						sector_t sector)
+{
+	sector_t *highs = t->eyt_highs;
+	unsigned int k = 1;
+
+	while (k <= t->num_targets) {
+		prefetch(highs + k * KEYS_PER_NODE);
+		k = 2 * k + (highs[k] < sector);
+	}
+	/* drop the right turns taken after the last left one */
+	k >>= ffs(~k);
+
+	/* past the end: the spare slot is an invalid target */
+	return &t->targets[k ? t->eyt_targets[k] : t->num_targets];
+}
+
 struct dm_target *dm_table_find_target(struct dm_table *t, sector_t sector)
 {
 	unsigned int l, n = 0, k = 0;
 	sector_t *node;
 
+	if (t->eyt_highs)
+		return eytzinger_find_target(t, sector);
+
 	for (l = 0; l < t->depth; l++) {
 		n = get_child(n, k);
 		node = get_node(t, l, n);
@@ -1306,6 +1390,30 @@ struct dm_target *dm_table_find_target(struct dm_table *t, sector_t sector)
 	return &t->targets[(KEYS_PER_NODE * n) + k];
 }
 
+/*
+ * Look up the targets covering [sector, sector + len), at most max of
+ * them.  Targets are contiguous and sorted, so only the first needs a
+ * search.  tis[0] is always set, possibly to an invalid target.
+ */
+unsigned int dm_table_find_targets(struct dm_table *t, sector_t sector,
+				   sector_t len, struct dm_target **tis,
+				   unsigned int max)
+{
+	struct dm_target *ti = dm_table_find_target(t, sector);
+	struct dm_target *last = t->targets + t->num_targets - 1;
+	unsigned int n = 0;
+
+	tis[n++] = ti;
+	if (!dm_target_is_valid(ti))
+		return n;
+
+	while (n < max && ti < last && ti->begin + ti->len < sector + len) {
+		prefetch(ti + 2);
+		tis[n++] = ++ti;
+	}
+	return n;
+}
+
 static int count_device(struct dm_target *ti, struct dm_dev *dev,
 			sector_t start, sector_t len, void *data)
 {
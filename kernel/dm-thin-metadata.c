@@ -133,6 +133,12 @@ struct thin_disk_superblock {
 	__le32 compat_flags;
 	__le32 compat_ro_flags;
 	__le32 incompat_flags;
+
+	/*
+	 * 2-level btree mapping (dev_id, dev block) -> partial mapping.
+	 * Zero until the first partial mapping is created.
+	 */
+	__le64 partial_mapping_root;
 } __packed;
 
 struct disk_device_details {
@@ -142,6 +148,15 @@ struct disk_device_details {
 	__le32 snapshotted_time;
 } __packed;
 
+/*
+ * A thin block whose data block only holds some of its sub-blocks.  The
+ * rest are still read from origin_block, which we hold a reference on.
+ */
+struct disk_partial_mapping {
+	__le64 origin_block;
+	__le64 valid;			/* bitmap of valid sub-blocks */
+} __packed;
+
 struct dm_pool_metadata {
 	struct hlist_node hash;
 
@@ -179,10 +194,19 @@ struct dm_pool_metadata {
 	 */
 	struct dm_btree_info details_info;
 
+	/*
+	 * Partial mappings, laid out like the mapping tree.
+	 */
+	struct dm_btree_info partial_info;
+	struct dm_btree_info nb_partial_info;
+	struct dm_btree_info partial_tl_info;
+	struct dm_btree_info partial_bl_info;
+
 	struct rw_semaphore root_lock;
 	uint32_t time;
 	dm_block_t root;
 	dm_block_t details_root;
+	dm_block_t partial_root;
 	struct list_head thin_devices;
 	uint64_t trans_id;
 	unsigned long flags;
@@ -372,6 +396,38 @@ static int subtree_equal(void *context, const void *value1_le, const void *value
 	return v1_le == v2_le;
 }
 
+static void partial_origin_inc(void *context, const void *value_le)
+{
+	struct dm_space_map *sm = context;
+	struct disk_partial_mapping v;
+
+	memcpy(&v, value_le, sizeof(v));
+	dm_sm_inc_block(sm, le64_to_cpu(v.origin_block));
+}
+
+static void partial_origin_dec(void *context, const void *value_le)
+{
+	struct dm_space_map *sm = context;
+	struct disk_partial_mapping v;
+
+	memcpy(&v, value_le, sizeof(v));
+	dm_sm_dec_block(sm, le64_to_cpu(v.origin_block));
+}
+
+/*
+ * Only the origin is reference counted, so updating the valid bitmap
+ * in place mustn't drop a reference.
+ */
+static int partial_origin_equal(void *context, const void *value1_le, const void *value2_le)
+{
+	struct disk_partial_mapping v1, v2;
+
+	memcpy(&v1, value1_le, sizeof(v1));
+	memcpy(&v2, value2_le, sizeof(v2));
+
+	return v1.origin_block == v2.origin_block;
+}
+
 /*----------------------------------------------------------------*/
 
 /*
@@ -479,6 +535,23 @@ static void __setup_btree_details(struct dm_pool_metadata *pmd)
 	pmd->details_info.value_type.inc = NULL;
 	pmd->details_info.value_type.dec = NULL;
 	pmd->details_info.value_type.equal = NULL;
+
+	pmd->partial_info.tm = pmd->tm;
+	pmd->partial_info.levels = 2;
+	pmd->partial_info.value_type.context = pmd->data_sm;
+	pmd->partial_info.value_type.size = sizeof(struct disk_partial_mapping);
+	pmd->partial_info.value_type.inc = partial_origin_inc;
+	pmd->partial_info.value_type.dec = partial_origin_dec;
+	pmd->partial_info.value_type.equal = partial_origin_equal;
+
+	memcpy(&pmd->nb_partial_info, &pmd->partial_info, sizeof(pmd->nb_partial_info));
+	pmd->nb_partial_info.tm = pmd->nb_tm;
+
+	memcpy(&pmd->partial_tl_info, &pmd->tl_info, sizeof(pmd->partial_tl_info));
+	pmd->partial_tl_info.value_type.context = &pmd->partial_bl_info;
+
+	memcpy(&pmd->partial_bl_info, &pmd->partial_info, sizeof(pmd->partial_bl_info));
+	pmd->partial_bl_info.levels = 1;
 }
 
 static int save_sm_roots(struct dm_pool_metadata *pmd)
@@ -769,6 +842,7 @@ static int __begin_transaction(struct dm_pool_metadata *pmd)
 	pmd->time = le32_to_cpu(disk_super->time);
 	pmd->root = le64_to_cpu(disk_super->data_mapping_root);
 	pmd->details_root = le64_to_cpu(disk_super->device_details_root);
+	pmd->partial_root = le64_to_cpu(disk_super->partial_mapping_root);
 	pmd->trans_id = le64_to_cpu(disk_super->trans_id);
 	pmd->flags = le32_to_cpu(disk_super->flags);
 	pmd->data_block_size = le32_to_cpu(disk_super->data_block_size);
@@ -852,6 +926,9 @@ static int __commit_transaction(struct dm_pool_metadata *pmd)
 	disk_super->device_details_root = cpu_to_le64(pmd->details_root);
 	disk_super->trans_id = cpu_to_le64(pmd->trans_id);
 	disk_super->flags = cpu_to_le32(pmd->flags);
+	disk_super->partial_mapping_root = cpu_to_le64(pmd->partial_root);
+	if (pmd->partial_root)
+		disk_super->incompat_flags |= cpu_to_le32(THIN_FEATURE_INCOMPAT_PARTIAL);
 
 	copy_sm_roots(pmd, disk_super);
 
@@ -1097,6 +1174,53 @@ static int __set_snapshot_details(struct dm_pool_metadata *pmd,
 	return 0;
 }
 
+/*
+ * A snapshot shares the origin's partial mappings in the same way as
+ * its mapping tree: the subtree is cloned by reference and the origin
+ * blocks are inc'd as the nodes get shadowed.
+ */
+static int __clone_partial_mappings(struct dm_pool_metadata *pmd,
+				    dm_thin_id dev, dm_thin_id origin)
+{
+	int r;
+	uint64_t key = origin;
+	dm_block_t origin_root;
+	__le64 value;
+
+	if (!pmd->partial_root)
+		return 0;
+
+	r = dm_btree_lookup(&pmd->partial_tl_info, pmd->partial_root, &key, &value);
+	if (r)
+		return r == -ENODATA ? 0 : r;
+	origin_root = le64_to_cpu(value);
+
+	dm_tm_inc(pmd->tm, origin_root);
+
+	value = cpu_to_le64(origin_root);
+	__dm_bless_for_disk(&value);
+	key = dev;
+	r = dm_btree_insert(&pmd->partial_tl_info, pmd->partial_root, &key, &value,
+			    &pmd->partial_root);
+	if (r)
+		dm_tm_dec(pmd->tm, origin_root);
+
+	return r;
+}
+
+static int __remove_partial_device(struct dm_pool_metadata *pmd, dm_thin_id dev)
+{
+	int r;
+	uint64_t key = dev;
+
+	if (!pmd->partial_root)
+		return 0;
+
+	r = dm_btree_remove(&pmd->partial_tl_info, pmd->partial_root, &key,
+			    &pmd->partial_root);
+	return r == -ENODATA ? 0 : r;
+}
+
 static int __create_snap(struct dm_pool_metadata *pmd,
 			 dm_thin_id dev, dm_thin_id origin)
 {
@@ -1134,6 +1258,10 @@ static int __create_snap(struct dm_pool_metadata *pmd,
 
 	pmd->time++;
 
+	r = __clone_partial_mappings(pmd, dev, origin);
+	if (r)
+		goto bad;
+
 	r = __open_device(pmd, dev, 1, &td);
 	if (r)
 		goto bad;
@@ -1147,6 +1275,7 @@ static int __create_snap(struct dm_pool_metadata *pmd,
 	return 0;
 
 bad:
+	__remove_partial_device(pmd, dev);
 	dm_btree_remove(&pmd->tl_info, pmd->root, &key, &pmd->root);
 	dm_btree_remove(&pmd->details_info, pmd->details_root,
 			&key, &pmd->details_root);
@@ -1194,7 +1323,7 @@ static int __delete_device(struct dm_pool_metadata *pmd, dm_thin_id dev)
 	if (r)
 		return r;
 
-	return 0;
+	return __remove_partial_device(pmd, dev);
 }
 
 int dm_pool_delete_thin_device(struct dm_pool_metadata *pmd,
@@ -1303,6 +1432,8 @@ static int __reserve_metadata_snap(struct dm_pool_metadata *pmd)
 	 */
 	dm_tm_inc(pmd->tm, le64_to_cpu(disk_super->data_mapping_root));
 	dm_tm_inc(pmd->tm, le64_to_cpu(disk_super->device_details_root));
+	if (le64_to_cpu(disk_super->partial_mapping_root))
+		dm_tm_inc(pmd->tm, le64_to_cpu(disk_super->partial_mapping_root));
 	dm_tm_unlock(pmd->tm, copy);
 
 	/*
@@ -1361,6 +1492,9 @@ static int __release_metadata_snap(struct dm_pool_metadata *pmd)
 	disk_super = dm_block_data(copy);
 	dm_btree_del(&pmd->info, le64_to_cpu(disk_super->data_mapping_root));
 	dm_btree_del(&pmd->details_info, le64_to_cpu(disk_super->device_details_root));
+	if (le64_to_cpu(disk_super->partial_mapping_root))
+		dm_btree_del(&pmd->partial_info,
+			     le64_to_cpu(disk_super->partial_mapping_root));
 	dm_sm_dec_block(pmd->metadata_sm, held_root);
 
 	dm_tm_unlock(pmd->tm, copy);
@@ -1503,6 +1637,61 @@ int dm_thin_find_block(struct dm_thin_device *td, dm_block_t block,
 	return r;
 }
 
+static int __find_partial(struct dm_thin_device *td, dm_block_t block,
+			  int can_issue_io, struct dm_thin_partial_result *result)
+{
+	int r;
+	struct disk_partial_mapping value;
+	struct dm_pool_metadata *pmd = td->pmd;
+	dm_block_t keys[2] = { td->id, block };
+	struct dm_btree_info *info;
+
+	if (!pmd->partial_root)
+		return -ENODATA;
+
+	if (can_issue_io)
+		info = &pmd->partial_info;
+	else
+		info = &pmd->nb_partial_info;
+
+	r = dm_btree_lookup(info, pmd->partial_root, keys, &value);
+	if (!r) {
+		result->origin = le64_to_cpu(value.origin_block);
+		result->valid = le64_to_cpu(value.valid);
+	}
+
+	return r;
+}
+
+int dm_thin_find_partial(struct dm_thin_device *td, dm_block_t block,
+			 int can_issue_io, struct dm_thin_partial_result *result)
+{
+	int r;
+	struct dm_pool_metadata *pmd = td->pmd;
+
+	down_read(&pmd->root_lock);
+	if (pmd->fail_io) {
+		up_read(&pmd->root_lock);
+		return -EINVAL;
+	}
+
+	r = __find_partial(td, block, can_issue_io, result);
+
+	up_read(&pmd->root_lock);
+	return r;
+}
+
+bool dm_pool_has_partial_mappings(struct dm_pool_metadata *pmd)
+{
+	bool r;
+
+	down_read(&pmd->root_lock);
+	r = pmd->partial_root != 0;
+	up_read(&pmd->root_lock);
+
+	return r;
+}
+
 static int __find_next_mapped_block(struct dm_thin_device *td, dm_block_t block,
 					  dm_block_t *vblock,
 					  struct dm_thin_lookup_result *result)
@@ -1606,14 +1795,130 @@ static int __insert(struct dm_thin_device *td, dm_block_t block,
 	return 0;
 }
 
+static int __remove_partial(struct dm_thin_device *td, dm_block_t block)
+{
+	int r;
+	struct dm_pool_metadata *pmd = td->pmd;
+	dm_block_t keys[2] = { td->id, block };
+
+	if (!pmd->partial_root)
+		return 0;
+
+	r = dm_btree_remove(&pmd->partial_info, pmd->partial_root, keys,
+			    &pmd->partial_root);
+	return r == -ENODATA ? 0 : r;
+}
+
+static int __insert_partial(struct dm_thin_device *td, dm_block_t block,
+			    dm_block_t origin, uint64_t valid)
+{
+	int r;
+	struct disk_partial_mapping value;
+	struct dm_pool_metadata *pmd = td->pmd;
+	dm_block_t keys[2] = { td->id, block };
+
+	if (!pmd->partial_root) {
+		r = dm_btree_empty(&pmd->partial_info, &pmd->partial_root);
+		if (r)
+			return r;
+	}
+
+	value.origin_block = cpu_to_le64(origin);
+	value.valid = cpu_to_le64(valid);
+	__dm_bless_for_disk(&value);
+
+	return dm_btree_insert(&pmd->partial_info, pmd->partial_root, keys,
+			       &value, &pmd->partial_root);
+}
+
+/*
+ * A full mapping replaces any partial one left for the block.
+ */
 int dm_thin_insert_block(struct dm_thin_device *td, dm_block_t block,
 			 dm_block_t data_block)
 {
 	int r = -EINVAL;
 
 	pmd_write_lock(td->pmd);
-	if (!td->pmd->fail_io)
+	if (!td->pmd->fail_io) {
 		r = __insert(td, block, data_block);
+		if (!r)
+			r = __remove_partial(td, block);
+	}
+	pmd_write_unlock(td->pmd);
+
+	return r;
+}
+
+static int __insert_partial_block(struct dm_thin_device *td, dm_block_t block,
+				  dm_block_t data_block, dm_block_t origin,
+				  uint64_t valid)
+{
+	int r;
+
+	r = __remove_partial(td, block);
+	if (r)
+		return r;
+
+	/*
+	 * Take the partial mapping's reference before the mapping tree
+	 * drops its own.
+	 */
+	r = dm_sm_inc_block(td->pmd->data_sm, origin);
+	if (r)
+		return r;
+
+	r = __insert_partial(td, block, origin, valid);
+	if (r)
+		return r;
+
+	return __insert(td, block, data_block);
+}
+
+int dm_thin_insert_partial_block(struct dm_thin_device *td, dm_block_t block,
+				 dm_block_t data_block, dm_block_t origin,
+				 uint64_t valid)
+{
+	int r = -EINVAL;
+
+	pmd_write_lock(td->pmd);
+	if (!td->pmd->fail_io)
+		r = __insert_partial_block(td, block, data_block, origin, valid);
+	pmd_write_unlock(td->pmd);
+
+	return r;
+}
+
+static int __set_partial_valid(struct dm_thin_device *td, dm_block_t block,
+			       uint64_t valid, uint64_t full)
+{
+	int r;
+	struct dm_thin_partial_result partial;
+
+	r = __find_partial(td, block, 1, &partial);
+	if (r)
+		return r;
+
+	partial.valid |= valid;
+	if ((partial.valid & full) == full)
+		r = __remove_partial(td, block);
+	else
+		r = __insert_partial(td, block, partial.origin, partial.valid);
+	if (r)
+		return r;
+
+	td->changed = 1;
+	return 0;
+}
+
+int dm_thin_set_partial_valid(struct dm_thin_device *td, dm_block_t block,
+			      uint64_t valid, uint64_t full)
+{
+	int r = -EINVAL;
+
+	pmd_write_lock(td->pmd);
+	if (!td->pmd->fail_io)
+		r = __set_partial_valid(td, block, valid, full);
 	pmd_write_unlock(td->pmd);
 
 	return r;
@@ -1629,12 +1934,65 @@ static int __remove(struct dm_thin_device *td, dm_block_t block)
 	if (r)
 		return r;
 
+	r = __remove_partial(td, block);
+	if (r)
+		return r;
+
 	td->mapped_blocks--;
 	td->changed = 1;
 
 	return 0;
 }
 
+static int __remove_partial_range(struct dm_thin_device *td,
+				  dm_block_t begin, dm_block_t end)
+{
+	int r;
+	unsigned count;
+	struct dm_pool_metadata *pmd = td->pmd;
+	dm_block_t keys[1] = { td->id };
+	struct disk_partial_mapping pvalue;
+	__le64 value;
+	dm_block_t partial_root;
+
+	if (!pmd->partial_root)
+		return 0;
+
+	r = dm_btree_lookup(&pmd->partial_tl_info, pmd->partial_root, keys, &value);
+	if (r)
+		return r == -ENODATA ? 0 : r;
+
+	partial_root = le64_to_cpu(value);
+	dm_tm_inc(pmd->tm, partial_root);
+	r = dm_btree_remove(&pmd->partial_tl_info, pmd->partial_root, keys,
+			    &pmd->partial_root);
+	if (r)
+		return r;
+
+	while (begin < end) {
+		r = dm_btree_lookup_next(&pmd->partial_bl_info, partial_root,
+					 &begin, &begin, &pvalue);
+		if (r == -ENODATA)
+			break;
+
+		if (r)
+			return r;
+
+		if (begin >= end)
+			break;
+
+		r = dm_btree_remove_leaves(&pmd->partial_bl_info, partial_root,
+					   &begin, end, &partial_root, &count);
+		if (r)
+			return r;
+	}
+
+	value = cpu_to_le64(partial_root);
+	__dm_bless_for_disk(&value);
+	return dm_btree_insert(&pmd->partial_tl_info, pmd->partial_root, keys,
+			       &value, &pmd->partial_root);
+}
+
 static int __remove_range(struct dm_thin_device *td, dm_block_t begin, dm_block_t end)
 {
 	int r;
@@ -1644,6 +2002,10 @@ static int __remove_range(struct dm_thin_device *td, dm_block_t begin, dm_block_
 	__le64 value;
 	dm_block_t mapping_root;
 
+	r = __remove_partial_range(td, begin, end);
+	if (r)
+		return r;
+
 	/*
 	 * Find the mapping tree
 	 */
@@ -1814,6 +2176,19 @@ int dm_pool_alloc_data_block(struct dm_pool_metadata *pmd, dm_block_t *result)
 	return r;
 }
 
+int dm_pool_alloc_data_block_near(struct dm_pool_metadata *pmd, dm_block_t hint,
+				  dm_block_t *result)
+{
+	int r = -EINVAL;
+
+	pmd_write_lock(pmd);
+	if (!pmd->fail_io)
+		r = dm_sm_new_block_near(pmd->data_sm, hint, result);
+	pmd_write_unlock(pmd);
+
+	return r;
+}
+
 int dm_pool_commit_metadata(struct dm_pool_metadata *pmd)
 {
 	int r = -EINVAL;
@@ -1839,6 +2214,20 @@ out:
 	return r;
 }
 
+/*
+ * Metadata blocks dirtied in this transaction are never referenced by
+ * the committed superblock, so they can be written out early.  Doing
+ * so without the root_lock held for write lets a following
+ * dm_pool_commit_metadata() hold it only for the tail of the flush.
+ */
+void dm_pool_pre_commit_metadata(struct dm_pool_metadata *pmd)
+{
+	down_read(&pmd->root_lock);
+	if (!pmd->fail_io && pmd->in_service)
+		dm_bm_start_flush(pmd->bm);
+	up_read(&pmd->root_lock);
+}
+
 static void __set_abort_with_changes_flags(struct dm_pool_metadata *pmd)
 {
 	struct dm_thin_device *td;
@@ -53,7 +53,12 @@ int dm_pool_metadata_close(struct dm_pool_metadata *pmd);
  */
 #define THIN_FEATURE_COMPAT_SUPP	  0UL
 #define THIN_FEATURE_COMPAT_RO_SUPP	  0UL
-#define THIN_FEATURE_INCOMPAT_SUPP	  0UL
+#define THIN_FEATURE_INCOMPAT_SUPP	  THIN_FEATURE_INCOMPAT_PARTIAL
+
+/*
+ * Set once partial mappings (sub-block copy-on-write) have been created.
+ */
+#define THIN_FEATURE_INCOMPAT_PARTIAL	  (1UL << 0)
 
 /*
  * Device creation/deletion.
@@ -83,6 +88,12 @@ int dm_pool_delete_thin_device(struct dm_pool_metadata *pmd,
  */
 int dm_pool_commit_metadata(struct dm_pool_metadata *pmd);
 
+/*
+ * Starts writing out the current transaction's metadata so a
+ * following commit has less to wait for.  Doesn't commit anything.
+ */
+void dm_pool_pre_commit_metadata(struct dm_pool_metadata *pmd);
+
 /*
  * Discards all uncommitted changes.  Rereads the superblock, rolling back
  * to the last good transaction.  Thin devices remain open.
@@ -146,6 +157,30 @@ struct dm_thin_lookup_result {
 int dm_thin_find_block(struct dm_thin_device *td, dm_block_t block,
 		       int can_issue_io, struct dm_thin_lookup_result *result);
 
+/*
+ * A partial mapping records which sub-blocks of a block's data block
+ * have been written since sharing was broken.  The others still have to
+ * be read from the origin data block.
+ */
+struct dm_thin_partial_result {
+	dm_block_t origin;
+	uint64_t valid;
+};
+
+/*
+ * Returns:
+ *   -EWOULDBLOCK iff @can_issue_io is set and would issue IO
+ *   -ENODATA iff the block has no partial mapping.
+ *   0 success
+ */
+int dm_thin_find_partial(struct dm_thin_device *td, dm_block_t block,
+			 int can_issue_io, struct dm_thin_partial_result *result);
+
+/*
+ * False if no partial mapping has ever been created in this pool.
+ */
+bool dm_pool_has_partial_mappings(struct dm_pool_metadata *pmd);
+
 /*
  * Retrieve the next run of contiguously mapped blocks.  Useful for working
  * out where to break up IO.  Returns 0 on success, < 0 on error.
@@ -160,12 +195,33 @@ int dm_thin_find_mapped_range(struct dm_thin_device *td,
  */
 int dm_pool_alloc_data_block(struct dm_pool_metadata *pmd, dm_block_t *result);
 
+/*
+ * As above, but prefer hint, or the next free block after it.
+ */
+int dm_pool_alloc_data_block_near(struct dm_pool_metadata *pmd, dm_block_t hint,
+				  dm_block_t *result);
+
 /*
  * Insert or remove block.
  */
 int dm_thin_insert_block(struct dm_thin_device *td, dm_block_t block,
 			 dm_block_t data_block);
 
+/*
+ * Maps @block to @data_block, but with only the sub-blocks in @valid
+ * present.  The rest are read from @origin until they are filled in.
+ */
+int dm_thin_insert_partial_block(struct dm_thin_device *td, dm_block_t block,
+				 dm_block_t data_block, dm_block_t origin,
+				 uint64_t valid);
+
+/*
+ * Marks more sub-blocks valid, dropping the partial mapping once all of
+ * @full are.
+ */
+int dm_thin_set_partial_valid(struct dm_thin_device *td, dm_block_t block,
+			      uint64_t valid, uint64_t full);
+
 int dm_thin_remove_block(struct dm_thin_device *td, dm_block_t block);
 int dm_thin_remove_range(struct dm_thin_device *td,
 			 dm_block_t begin, dm_block_t end);
@@ -21,6 +21,7 @@
 #include <linux/vmalloc.h>
 #include <linux/sort.h>
 #include <linux/rbtree.h>
+#include <linux/hash.h>
 
 #define	DM_MSG_PREFIX	"thin"
 
@@ -31,8 +32,35 @@
 #define MAPPING_POOL_SIZE 1024
 #define COMMIT_PERIOD HZ
 #define NO_SPACE_TIMEOUT_SECS 60
+#define MAX_POOL_WORKERS 64
+#define ALLOC_WINDOW_MB 64
+
+/*
+ * Commit latency histogram: bucket 0 is < 1ms, bucket i covers
+ * [2^(i-1), 2^i) ms and the last one everything slower.
+ */
+#define COMMIT_HIST_BUCKETS 12
+
+/*
+ * Deferred work is shared out between the thins of a worker in batches
+ * of at most FAIR_QUANTUM bios.  A bio costs its size in sectors plus
+ * FAIR_IO_COST, and a thin's virtual time advances by the cost scaled
+ * by THIN_WEIGHT_DEFAULT / weight.
+ */
+#define THIN_WEIGHT_DEFAULT 100
+#define THIN_WEIGHT_MAX 10000
+#define FAIR_QUANTUM 32
+#define FAIR_IO_COST 8
+#define FAIR_MAX_BATCHES 256
+
+/*
+ * A rate limited thin may burst for 1/CAP_BURST_DIV of a second.
+ */
+#define CAP_BURST_DIV 10
 
 static unsigned no_space_timeout_secs = NO_SPACE_TIMEOUT_SECS;
+static unsigned pool_workers = 1;
+static unsigned alloc_window_mb = ALLOC_WINDOW_MB;
 
 DECLARE_DM_KCOPYD_THROTTLE_WITH_MODULE_PARM(snapshot_copy_throttle,
 		"A percentage of time allocated for copy on write");
@@ -44,6 +72,12 @@ DECLARE_DM_KCOPYD_THROTTLE_WITH_MODULE_PARM(snapshot_copy_throttle,
 #define DATA_DEV_BLOCK_SIZE_MIN_SECTORS (64 * 1024 >> SECTOR_SHIFT)
 #define DATA_DEV_BLOCK_SIZE_MAX_SECTORS (1024 * 1024 * 1024 >> SECTOR_SHIFT)
 
+/*
+ * Sub-block copy-on-write splits a block into at most MAX_SUB_BLOCKS
+ * sub-blocks of at least the minimum block size.
+ */
+#define MAX_SUB_BLOCKS 64
+
 /*
  * Device id is restricted to 24 bits.
  */
@@ -217,6 +251,7 @@ struct pool_features {
 	bool discard_enabled:1;
 	bool discard_passdown:1;
 	bool error_if_no_space:1;
+	bool sub_block_cow:1;
 };
 
 struct thin_c;
@@ -226,6 +261,28 @@ typedef void (*process_mapping_fn)(struct dm_thin_new_mapping *m);
 
 #define CELL_SORT_ARRAY_SIZE 8192
 
+/*
+ * Deferred bios and cells of the thin devices are processed by
+ * pool->nr_workers workers, thins being sharded across them by dev_id.
+ * With a single worker this is done by the pool worker itself.
+ * Otherwise the pool worker keeps prepared mappings, discards and
+ * commits, so metadata updates and flush ordering stay on one ordered
+ * queue, and the thin workers run on pool->thin_wq.
+ */
+struct pool_worker {
+	struct pool *pool;
+	struct work_struct worker;
+
+	struct dm_thin_new_mapping *next_mapping;
+	struct dm_bio_prison_cell **cell_sort_array;
+
+	u64 runtime_ns;
+	unsigned long runs;
+
+	u64 vclock;			/* start time of the last batch */
+	struct delayed_work cap_waker;	/* for thins over their io caps */
+} ____cacheline_aligned_in_smp;
+
 struct pool {
 	struct list_head list;
 	struct dm_target *ti;	/* Only set if a pool target is bound */
@@ -237,6 +294,8 @@ struct pool {
 	dm_block_t low_water_blocks;
 	uint32_t sectors_per_block;
 	int sectors_per_block_shift;
+	unsigned nr_sub_blocks;		/* 0 if the block is too small */
+	uint32_t sub_block_sectors;
 
 	struct pool_features pf;
 	bool low_water_triggered:1;	/* A dm event has been sent */
@@ -249,6 +308,13 @@ struct pool {
 	struct workqueue_struct *wq;
 	struct throttle throttle;
 	struct work_struct worker;
+	struct workqueue_struct *thin_wq;	/* only if nr_workers > 1 */
+	unsigned nr_workers;
+	struct pool_worker *workers;
+	struct mutex alloc_lock;
+	dm_block_t alloc_window;	/* blocks reserved per thin, may be 0 */
+	dm_block_t alloc_cursor;	/* where the next window starts */
+	atomic_long_t commit_hist[COMMIT_HIST_BUCKETS];
 	struct delayed_work waker;
 	struct delayed_work no_space_timeout;
 
@@ -266,7 +332,6 @@ struct pool {
 	struct dm_deferred_set *shared_read_ds;
 	struct dm_deferred_set *all_io_ds;
 
-	struct dm_thin_new_mapping *next_mapping;
 	mempool_t *mapping_pool;
 
 	process_bio_fn process_bio;
@@ -278,8 +343,6 @@ struct pool {
 	process_mapping_fn process_prepared_mapping;
 	process_mapping_fn process_prepared_discard;
 	process_mapping_fn process_prepared_discard_pt2;
-
-	struct dm_bio_prison_cell **cell_sort_array;
 };
 
 static void metadata_operation_failed(struct pool *pool, const char *op, int r);
@@ -329,6 +392,50 @@ struct pool_c {
 	struct pool_features adjusted_pf;  /* Features used after adjusting for constituent devices */
 };
 
+/*
+ * Cache of recently resolved, unshared virtual -> data extents of a thin,
+ * looked up by thin_bio_map() under RCU only.  An extent never crosses a
+ * window of 2^THIN_EXTENT_WINDOW_SHIFT blocks and each window hashes to
+ * one slot, which holds the window's most recently extended extent.
+ * There are at most 2^THIN_CACHE_BITS slots, fewer for small thins, and
+ * the slot array is only allocated by the first insert so that idle
+ * thins don't pay for it.
+ *
+ * Entries are immutable; updaters serialise on the lock and replace
+ * them.  Blocks are only added or invalidated while their virtual cell
+ * is held, except for whole-cache invalidations (snapshot creation,
+ * transaction abort) which bump gen so lookups that raced with them are
+ * not inserted.
+ */
+#define THIN_CACHE_BITS 10
+#define THIN_EXTENT_WINDOW_SHIFT 6
+
+struct thin_extent {
+	struct rcu_head rcu;
+	dm_block_t virt_begin;
+	dm_block_t virt_end;	/* exclusive */
+	dm_block_t data_begin;
+};
+
+struct thin_cache_stats {
+	unsigned long hits;
+	unsigned long misses;
+};
+
+struct thin_lat_stats {
+	u64 ios;
+	u64 total_ns;
+	u64 max_ns;
+};
+
+struct thin_extent_cache {
+	spinlock_t lock;
+	unsigned gen;
+	unsigned bits;			/* log2 of the number of slots */
+	struct thin_cache_stats __percpu *stats;
+	struct thin_extent __rcu * __rcu *slots;
+};
+
 /*
  * Target context for a thin.
  */
@@ -340,10 +447,38 @@ struct thin_c {
 	dm_thin_id dev_id;
 
 	struct pool *pool;
+	struct pool_worker *worker;
 	struct dm_thin_device *td;
 	struct mapped_device *thin_md;
+	struct thin_extent_cache *cache;
+
+	/*
+	 * Allocation window and contiguity stats, protected by
+	 * pool->alloc_lock.
+	 */
+	dm_block_t alloc_next;
+	dm_block_t alloc_end;
+	dm_block_t last_alloc;
+	uint64_t alloc_blocks;
+	uint64_t alloc_extents;
+
+	/*
+	 * Fair queueing and io caps.  The limits are set by thin messages,
+	 * everything else is only touched by tc->worker.
+	 */
+	unsigned weight;
+	unsigned iops_limit;		/* ios per second, 0 is unlimited */
+	unsigned long bw_limit;		/* sectors per second, 0 is unlimited */
+	u64 vtime;
+	u64 batch_cost;
+	long long iops_tokens;		/* in 1/HZ ios */
+	long long bw_tokens;		/* in 1/HZ sectors */
+	unsigned long cap_refill;
+	unsigned sorted_left;		/* sorted bios at the head of the list */
+	struct thin_lat_stats __percpu *lat;
 
 	bool requeue_mode:1;
+	bool partials:1;		/* partial mappings may be present */
 	spinlock_t lock;
 	struct list_head deferred_cells;
 	struct bio_list deferred_bio_list;
@@ -360,6 +495,250 @@ struct thin_c {
 
 /*----------------------------------------------------------------*/
 
+/*
+ * nr_blocks is the size of the thin, which bounds the number of slots
+ * worth having.
+ */
+static struct thin_extent_cache *alloc_extent_cache(dm_block_t nr_blocks)
+{
+	struct thin_extent_cache *c = kzalloc(sizeof(*c), GFP_KERNEL);
+	dm_block_t windows = (nr_blocks >> THIN_EXTENT_WINDOW_SHIFT) + 1;
+
+	if (!c)
+		return NULL;
+
+	c->stats = alloc_percpu(struct thin_cache_stats);
+	if (!c->stats) {
+		kfree(c);
+		return NULL;
+	}
+	spin_lock_init(&c->lock);
+	c->bits = windows >= (1 << THIN_CACHE_BITS) ? THIN_CACHE_BITS :
+		max_t(unsigned, order_base_2(windows), 1);
+
+	return c;
+}
+
+static unsigned extent_cache_nr_slots(struct thin_extent_cache *c)
+{
+	return 1U << c->bits;
+}
+
+/*
+ * No lookups may be running any more.
+ */
+static void free_extent_cache(struct thin_extent_cache *c)
+{
+	struct thin_extent __rcu **slots;
+	unsigned i;
+
+	if (!c)
+		return;
+
+	slots = rcu_dereference_raw(c->slots);
+	if (slots) {
+		for (i = 0; i < extent_cache_nr_slots(c); i++)
+			kfree(rcu_dereference_raw(slots[i]));
+		kfree(slots);
+	}
+	free_percpu(c->stats);
+	kfree(c);
+}
+
+static struct thin_extent __rcu **extent_slot(struct thin_extent_cache *c,
+					      struct thin_extent __rcu **slots,
+					      dm_block_t window)
+{
+	return &slots[hash_64(window, c->bits)];
+}
+
+static unsigned extent_cache_gen(struct thin_extent_cache *c)
+{
+	unsigned gen = ACCESS_ONCE(c->gen);
+
+	/* read gen before looking up the metadata */
+	smp_rmb();
+	return gen;
+}
+
+static bool extent_cache_lookup(struct thin_extent_cache *c, dm_block_t block,
+				dm_block_t *data_block)
+{
+	struct thin_extent __rcu **slots;
+	struct thin_extent *e = NULL;
+	bool hit = false;
+
+	rcu_read_lock();
+	slots = rcu_dereference(c->slots);
+	if (slots)
+		e = rcu_dereference(*extent_slot(c, slots,
+						 block >> THIN_EXTENT_WINDOW_SHIFT));
+	if (e && block >= e->virt_begin && block < e->virt_end) {
+		*data_block = e->data_begin + (block - e->virt_begin);
+		hit = true;
+	}
+	rcu_read_unlock();
+
+	if (hit)
+		this_cpu_inc(c->stats->hits);
+	else
+		this_cpu_inc(c->stats->misses);
+
+	return hit;
+}
+
+/*
+ * Record an unshared mapping found in the metadata, extending the
+ * window's extent when it is contiguous with it.
+ */
+static void extent_cache_insert(struct thin_extent_cache *c, unsigned gen,
+				dm_block_t block, dm_block_t data_block)
+{
+	dm_block_t window = block >> THIN_EXTENT_WINDOW_SHIFT;
+	struct thin_extent __rcu **slots, **new_slots = NULL, **slot;
+	struct thin_extent *old, *new;
+	unsigned long flags;
+
+	if (!rcu_access_pointer(c->slots)) {
+		new_slots = kcalloc(extent_cache_nr_slots(c), sizeof(*new_slots),
+				    GFP_NOWAIT | __GFP_NOWARN);
+		if (!new_slots)
+			return;
+	}
+
+	new = kmalloc(sizeof(*new), GFP_NOWAIT | __GFP_NOWARN);
+	if (!new) {
+		kfree(new_slots);
+		return;
+	}
+
+	new->virt_begin = block;
+	new->virt_end = block + 1;
+	new->data_begin = data_block;
+
+	spin_lock_irqsave(&c->lock, flags);
+	if (c->gen != gen)
+		goto out_free;
+
+	slots = rcu_dereference_protected(c->slots, lockdep_is_held(&c->lock));
+	if (!slots) {
+		slots = new_slots;
+		new_slots = NULL;
+		rcu_assign_pointer(c->slots, slots);
+	}
+	slot = extent_slot(c, slots, window);
+
+	old = rcu_dereference_protected(*slot, lockdep_is_held(&c->lock));
+	if (old && (old->virt_begin >> THIN_EXTENT_WINDOW_SHIFT) == window) {
+		if (block >= old->virt_begin && block < old->virt_end)
+			goto out_free;
+
+		if (old->virt_end == block &&
+		    old->data_begin + (block - old->virt_begin) == data_block) {
+			new->virt_begin = old->virt_begin;
+			new->data_begin = old->data_begin;
+		} else if (old->virt_begin == block + 1 &&
+			   old->data_begin == data_block + 1)
+			new->virt_end = old->virt_end;
+	}
+
+	rcu_assign_pointer(*slot, new);
+	spin_unlock_irqrestore(&c->lock, flags);
+
+	if (old)
+		kfree_rcu(old, rcu);
+	kfree(new_slots);
+	return;
+
+out_free:
+	spin_unlock_irqrestore(&c->lock, flags);
+	kfree(new);
+	kfree(new_slots);
+}
+
+static void __extent_cache_drop(struct thin_extent_cache *c,
+				struct thin_extent __rcu **slot)
+{
+	struct thin_extent *e = rcu_dereference_protected(*slot, lockdep_is_held(&c->lock));
+
+	RCU_INIT_POINTER(*slot, NULL);
+	kfree_rcu(e, rcu);
+}
+
+static void extent_cache_invalidate_all(struct thin_extent_cache *c)
+{
+	struct thin_extent __rcu **slots;
+	unsigned long flags;
+	unsigned i;
+
+	spin_lock_irqsave(&c->lock, flags);
+	c->gen++;
+	slots = rcu_dereference_protected(c->slots, lockdep_is_held(&c->lock));
+	for (i = 0; slots && i < extent_cache_nr_slots(c); i++)
+		if (rcu_access_pointer(slots[i]))
+			__extent_cache_drop(c, &slots[i]);
+	spin_unlock_irqrestore(&c->lock, flags);
+}
+
+static void extent_cache_invalidate(struct thin_extent_cache *c,
+				    dm_block_t begin, dm_block_t end)
+{
+	dm_block_t window, last = (end - 1) >> THIN_EXTENT_WINDOW_SHIFT;
+	struct thin_extent __rcu **slots, **slot;
+	struct thin_extent *e;
+	unsigned long flags;
+
+	if (end <= begin || !rcu_access_pointer(c->slots))
+		return;
+
+	if (last - (begin >> THIN_EXTENT_WINDOW_SHIFT) >= extent_cache_nr_slots(c)) {
+		extent_cache_invalidate_all(c);
+		return;
+	}
+
+	spin_lock_irqsave(&c->lock, flags);
+	slots = rcu_dereference_protected(c->slots, lockdep_is_held(&c->lock));
+	for (window = begin >> THIN_EXTENT_WINDOW_SHIFT; window <= last; window++) {
+		slot = extent_slot(c, slots, window);
+		e = rcu_dereference_protected(*slot, lockdep_is_held(&c->lock));
+		if (e && e->virt_begin < end && e->virt_end > begin)
+			__extent_cache_drop(c, slot);
+	}
+	spin_unlock_irqrestore(&c->lock, flags);
+}
+
+static void extent_cache_stats(struct thin_extent_cache *c,
+			       unsigned long long *hits,
+			       unsigned long long *misses)
+{
+	struct thin_cache_stats *st;
+	int cpu;
+
+	*hits = *misses = 0;
+	for_each_possible_cpu(cpu) {
+		st = per_cpu_ptr(c->stats, cpu);
+		*hits += ACCESS_ONCE(st->hits);
+		*misses += ACCESS_ONCE(st->misses);
+	}
+}
+
+/*
+ * Drop the caches of every active thin with this dev_id, or of all of
+ * them if all is set.
+ */
+static void invalidate_thin_caches(struct pool *pool, dm_thin_id dev_id, bool all)
+{
+	struct thin_c *tc;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(tc, &pool->active_thins, list)
+		if (all || tc->dev_id == dev_id)
+			extent_cache_invalidate_all(tc->cache);
+	rcu_read_unlock();
+}
+
+/*----------------------------------------------------------------*/
+
 static struct bio *next_bio(struct bio *bio, int rw, unsigned int nr_pages,
 			    gfp_t gfp)
 {
@@ -536,6 +915,32 @@ static void wake_worker(struct pool *pool)
 	queue_work(pool->wq, &pool->worker);
 }
 
+static void wake_pool_worker(struct pool_worker *w)
+{
+	struct pool *pool = w->pool;
+
+	if (pool->nr_workers > 1)
+		queue_work(pool->thin_wq, &w->worker);
+	else
+		wake_worker(pool);
+}
+
+/*
+ * Used when bios or cells are deferred to a thin.
+ */
+static void wake_thin_worker(struct thin_c *tc)
+{
+	wake_pool_worker(tc->worker);
+}
+
+static void wake_thin_workers(struct pool *pool)
+{
+	unsigned i;
+
+	for (i = 0; i < pool->nr_workers; i++)
+		queue_work(pool->thin_wq, &pool->workers[i].worker);
+}
+
 /*----------------------------------------------------------------*/
 
 static int bio_detain(struct pool *pool, struct dm_cell_key *key, struct bio *bio,
@@ -682,6 +1087,8 @@ struct dm_thin_endio_hook {
 	struct dm_thin_new_mapping *overwrite_mapping;
 	struct rb_node rb_node;
 	struct dm_bio_prison_cell *cell;
+	ktime_t start;
+	bool charged;
 };
 
 static void __merge_bio_list(struct bio_list *bios, struct bio_list *master)
@@ -918,6 +1325,16 @@ struct dm_thin_new_mapping {
 	 */
 	struct bio *bio;
 	bio_end_io_t *saved_bi_end_io;
+
+	/*
+	 * Sub-block copy-on-write: the sub-blocks that become valid, and
+	 * whether this fills in an existing partial mapping rather than
+	 * creating one on partial_origin.
+	 */
+	bool partial:1;
+	bool partial_fill:1;
+	dm_block_t partial_origin;
+	uint64_t partial_valid;
 };
 
 static void __complete_mapping_preparation(struct dm_thin_new_mapping *m)
@@ -948,6 +1365,20 @@ static void copy_complete(int read_err, unsigned long write_err, void *context)
 	complete_mapping_preparation(m);
 }
 
+/*
+ * There may be several sub-block copies per mapping, so don't let a
+ * later success hide an earlier error.
+ */
+static void sub_block_copy_complete(int read_err, unsigned long write_err,
+				    void *context)
+{
+	struct dm_thin_new_mapping *m = context;
+
+	if (read_err || write_err)
+		m->err = -EIO;
+	complete_mapping_preparation(m);
+}
+
 static void overwrite_endio(struct bio *bio, int err)
 {
 	struct dm_thin_endio_hook *h = dm_per_bio_data(bio, sizeof(struct dm_thin_endio_hook));
@@ -982,7 +1413,21 @@ static void cell_defer_no_holder(struct thin_c *tc, struct dm_bio_prison_cell *c
 	cell_release_no_holder(pool, cell, &tc->deferred_bio_list);
 	spin_unlock_irqrestore(&tc->lock, flags);
 
-	wake_worker(pool);
+	wake_thin_worker(tc);
+}
+
+/*
+ * Sends the whole cell, holder included, back to be processed again.
+ */
+static void cell_redefer(struct thin_c *tc, struct dm_bio_prison_cell *cell)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&tc->lock, flags);
+	list_add_tail(&cell->user_list, &tc->deferred_cells);
+	spin_unlock_irqrestore(&tc->lock, flags);
+
+	wake_thin_worker(tc);
 }
 
 static void thin_defer_bio(struct thin_c *tc, struct bio *bio);
@@ -1081,6 +1526,52 @@ static void complete_overwrite_bio(struct thin_c *tc, struct bio *bio)
 	spin_unlock_irqrestore(&pool->lock, flags);
 }
 
+static uint64_t full_sub_block_mask(struct pool *pool)
+{
+	return pool->nr_sub_blocks == 64 ? ~0ULL : (1ULL << pool->nr_sub_blocks) - 1;
+}
+
+/*
+ * Partial mappings only change the sub-blocks the bios in the cell
+ * touch, so the other bios have to be looked at again.
+ */
+static void process_prepared_partial(struct dm_thin_new_mapping *m)
+{
+	struct thin_c *tc = m->tc;
+	struct pool *pool = tc->pool;
+	int r;
+
+	extent_cache_invalidate(tc->cache, m->virt_begin, m->virt_end);
+	if (m->partial_fill) {
+		r = dm_thin_set_partial_valid(tc->td, m->virt_begin, m->partial_valid,
+					      full_sub_block_mask(pool));
+		if (r) {
+			metadata_operation_failed(pool, "dm_thin_set_partial_valid", r);
+			cell_error(pool, m->cell);
+			return;
+		}
+
+		cell_redefer(tc, m->cell);
+		return;
+	}
+
+	r = dm_thin_insert_partial_block(tc->td, m->virt_begin, m->data_block,
+					 m->partial_origin, m->partial_valid);
+	if (r) {
+		metadata_operation_failed(pool, "dm_thin_insert_partial_block", r);
+		cell_error(pool, m->cell);
+		return;
+	}
+
+	if (m->bio)
+		complete_overwrite_bio(tc, m->bio);
+	else {
+		inc_all_io_entry(pool, m->cell->holder);
+		remap_and_issue(tc, m->cell->holder, m->data_block);
+	}
+	cell_defer_no_holder(tc, m->cell);
+}
+
 static void process_prepared_mapping(struct dm_thin_new_mapping *m)
 {
 	struct thin_c *tc = m->tc;
@@ -1093,11 +1584,17 @@ static void process_prepared_mapping(struct dm_thin_new_mapping *m)
 		goto out;
 	}
 
+	if (m->partial) {
+		process_prepared_partial(m);
+		goto out;
+	}
+
 	/*
 	 * Commit the prepared block into the mapping btree.
 	 * Any I/O for this block arriving after this point will get
 	 * remapped to it directly.
 	 */
+	extent_cache_invalidate(tc->cache, m->virt_begin, m->virt_begin + 1);
 	r = dm_thin_insert_block(tc->td, m->virt_begin, m->data_block);
 	if (r) {
 		metadata_operation_failed(pool, "dm_thin_insert_block", r);
@@ -1152,6 +1649,7 @@ static void process_prepared_discard_no_passdown(struct dm_thin_new_mapping *m)
 	int r;
 	struct thin_c *tc = m->tc;
 
+	extent_cache_invalidate(tc->cache, m->cell->key.block_begin, m->cell->key.block_end);
 	r = dm_thin_remove_range(tc->td, m->cell->key.block_begin, m->cell->key.block_end);
 	if (r) {
 		metadata_operation_failed(tc->pool, "dm_thin_remove_range", r);
@@ -1248,6 +1746,7 @@ static void process_prepared_discard_passdown_pt1(struct dm_thin_new_mapping *m)
 	 * newly unmapped blocks will not be allocated before the end of
 	 * the function.
 	 */
+	extent_cache_invalidate(tc->cache, m->virt_begin, m->virt_end);
 	r = dm_thin_remove_range(tc->td, m->virt_begin, m->virt_end);
 	if (r) {
 		metadata_operation_failed(pool, "dm_thin_remove_range", r);
@@ -1344,6 +1843,87 @@ static int io_overwrites_block(struct pool *pool, struct bio *bio)
 		io_overlaps_block(pool, bio);
 }
 
+/*
+ * The sub-blocks that a bio touches, and those that it writes
+ * completely.
+ */
+static void bio_sub_blocks(struct pool *pool, struct bio *bio,
+			   uint64_t *touched, uint64_t *covered)
+{
+	sector_t b = bio->bi_sector, e;
+	sector_t first, last;
+	uint32_t head, tail;
+
+	if (block_size_is_power_of_two(pool))
+		b &= pool->sectors_per_block - 1;
+	else
+		b = sector_div(b, pool->sectors_per_block);
+	e = b + (bio->bi_size >> SECTOR_SHIFT);
+
+	*touched = *covered = 0;
+	if (b == e)
+		return;
+
+	first = b;
+	head = sector_div(first, pool->sub_block_sectors);
+	last = e - 1;
+	tail = sector_div(last, pool->sub_block_sectors);
+
+	*touched = (last - first == 63 ? ~0ULL : (1ULL << (last - first + 1)) - 1) << first;
+
+	if (bio_data_dir(bio) == WRITE) {
+		*covered = *touched;
+		if (head)
+			*covered &= ~(1ULL << first);
+		if (tail != pool->sub_block_sectors - 1)
+			*covered &= ~(1ULL << last);
+	}
+}
+
+/*
+ * Copies each run of sub-blocks in @mask from one pool block to another,
+ * taking a prepare action per copy.
+ */
+static void copy_sub_blocks(struct thin_c *tc, struct dm_thin_new_mapping *m,
+			    dm_block_t from_block, dm_block_t to_block,
+			    uint64_t mask)
+{
+	int r;
+	unsigned i = 0, j;
+	struct pool *pool = tc->pool;
+	struct dm_io_region from, to;
+
+	while (i < pool->nr_sub_blocks) {
+		if (!(mask & (1ULL << i))) {
+			i++;
+			continue;
+		}
+
+		for (j = i + 1; j < pool->nr_sub_blocks && (mask & (1ULL << j)); j++)
+			;
+
+		from.bdev = tc->pool_dev->bdev;
+		from.sector = block_to_sectors(pool, from_block) +
+			(sector_t) i * pool->sub_block_sectors;
+		from.count = (sector_t) (j - i) * pool->sub_block_sectors;
+
+		to.bdev = tc->pool_dev->bdev;
+		to.sector = block_to_sectors(pool, to_block) +
+			(sector_t) i * pool->sub_block_sectors;
+		to.count = from.count;
+
+		atomic_inc(&m->prepare_actions);
+		r = dm_kcopyd_copy(pool->copier, &from, 1, &to, 0,
+				   sub_block_copy_complete, m);
+		if (r < 0) {
+			DMERR_LIMIT("dm_kcopyd_copy() failed");
+			sub_block_copy_complete(1, 1, m);
+		}
+
+		i = j;
+	}
+}
+
 static void save_and_set_endio(struct bio *bio, bio_end_io_t **save,
 			       bio_end_io_t *fn)
 {
@@ -1351,27 +1931,30 @@ static void save_and_set_endio(struct bio *bio, bio_end_io_t **save,
 	bio->bi_end_io = fn;
 }
 
-static int ensure_next_mapping(struct pool *pool)
+static int ensure_next_mapping(struct thin_c *tc)
 {
-	if (pool->next_mapping)
+	struct pool_worker *w = tc->worker;
+
+	if (w->next_mapping)
 		return 0;
 
-	pool->next_mapping = mempool_alloc(pool->mapping_pool, GFP_ATOMIC);
+	w->next_mapping = mempool_alloc(tc->pool->mapping_pool, GFP_ATOMIC);
 
-	return pool->next_mapping ? 0 : -ENOMEM;
+	return w->next_mapping ? 0 : -ENOMEM;
 }
 
-static struct dm_thin_new_mapping *get_next_mapping(struct pool *pool)
+static struct dm_thin_new_mapping *get_next_mapping(struct thin_c *tc)
 {
-	struct dm_thin_new_mapping *m = pool->next_mapping;
+	struct pool_worker *w = tc->worker;
+	struct dm_thin_new_mapping *m = w->next_mapping;
 
-	BUG_ON(!pool->next_mapping);
+	BUG_ON(!w->next_mapping);
 
 	memset(m, 0, sizeof(struct dm_thin_new_mapping));
 	INIT_LIST_HEAD(&m->list);
 	m->bio = NULL;
 
-	pool->next_mapping = NULL;
+	w->next_mapping = NULL;
 
 	return m;
 }
@@ -1418,7 +2001,7 @@ static void schedule_copy(struct thin_c *tc, dm_block_t virt_block,
 {
 	int r;
 	struct pool *pool = tc->pool;
-	struct dm_thin_new_mapping *m = get_next_mapping(pool);
+	struct dm_thin_new_mapping *m = get_next_mapping(tc);
 
 	m->tc = tc;
 	m->virt_begin = virt_block;
@@ -1492,12 +2075,87 @@ static void schedule_internal_copy(struct thin_c *tc, dm_block_t virt_block,
 		      tc->pool->sectors_per_block);
 }
 
+/*
+ * Breaks sharing of a block by copying just the sub-blocks the bio
+ * touches.  If it overwrites all of them there's nothing to copy, and
+ * the mapping is inserted once the write completes.
+ */
+static void schedule_partial_copy(struct thin_c *tc, dm_block_t virt_block,
+				  dm_block_t data_origin, dm_block_t data_dest,
+				  struct dm_bio_prison_cell *cell, struct bio *bio)
+{
+	struct pool *pool = tc->pool;
+	struct dm_thin_new_mapping *m = get_next_mapping(tc);
+	uint64_t touched, covered;
+
+	bio_sub_blocks(pool, bio, &touched, &covered);
+
+	m->tc = tc;
+	m->virt_begin = virt_block;
+	m->virt_end = virt_block + 1u;
+	m->data_block = data_dest;
+	m->cell = cell;
+	m->partial = true;
+	m->partial_origin = data_origin;
+	m->partial_valid = touched;
+
+	/* quiesce action + our reference */
+	atomic_set(&m->prepare_actions, 2);
+
+	if (!dm_deferred_set_add_work(pool->shared_read_ds, &m->list))
+		complete_mapping_preparation(m); /* already quiesced */
+
+	if (touched == covered) {
+		atomic_inc(&m->prepare_actions);
+		remap_and_issue_overwrite(tc, bio, data_dest, m);
+	} else
+		copy_sub_blocks(tc, m, data_origin, data_dest, touched);
+
+	complete_mapping_preparation(m); /* drop our ref */
+}
+
+/*
+ * Copies the @fill sub-blocks of a partial mapping in from its origin.
+ * The bios in @cell are processed again afterwards.
+ */
+static void schedule_partial_fill(struct thin_c *tc, dm_block_t virt_block,
+				  dm_block_t data_block,
+				  struct dm_thin_partial_result *partial,
+				  uint64_t fill, struct dm_bio_prison_cell *cell)
+{
+	struct pool *pool = tc->pool;
+	struct dm_thin_new_mapping *m = get_next_mapping(tc);
+
+	m->tc = tc;
+	m->virt_begin = virt_block;
+	m->virt_end = virt_block + 1u;
+	m->data_block = data_block;
+	m->cell = cell;
+	m->partial = true;
+	m->partial_fill = true;
+	m->partial_origin = partial->origin;
+	m->partial_valid = fill;
+
+	/*
+	 * The fill may drop the last reference to the origin, so wait for
+	 * reads that went there.
+	 */
+	atomic_set(&m->prepare_actions, 2);
+
+	if (!dm_deferred_set_add_work(pool->shared_read_ds, &m->list))
+		complete_mapping_preparation(m); /* already quiesced */
+
+	copy_sub_blocks(tc, m, partial->origin, data_block, fill);
+
+	complete_mapping_preparation(m); /* drop our ref */
+}
+
 static void schedule_zero(struct thin_c *tc, dm_block_t virt_block,
 			  dm_block_t data_block, struct dm_bio_prison_cell *cell,
 			  struct bio *bio)
 {
 	struct pool *pool = tc->pool;
-	struct dm_thin_new_mapping *m = get_next_mapping(pool);
+	struct dm_thin_new_mapping *m = get_next_mapping(tc);
 
 	atomic_set(&m->prepare_actions, 1); /* no need to quiesce */
 	m->tc = tc;
@@ -1593,6 +2251,14 @@ static void check_for_data_space(struct pool *pool)
 	}
 }
 
+static void account_commit(struct pool *pool, ktime_t start)
+{
+	unsigned long ms = ktime_to_ms(ktime_sub(ktime_get(), start));
+	unsigned bucket = ms ? min(ilog2(ms) + 1, COMMIT_HIST_BUCKETS - 1) : 0;
+
+	atomic_long_inc(&pool->commit_hist[bucket]);
+}
+
 /*
  * A non-zero return indicates read_only or fail_io mode.
  * Many callers don't care about the return value.
@@ -1600,14 +2266,25 @@ static void check_for_data_space(struct pool *pool)
 static int commit(struct pool *pool)
 {
 	int r;
+	ktime_t start;
 
 	if (get_pool_mode(pool) >= PM_OUT_OF_METADATA_SPACE)
 		return -EINVAL;
 
+	start = ktime_get();
 	r = dm_pool_commit_metadata(pool->pmd);
+	account_commit(pool, start);
 	if (r)
 		metadata_operation_failed(pool, "dm_pool_commit_metadata", r);
 	else {
+		/*
+		 * Without windows, restart the search at the front of the
+		 * data device each transaction, as the space map used to.
+		 * Thin workers may race with this unlocked store, but the
+		 * cursor is only a hint.
+		 */
+		if (!pool->alloc_window)
+			pool->alloc_cursor = 0;
 		check_for_metadata_space(pool);
 		check_for_data_space(pool);
 	}
@@ -1629,10 +2306,44 @@ static void check_low_water_mark(struct pool *pool, dm_block_t free_blocks)
 	}
 }
 
-static int alloc_data_block(struct thin_c *tc, dm_block_t *result)
+/*
+ * Each thin allocates from its own window of the data device, so
+ * concurrent writers to different thins do not interleave block by
+ * block.  A thin keeps extending its window while the blocks after
+ * its last allocation are free, and otherwise claims a fresh window at
+ * the pool's cursor.  Windows are only a hint: nothing is reserved in
+ * the space map, so an almost full pool still hands out every block.
+ */
+static dm_block_t alloc_hint(struct thin_c *tc)
+{
+	if (tc->alloc_next < tc->alloc_end)
+		return tc->alloc_next;
+
+	return tc->pool->alloc_cursor;
+}
+
+static void note_alloc(struct thin_c *tc, dm_block_t hint, dm_block_t b)
+{
+	struct pool *pool = tc->pool;
+
+	if (b != hint || tc->alloc_next >= tc->alloc_end) {
+		tc->alloc_end = b + pool->alloc_window;
+		/* don't move the cursor back over other thins' windows */
+		if (tc->alloc_end > pool->alloc_cursor || b < hint)
+			pool->alloc_cursor = tc->alloc_end;
+	}
+	tc->alloc_next = b + 1;
+
+	if (!tc->alloc_blocks || b != tc->last_alloc + 1)
+		tc->alloc_extents++;
+	tc->alloc_blocks++;
+	tc->last_alloc = b;
+}
+
+static int __alloc_data_block(struct thin_c *tc, dm_block_t *result)
 {
 	int r;
-	dm_block_t free_blocks;
+	dm_block_t free_blocks, hint;
 	struct pool *pool = tc->pool;
 
 	if (WARN_ON(get_pool_mode(pool) != PM_WRITE))
@@ -1667,14 +2378,16 @@ static int alloc_data_block(struct thin_c *tc, dm_block_t *result)
 		}
 	}
 
-	r = dm_pool_alloc_data_block(pool->pmd, result);
+	hint = alloc_hint(tc);
+	r = dm_pool_alloc_data_block_near(pool->pmd, hint, result);
 	if (r) {
 		if (r == -ENOSPC)
 			set_pool_mode(pool, PM_OUT_OF_DATA_SPACE);
 		else
-			metadata_operation_failed(pool, "dm_pool_alloc_data_block", r);
+			metadata_operation_failed(pool, "dm_pool_alloc_data_block_near", r);
 		return r;
 	}
+	note_alloc(tc, hint, *result);
 
 	r = dm_pool_get_free_metadata_block_count(pool->pmd, &free_blocks);
 	if (r) {
@@ -1692,6 +2405,22 @@ static int alloc_data_block(struct thin_c *tc, dm_block_t *result)
 	return 0;
 }
 
+/*
+ * Thin workers may allocate concurrently; keep the free space checks,
+ * the allocation and the mode changes they trigger together.
+ */
+static int alloc_data_block(struct thin_c *tc, dm_block_t *result)
+{
+	struct pool *pool = tc->pool;
+	int r;
+
+	mutex_lock(&pool->alloc_lock);
+	r = __alloc_data_block(tc, result);
+	mutex_unlock(&pool->alloc_lock);
+
+	return r;
+}
+
 /*
  * If we have run out of space, queue bios until the device is
  * resumed, presumably after having been reloaded with more space.
@@ -1764,7 +2493,7 @@ static void process_discard_cell_no_passdown(struct thin_c *tc,
 					     struct dm_bio_prison_cell *virt_cell)
 {
 	struct pool *pool = tc->pool;
-	struct dm_thin_new_mapping *m = get_next_mapping(pool);
+	struct dm_thin_new_mapping *m = get_next_mapping(tc);
 
 	/*
 	 * We don't need to lock the data blocks, since there's no
@@ -1793,7 +2522,7 @@ static void break_up_discard_bio(struct thin_c *tc, dm_block_t begin, dm_block_t
 	dm_block_t virt_begin, virt_end, data_begin;
 
 	while (begin != end) {
-		r = ensure_next_mapping(pool);
+		r = ensure_next_mapping(tc);
 		if (r)
 			/* we did our best */
 			return;
@@ -1818,7 +2547,7 @@ static void break_up_discard_bio(struct thin_c *tc, dm_block_t begin, dm_block_t
 		 * IO may still be going to the destination block.  We must
 		 * quiesce before we can do the removal.
 		 */
-		m = get_next_mapping(pool);
+		m = get_next_mapping(tc);
 		m->tc = tc;
 		m->maybe_shared = maybe_shared;
 		m->virt_begin = virt_begin;
@@ -1905,8 +2634,12 @@ static void break_sharing(struct thin_c *tc, struct bio *bio, dm_block_t block,
 	r = alloc_data_block(tc, &data_block);
 	switch (r) {
 	case 0:
-		schedule_internal_copy(tc, block, lookup_result->block,
-				       data_block, cell, bio);
+		if (pool->pf.sub_block_cow && !io_overwrites_block(pool, bio))
+			schedule_partial_copy(tc, block, lookup_result->block,
+					      data_block, cell, bio);
+		else
+			schedule_internal_copy(tc, block, lookup_result->block,
+					       data_block, cell, bio);
 		break;
 
 	case -ENOSPC:
@@ -2045,6 +2778,49 @@ static void provision_block(struct thin_c *tc, struct bio *bio, dm_block_t block
 	}
 }
 
+/*
+ * A bio to a block with a partial mapping.  Returns false if every
+ * sub-block it touches is valid, so it can be treated like any other
+ * bio to the data block.
+ *
+ * A write to a shared block fills in all the invalid sub-blocks first,
+ * so that sharing can then be broken as usual.  Otherwise reads that
+ * touch only invalid sub-blocks go to the origin, and anything else
+ * fills in the invalid sub-blocks it touches.
+ */
+static bool process_partial_bio(struct thin_c *tc, struct bio *bio,
+				dm_block_t block,
+				struct dm_thin_lookup_result *lookup_result,
+				struct dm_thin_partial_result *partial,
+				struct dm_bio_prison_cell *cell)
+{
+	struct pool *pool = tc->pool;
+	uint64_t touched, covered, fill;
+
+	bio_sub_blocks(pool, bio, &touched, &covered);
+
+	if (bio_data_dir(bio) == WRITE && bio->bi_size && lookup_result->shared)
+		fill = full_sub_block_mask(pool) & ~partial->valid;
+	else {
+		fill = touched & ~partial->valid;
+		if (!fill)
+			return false;
+
+		if (bio_data_dir(bio) == READ && fill == touched) {
+			struct dm_thin_endio_hook *h = dm_per_bio_data(bio, sizeof(struct dm_thin_endio_hook));
+
+			h->shared_read_entry = dm_deferred_entry_inc(pool->shared_read_ds);
+			inc_all_io_entry(pool, bio);
+			remap_and_issue(tc, bio, partial->origin);
+			cell_defer_no_holder(tc, cell);
+			return true;
+		}
+	}
+
+	schedule_partial_fill(tc, block, lookup_result->block, partial, fill, cell);
+	return true;
+}
+
 static void process_cell(struct thin_c *tc, struct dm_bio_prison_cell *cell)
 {
 	int r;
@@ -2052,6 +2828,7 @@ static void process_cell(struct thin_c *tc, struct dm_bio_prison_cell *cell)
 	struct bio *bio = cell->holder;
 	dm_block_t block = get_bio_block(tc, bio);
 	struct dm_thin_lookup_result lookup_result;
+	struct dm_thin_partial_result partial;
 
 	if (tc->requeue_mode) {
 		cell_requeue(pool, cell);
@@ -2059,6 +2836,23 @@ static void process_cell(struct thin_c *tc, struct dm_bio_prison_cell *cell)
 	}
 
 	r = dm_thin_find_block(tc->td, block, 1, &lookup_result);
+	if (!r && tc->partials) {
+		r = dm_thin_find_partial(tc->td, block, 1, &partial);
+		if (!r) {
+			if (process_partial_bio(tc, bio, block, &lookup_result,
+						&partial, cell))
+				return;
+		} else if (r == -ENODATA)
+			r = 0;
+		else {
+			DMERR_LIMIT("%s: dm_thin_find_partial() failed: error = %d",
+				    __func__, r);
+			cell_defer_no_holder(tc, cell);
+			bio_io_error(bio);
+			return;
+		}
+	}
+
 	switch (r) {
 	case 0:
 		if (lookup_result.shared)
@@ -2125,11 +2919,35 @@ static void __process_bio_read_only(struct thin_c *tc, struct bio *bio,
 	int rw = bio_data_dir(bio);
 	dm_block_t block = get_bio_block(tc, bio);
 	struct dm_thin_lookup_result lookup_result;
+	struct dm_thin_partial_result partial;
+	uint64_t touched, covered;
+	bool needs_fill = false;
 
 	r = dm_thin_find_block(tc->td, block, 1, &lookup_result);
+	if (!r && tc->partials) {
+		/*
+		 * Partial mappings can't be filled in without changing the
+		 * metadata, so all we can do is pick the block to read from.
+		 * A read that straddles valid and invalid sub-blocks needs
+		 * a fill, just like a write to a shared block.
+		 */
+		r = dm_thin_find_partial(tc->td, block, 1, &partial);
+		if (!r) {
+			bio_sub_blocks(tc->pool, bio, &touched, &covered);
+			if (!(touched & ~partial.valid))
+				; /* all in the data block */
+			else if (rw == READ && !(touched & partial.valid))
+				lookup_result.block = partial.origin;
+			else
+				needs_fill = true;
+		} else if (r == -ENODATA)
+			r = 0;
+	}
+
 	switch (r) {
 	case 0:
-		if (lookup_result.shared && (rw == WRITE) && bio->bi_size) {
+		if (needs_fill ||
+		    (lookup_result.shared && (rw == WRITE) && bio->bi_size)) {
 			handle_unserviceable_bio(tc->pool, bio);
 			if (cell)
 				cell_defer_no_holder(tc, cell);
@@ -2209,6 +3027,32 @@ static int need_commit_due_to_time(struct pool *pool)
 			      pool->last_commit_jiffies + COMMIT_PERIOD);
 }
 
+/*
+ * Are there bios waiting for a commit by the pool worker?
+ */
+static bool flush_bios_pending(struct pool *pool)
+{
+	bool r;
+	unsigned long flags;
+
+	spin_lock_irqsave(&pool->lock, flags);
+	r = !bio_list_empty(&pool->deferred_flush_bios) ||
+		!bio_list_empty(&pool->deferred_flush_completions);
+	spin_unlock_irqrestore(&pool->lock, flags);
+
+	return r;
+}
+
+/*
+ * Will process_deferred_bios() commit on this run of the worker?
+ */
+static bool commit_pending(struct pool *pool)
+{
+	return flush_bios_pending(pool) ||
+		(need_commit_due_to_time(pool) &&
+		 dm_pool_changed_this_transaction(pool->pmd));
+}
+
 #define thin_pbd(node) rb_entry((node), struct dm_thin_endio_hook, rb_node)
 #define thin_bio(pbd) dm_bio_from_per_bio_data((pbd), sizeof(struct dm_thin_endio_hook))
 
@@ -2273,7 +3117,95 @@ static void __sort_thin_deferred_bios(struct thin_c *tc)
 	__extract_sorted_bios(tc);
 }
 
-static void process_thin_deferred_bios(struct thin_c *tc)
+/*----------------------------------------------------------------
+ * Fair queueing and io caps
+ *--------------------------------------------------------------*/
+static bool thin_capped(struct thin_c *tc)
+{
+	return ACCESS_ONCE(tc->iops_limit) || ACCESS_ONCE(tc->bw_limit);
+}
+
+static void refill_tokens(long long *tokens, unsigned long limit,
+			  unsigned long elapsed)
+{
+	long long burst;
+
+	if (!limit)
+		return;
+
+	burst = max_t(long long, (long long) limit * HZ / CAP_BURST_DIV, HZ);
+	*tokens = min(*tokens + (long long) limit * elapsed, burst);
+}
+
+/*
+ * Token buckets count in 1/HZ units so that a refill every jiffy
+ * doesn't round low rates down to nothing.  A thin may issue io while
+ * both buckets are positive; the bio that empties one leaves a debt.
+ *
+ * Returns 0 if the thin may issue io, or the jiffies until it may.
+ */
+static unsigned long cap_wait(struct thin_c *tc)
+{
+	unsigned long iops = ACCESS_ONCE(tc->iops_limit);
+	unsigned long bw = ACCESS_ONCE(tc->bw_limit);
+	unsigned long now = jiffies, elapsed, wait = 0;
+
+	if (!iops && !bw)
+		return 0;
+
+	elapsed = min_t(unsigned long, now - tc->cap_refill, HZ);
+	tc->cap_refill = now;
+	refill_tokens(&tc->iops_tokens, iops, elapsed);
+	refill_tokens(&tc->bw_tokens, bw, elapsed);
+
+	if (iops && tc->iops_tokens <= 0)
+		wait = div64_u64(-tc->iops_tokens, iops) + 1;
+	if (bw && tc->bw_tokens <= 0)
+		wait = max_t(unsigned long, wait,
+			     div64_u64(-tc->bw_tokens, bw) + 1);
+
+	return wait;
+}
+
+/*
+ * Bios released from a cell were charged when they were first
+ * processed.
+ */
+static void charge_bio(struct thin_c *tc, struct bio *bio)
+{
+	struct dm_thin_endio_hook *h = dm_per_bio_data(bio, sizeof(struct dm_thin_endio_hook));
+	unsigned sectors = (bio->bi_rw & REQ_DISCARD) ? 0 : bio_sectors(bio);
+
+	if (h->charged)
+		return;
+	h->charged = true;
+
+	tc->batch_cost += sectors + FAIR_IO_COST;
+	if (ACCESS_ONCE(tc->iops_limit))
+		tc->iops_tokens -= HZ;
+	if (ACCESS_ONCE(tc->bw_limit))
+		tc->bw_tokens -= (long long) sectors * HZ;
+}
+
+static bool thin_has_work(struct thin_c *tc)
+{
+	return !bio_list_empty(&tc->deferred_bio_list) ||
+		!list_empty(&tc->deferred_cells);
+}
+
+static void do_cap_waker(struct work_struct *ws)
+{
+	struct pool_worker *w = container_of(to_delayed_work(ws), struct pool_worker,
+					     cap_waker);
+
+	wake_pool_worker(w);
+}
+
+/*
+ * Processes at most budget of the thin's deferred bios, leaving the
+ * rest at the head of the list.  Returns the number processed.
+ */
+static unsigned process_thin_deferred_bios(struct thin_c *tc, unsigned budget)
 {
 	struct pool *pool = tc->pool;
 	unsigned long flags;
@@ -2284,7 +3216,7 @@ static void process_thin_deferred_bios(struct thin_c *tc)
 
 	if (tc->requeue_mode) {
 		error_thin_bio_list(tc, &tc->deferred_bio_list, DM_ENDIO_REQUEUE);
-		return;
+		return 0;
 	}
 
 	bio_list_init(&bios);
@@ -2293,10 +3225,17 @@ static void process_thin_deferred_bios(struct thin_c *tc)
 
 	if (bio_list_empty(&tc->deferred_bio_list)) {
 		spin_unlock_irqrestore(&tc->lock, flags);
-		return;
+		return 0;
 	}
 
-	__sort_thin_deferred_bios(tc);
+	/*
+	 * A batch that was cut short left the rest of the sorted bios at
+	 * the head of the list, so only sort again once they run out.
+	 */
+	if (tc->sorted_left < budget) {
+		__sort_thin_deferred_bios(tc);
+		tc->sorted_left = bio_list_size(&tc->deferred_bio_list);
+	}
 
 	bio_list_merge(&bios, &tc->deferred_bio_list);
 	bio_list_init(&tc->deferred_bio_list);
@@ -2310,25 +3249,32 @@ static void process_thin_deferred_bios(struct thin_c *tc)
 		 * this bio might require one, we pause until there are some
 		 * prepared mappings to process.
 		 */
-		if (ensure_next_mapping(pool)) {
+		if (count >= budget || cap_wait(tc) || ensure_next_mapping(tc)) {
+			bio_list_add_head(&bios, bio);
 			spin_lock_irqsave(&tc->lock, flags);
-			bio_list_add(&tc->deferred_bio_list, bio);
-			bio_list_merge(&tc->deferred_bio_list, &bios);
+			bio_list_merge_head(&tc->deferred_bio_list, &bios);
 			spin_unlock_irqrestore(&tc->lock, flags);
 			break;
 		}
 
+		charge_bio(tc, bio);
 		if (bio->bi_rw & REQ_DISCARD)
 			pool->process_discard(tc, bio);
 		else
 			pool->process_bio(tc, bio);
 
 		if ((count++ & 127) == 0) {
-			throttle_work_update(&pool->throttle);
+			/* the throttle belongs to the pool worker */
+			if (pool->nr_workers == 1)
+				throttle_work_update(&pool->throttle);
 			dm_pool_issue_prefetches(pool->pmd);
 		}
 	}
 	blk_finish_plug(&plug);
+
+	tc->sorted_left = tc->sorted_left > count ? tc->sorted_left - count : 0;
+
+	return count;
 }
 
 static int cmp_cells(const void *lhs, const void *rhs)
@@ -2348,7 +3294,7 @@ static int cmp_cells(const void *lhs, const void *rhs)
 	return 0;
 }
 
-static unsigned sort_cells(struct pool *pool, struct list_head *cells)
+static unsigned sort_cells(struct pool_worker *w, struct list_head *cells)
 {
 	unsigned count = 0;
 	struct dm_bio_prison_cell *cell, *tmp;
@@ -2357,22 +3303,27 @@ static unsigned sort_cells(struct pool *pool, struct list_head *cells)
 		if (count >= CELL_SORT_ARRAY_SIZE)
 			break;
 
-		pool->cell_sort_array[count++] = cell;
+		w->cell_sort_array[count++] = cell;
 		list_del(&cell->user_list);
 	}
 
-	sort(pool->cell_sort_array, count, sizeof(cell), cmp_cells, NULL);
+	sort(w->cell_sort_array, count, sizeof(cell), cmp_cells, NULL);
 
 	return count;
 }
 
-static void process_thin_deferred_cells(struct thin_c *tc)
+/*
+ * Processes at most budget of the thin's deferred cells, leaving the
+ * rest at the head of the list.  Returns the number processed.
+ */
+static unsigned process_thin_deferred_cells(struct thin_c *tc, unsigned budget)
 {
 	struct pool *pool = tc->pool;
+	struct pool_worker *w = tc->worker;
 	unsigned long flags;
 	struct list_head cells;
 	struct dm_bio_prison_cell *cell;
-	unsigned i, j, count;
+	unsigned i, j, count, done = 0;
 
 	INIT_LIST_HEAD(&cells);
 
@@ -2381,13 +3332,13 @@ static void process_thin_deferred_cells(struct thin_c *tc)
 	spin_unlock_irqrestore(&tc->lock, flags);
 
 	if (list_empty(&cells))
-		return;
+		return 0;
 
 	do {
-		count = sort_cells(tc->pool, &cells);
+		count = sort_cells(w, &cells);
 
 		for (i = 0; i < count; i++) {
-			cell = pool->cell_sort_array[i];
+			cell = w->cell_sort_array[i];
 			BUG_ON(!cell->holder);
 
 			/*
@@ -2395,22 +3346,26 @@ static void process_thin_deferred_cells(struct thin_c *tc)
 			 * this bio might require one, we pause until there are some
 			 * prepared mappings to process.
 			 */
-			if (ensure_next_mapping(pool)) {
-				for (j = i; j < count; j++)
-					list_add(&pool->cell_sort_array[j]->user_list, &cells);
+			if (done >= budget || cap_wait(tc) || ensure_next_mapping(tc)) {
+				for (j = count; j > i; j--)
+					list_add(&w->cell_sort_array[j - 1]->user_list, &cells);
 
 				spin_lock_irqsave(&tc->lock, flags);
 				list_splice(&cells, &tc->deferred_cells);
 				spin_unlock_irqrestore(&tc->lock, flags);
-				return;
+				return done;
 			}
 
+			charge_bio(tc, cell->holder);
 			if (cell->holder->bi_rw & REQ_DISCARD)
 				pool->process_discard_cell(tc, cell);
 			else
 				pool->process_cell(tc, cell);
+			done++;
 		}
 	} while (!list_empty(&cells));
+
+	return done;
 }
 
 static void thin_get(struct thin_c *tc);
@@ -2452,19 +3407,96 @@ static struct thin_c *get_next_thin(struct pool *pool, struct thin_c *tc)
 	return NULL;
 }
 
+/*
+ * Processes the deferred work of the thins served by a worker in
+ * batches, each time picking the thin with the smallest virtual time.
+ * Backlogged thins so get worker time in proportion to their weights.
+ * A thin that was idle starts again from the worker's clock, rather
+ * than cashing in the time it didn't use.
+ */
+static void process_thins(struct pool *pool, struct pool_worker *w)
+{
+	struct thin_c *tc, *next;
+	unsigned long wait, min_wait;
+	unsigned done, batches = 0;
+	u64 start, next_start = 0;
+
+	do {
+		next = NULL;
+		min_wait = 0;
+
+		rcu_read_lock();
+		list_for_each_entry_rcu(tc, &pool->active_thins, list) {
+			if (tc->worker != w || !thin_has_work(tc))
+				continue;
+
+			wait = cap_wait(tc);
+			if (wait) {
+				if (!min_wait || wait < min_wait)
+					min_wait = wait;
+				continue;
+			}
+
+			start = max(tc->vtime, w->vclock);
+			if (!next || start < next_start) {
+				next = tc;
+				next_start = start;
+			}
+		}
+		if (next)
+			thin_get(next);
+		rcu_read_unlock();
+
+		if (!next)
+			break;
+
+		next->batch_cost = 0;
+		done = process_thin_deferred_cells(next, FAIR_QUANTUM);
+		if (done < FAIR_QUANTUM)
+			done += process_thin_deferred_bios(next, FAIR_QUANTUM - done);
+
+		w->vclock = next_start;
+		next->vtime = next_start +
+			div_u64(next->batch_cost * THIN_WEIGHT_DEFAULT,
+				ACCESS_ONCE(next->weight));
+
+		/*
+		 * Out of mappings; the pool worker wakes us once prepared
+		 * mappings have been processed.
+		 */
+		if (!done && thin_has_work(next)) {
+			thin_put(next);
+			break;
+		}
+		thin_put(next);
+
+		if (++batches == FAIR_MAX_BATCHES) {
+			/* let the pool worker get at the prepared mappings */
+			wake_pool_worker(w);
+			break;
+		}
+	} while (true);
+
+	if (min_wait)
+		mod_delayed_work(pool->wq, &w->cap_waker, min_wait);
+}
+
+static void cancel_cap_wakers(struct pool *pool)
+{
+	unsigned i;
+
+	for (i = 0; i < pool->nr_workers; i++)
+		cancel_delayed_work_sync(&pool->workers[i].cap_waker);
+}
+
 static void process_deferred_bios(struct pool *pool)
 {
 	unsigned long flags;
 	struct bio *bio;
 	struct bio_list bios, bio_completions;
-	struct thin_c *tc;
 
-	tc = get_first_thin(pool);
-	while (tc) {
-		process_thin_deferred_cells(tc);
-		process_thin_deferred_bios(tc);
-		tc = get_next_thin(pool, tc);
-	}
+	if (pool->nr_workers == 1)
+		process_thins(pool, &pool->workers[0]);
 
 	/*
 	 * If there are any deferred flush bios, we must commit the metadata
@@ -2507,6 +3539,13 @@ static void do_worker(struct work_struct *ws)
 
 	throttle_work_start(&pool->throttle);
 	dm_pool_issue_prefetches(pool->pmd);
+
+	/*
+	 * Overlap the metadata writeback with the work below, so that the
+	 * commit at the end only waits for the blocks it dirtied.
+	 */
+	if (get_pool_mode(pool) == PM_WRITE && commit_pending(pool))
+		dm_pool_pre_commit_metadata(pool->pmd);
 	throttle_work_update(&pool->throttle);
 	process_prepared(pool, &pool->prepared_mappings, &pool->process_prepared_mapping);
 	throttle_work_update(&pool->throttle);
@@ -2516,6 +3555,33 @@ static void do_worker(struct work_struct *ws)
 	throttle_work_update(&pool->throttle);
 	process_deferred_bios(pool);
 	throttle_work_complete(&pool->throttle);
+
+	/*
+	 * Prepared mappings may have released cells, or returned the
+	 * mappings that thin workers were waiting for.
+	 */
+	if (pool->nr_workers > 1)
+		wake_thin_workers(pool);
+}
+
+static void do_thin_worker(struct work_struct *ws)
+{
+	struct pool_worker *w = container_of(ws, struct pool_worker, worker);
+	struct pool *pool = w->pool;
+	ktime_t start = ktime_get();
+
+	dm_pool_issue_prefetches(pool->pmd);
+	process_thins(pool, w);
+
+	/*
+	 * FLUSH/FUA bios, and overwrites completed here, wait for the pool
+	 * worker's commit; don't leave them for the periodic waker.
+	 */
+	if (flush_bios_pending(pool))
+		wake_worker(pool);
+
+	w->runtime_ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+	w->runs++;
 }
 
 /*
@@ -2588,6 +3654,8 @@ static void do_noflush_start(struct work_struct *ws)
 {
 	struct noflush_work *w = to_noflush(ws);
 	w->tc->requeue_mode = true;
+	if (w->tc->pool->nr_workers > 1)
+		flush_work(&w->tc->worker->worker);
 	requeue_io(w->tc);
 	pool_work_complete(&w->pw);
 }
@@ -2731,11 +3799,18 @@ static void abort_transaction(struct pool *pool)
 	const char *dev_name = dm_device_name(pool->pool_md);
 
 	DMERR_LIMIT("%s: aborting current metadata transaction", dev_name);
+	invalidate_thin_caches(pool, 0, true);
 	if (dm_pool_abort_metadata(pool->pmd)) {
 		DMERR("%s: failed to abort metadata transaction", dev_name);
 		set_pool_mode(pool, PM_FAIL);
 	}
 
+	/*
+	 * Lookups that ran during the abort may have cached mappings it
+	 * rolled back, under the new generation.
+	 */
+	invalidate_thin_caches(pool, 0, true);
+
 	if (dm_pool_metadata_set_needs_check(pool->pmd)) {
 		DMERR("%s: failed to set 'needs_check' flag in metadata", dev_name);
 		set_pool_mode(pool, PM_FAIL);
@@ -2769,7 +3844,7 @@ static void thin_defer_bio(struct thin_c *tc, struct bio *bio)
 	bio_list_add(&tc->deferred_bio_list, bio);
 	spin_unlock_irqrestore(&tc->lock, flags);
 
-	wake_worker(pool);
+	wake_thin_worker(tc);
 }
 
 static void thin_defer_bio_with_throttle(struct thin_c *tc, struct bio *bio)
@@ -2792,7 +3867,7 @@ static void thin_defer_cell(struct thin_c *tc, struct dm_bio_prison_cell *cell)
 	spin_unlock_irqrestore(&tc->lock, flags);
 	throttle_unlock(&pool->throttle);
 
-	wake_worker(pool);
+	wake_thin_worker(tc);
 }
 
 static void thin_hook_bio(struct thin_c *tc, struct bio *bio)
@@ -2804,6 +3879,8 @@ static void thin_hook_bio(struct thin_c *tc, struct bio *bio)
 	h->all_io_entry = NULL;
 	h->overwrite_mapping = NULL;
 	h->cell = NULL;
+	h->start = ktime_get();
+	h->charged = false;
 }
 
 /*
@@ -2818,6 +3895,7 @@ static int thin_bio_map(struct dm_target *ti, struct bio *bio)
 	struct dm_thin_lookup_result result;
 	struct dm_bio_prison_cell *virt_cell, *data_cell;
 	struct dm_cell_key key;
+	unsigned gen;
 
 	thin_hook_bio(tc, bio);
 
@@ -2831,7 +3909,11 @@ static int thin_bio_map(struct dm_target *ti, struct bio *bio)
 		return DM_MAPIO_SUBMITTED;
 	}
 
-	if (bio->bi_rw & (REQ_DISCARD | REQ_FLUSH | REQ_FUA)) {
+	/*
+	 * io caps are enforced by the worker, so rate limited thins give
+	 * up on the fast path.
+	 */
+	if ((bio->bi_rw & (REQ_DISCARD | REQ_FLUSH | REQ_FUA)) || thin_capped(tc)) {
 		thin_defer_bio_with_throttle(tc, bio);
 		return DM_MAPIO_SUBMITTED;
 	}
@@ -2844,7 +3926,25 @@ static int thin_bio_map(struct dm_target *ti, struct bio *bio)
 	if (bio_detain(tc->pool, &key, bio, &virt_cell))
 		return DM_MAPIO_SUBMITTED;
 
-	r = dm_thin_find_block(td, block, 0, &result);
+	gen = extent_cache_gen(tc->cache);
+	if (extent_cache_lookup(tc->cache, block, &result.block)) {
+		result.shared = false;
+		r = 0;
+	} else {
+		r = dm_thin_find_block(td, block, 0, &result);
+		if (!r && !result.shared && tc->partials) {
+			struct dm_thin_partial_result partial;
+
+			/* the worker deals with partial mappings */
+			r = dm_thin_find_partial(td, block, 0, &partial);
+			if (r == -ENODATA)
+				r = 0;
+			else if (!r)
+				r = -EWOULDBLOCK;
+		}
+		if (!r && !result.shared)
+			extent_cache_insert(tc->cache, gen, block, result.block);
+	}
 
 	/*
 	 * Note that we defer readahead too.
@@ -3012,24 +4112,73 @@ static void pool_features_init(struct pool_features *pf)
 	pf->discard_enabled = true;
 	pf->discard_passdown = true;
 	pf->error_if_no_space = false;
+	pf->sub_block_cow = false;
+}
+
+static unsigned calc_nr_sub_blocks(unsigned long block_size)
+{
+	unsigned nr = min_t(unsigned long, block_size / DATA_DEV_BLOCK_SIZE_MIN_SECTORS,
+			    MAX_SUB_BLOCKS);
+
+	return nr < 2 ? 0 : nr;
+}
+
+static void free_pool_workers(struct pool *pool)
+{
+	struct pool_worker *w;
+	unsigned i;
+
+	for (i = 0; i < pool->nr_workers; i++) {
+		w = &pool->workers[i];
+		if (w->next_mapping)
+			mempool_free(w->next_mapping, pool->mapping_pool);
+		vfree(w->cell_sort_array);
+	}
+	kfree(pool->workers);
+}
+
+static int alloc_pool_workers(struct pool *pool, unsigned nr_workers)
+{
+	struct pool_worker *w;
+	unsigned i;
+
+	pool->workers = kcalloc(nr_workers, sizeof(*pool->workers), GFP_KERNEL);
+	if (!pool->workers)
+		return -ENOMEM;
+	pool->nr_workers = nr_workers;
+
+	for (i = 0; i < nr_workers; i++) {
+		w = &pool->workers[i];
+		w->pool = pool;
+		INIT_WORK(&w->worker, do_thin_worker);
+		INIT_DELAYED_WORK(&w->cap_waker, do_cap_waker);
+		w->cell_sort_array = vmalloc(sizeof(*w->cell_sort_array) * CELL_SORT_ARRAY_SIZE);
+		if (!w->cell_sort_array) {
+			free_pool_workers(pool);
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
 }
 
 static void __pool_destroy(struct pool *pool)
 {
 	__pool_table_remove(pool);
 
-	vfree(pool->cell_sort_array);
 	if (dm_pool_metadata_close(pool->pmd) < 0)
 		DMWARN("%s: dm_pool_metadata_close() failed.", __func__);
 
 	dm_bio_prison_destroy(pool->prison);
 	dm_kcopyd_client_destroy(pool->copier);
 
+	cancel_cap_wakers(pool);
+	if (pool->thin_wq)
+		destroy_workqueue(pool->thin_wq);
 	if (pool->wq)
 		destroy_workqueue(pool->wq);
 
-	if (pool->next_mapping)
-		mempool_free(pool->next_mapping, pool->mapping_pool);
+	free_pool_workers(pool);
 	mempool_destroy(pool->mapping_pool);
 	dm_deferred_set_destroy(pool->shared_read_ds);
 	dm_deferred_set_destroy(pool->all_io_ds);
@@ -3044,10 +4193,13 @@ static struct pool *pool_create(struct mapped_device *pool_md,
 				int read_only, char **error)
 {
 	int r;
+	unsigned i;
 	void *err_p;
 	struct pool *pool;
 	struct dm_pool_metadata *pmd;
 	bool format_device = read_only ? false : true;
+	unsigned nr_workers = clamp_t(unsigned, ACCESS_ONCE(pool_workers),
+				      1, MAX_POOL_WORKERS);
 
 	pmd = dm_pool_metadata_open(metadata_dev, block_size, format_device);
 	if (IS_ERR(pmd)) {
@@ -3068,7 +4220,13 @@ static struct pool *pool_create(struct mapped_device *pool_md,
 		pool->sectors_per_block_shift = -1;
 	else
 		pool->sectors_per_block_shift = __ffs(block_size);
+	pool->nr_sub_blocks = calc_nr_sub_blocks(block_size);
+	pool->sub_block_sectors = pool->nr_sub_blocks ?
+		block_size / pool->nr_sub_blocks : block_size;
 	pool->low_water_blocks = 0;
+	pool->alloc_window = div_u64((u64) ACCESS_ONCE(alloc_window_mb) <<
+				     (20 - SECTOR_SHIFT), block_size);
+	pool->alloc_cursor = 0;
 	pool_features_init(&pool->pf);
 	pool->prison = dm_bio_prison_create();
 	if (!pool->prison) {
@@ -3096,7 +4254,24 @@ static struct pool *pool_create(struct mapped_device *pool_md,
 		goto bad_wq;
 	}
 
+	/*
+	 * The thin workers, if any, run concurrently.
+	 */
+	pool->thin_wq = NULL;
+	if (nr_workers > 1) {
+		pool->thin_wq = alloc_workqueue("dm-" DM_MSG_PREFIX "-thin",
+						WQ_MEM_RECLAIM | WQ_UNBOUND, nr_workers);
+		if (!pool->thin_wq) {
+			*error = "Error creating pool's thin workqueue";
+			err_p = ERR_PTR(-ENOMEM);
+			goto bad_thin_wq;
+		}
+	}
+
 	throttle_init(&pool->throttle);
+	mutex_init(&pool->alloc_lock);
+	for (i = 0; i < COMMIT_HIST_BUCKETS; i++)
+		atomic_long_set(&pool->commit_hist[i], 0);
 	INIT_WORK(&pool->worker, do_worker);
 	INIT_DELAYED_WORK(&pool->waker, do_waker);
 	INIT_DELAYED_WORK(&pool->no_space_timeout, do_no_space_timeout);
@@ -3125,7 +4300,6 @@ static struct pool *pool_create(struct mapped_device *pool_md,
 		goto bad_all_io_ds;
 	}
 
-	pool->next_mapping = NULL;
 	pool->mapping_pool = mempool_create_slab_pool(MAPPING_POOL_SIZE,
 						      _new_mapping_cache);
 	if (!pool->mapping_pool) {
@@ -3134,11 +4308,10 @@ static struct pool *pool_create(struct mapped_device *pool_md,
 		goto bad_mapping_pool;
 	}
 
-	pool->cell_sort_array = vmalloc(sizeof(*pool->cell_sort_array) * CELL_SORT_ARRAY_SIZE);
-	if (!pool->cell_sort_array) {
-		*error = "Error allocating cell sort array";
+	if (alloc_pool_workers(pool, nr_workers)) {
+		*error = "Error allocating pool workers";
 		err_p = ERR_PTR(-ENOMEM);
-		goto bad_sort_array;
+		goto bad_workers;
 	}
 
 	pool->ref_count = 1;
@@ -3149,13 +4322,16 @@ static struct pool *pool_create(struct mapped_device *pool_md,
 
 	return pool;
 
-bad_sort_array:
+bad_workers:
 	mempool_destroy(pool->mapping_pool);
 bad_mapping_pool:
 	dm_deferred_set_destroy(pool->all_io_ds);
 bad_all_io_ds:
 	dm_deferred_set_destroy(pool->shared_read_ds);
 bad_shared_read_ds:
+	if (pool->thin_wq)
+		destroy_workqueue(pool->thin_wq);
+bad_thin_wq:
 	destroy_workqueue(pool->wq);
 bad_wq:
 	dm_kcopyd_client_destroy(pool->copier);
@@ -3242,7 +4418,7 @@ static int parse_pool_features(struct dm_arg_set *as, struct pool_features *pf,
 	const char *arg_name;
 
 	static const struct dm_arg _args[] = {
-		{0, 4, "Invalid number of pool feature arguments"},
+		{0, 6, "Invalid number of pool feature arguments"},
 	};
 
 	/*
@@ -3274,6 +4450,9 @@ static int parse_pool_features(struct dm_arg_set *as, struct pool_features *pf,
 		else if (!strcasecmp(arg_name, "error_if_no_space"))
 			pf->error_if_no_space = true;
 
+		else if (!strcasecmp(arg_name, "sub_block_cow"))
+			pf->sub_block_cow = true;
+
 		else {
 			ti->error = "Unrecognised pool feature requested";
 			r = -EINVAL;
@@ -3357,6 +4536,8 @@ static dm_block_t calc_metadata_threshold(struct pool_c *pt)
  *	     no_discard_passdown: don't pass discards down to the data device
  *	     read_only: Don't allow any changes to be made to the pool metadata.
  *	     error_if_no_space: error IOs, instead of queueing, if no space.
+ *	     sub_block_cow: break sharing by copying only the sub-blocks that
+ *			    are written.
  */
 static int pool_ctr(struct dm_target *ti, unsigned argc, char **argv)
 {
@@ -3425,6 +4606,12 @@ static int pool_ctr(struct dm_target *ti, unsigned argc, char **argv)
 		goto out;
 	}
 
+	if (pf.sub_block_cow && !calc_nr_sub_blocks(block_size)) {
+		ti->error = "Block size too small for sub_block_cow";
+		r = -EINVAL;
+		goto out;
+	}
+
 	if (kstrtoull(argv[3], 10, (unsigned long long *)&low_water_blocks)) {
 		ti->error = "Invalid low water mark";
 		r = -EINVAL;
@@ -3456,6 +4643,16 @@ static int pool_ctr(struct dm_target *ti, unsigned argc, char **argv)
 		goto out_flags_changed;
 	}
 
+	/*
+	 * Thin devices size their io to the sub-blocks when they are
+	 * created, so this can't change on reload either.
+	 */
+	if (!pool_created && pf.sub_block_cow != pool->pf.sub_block_cow) {
+		ti->error = "sub_block_cow cannot be changed after initial load";
+		r = -EINVAL;
+		goto out_flags_changed;
+	}
+
 	pt->pool = pool;
 	pt->ti = ti;
 	pt->metadata_dev = metadata_dev;
@@ -3745,6 +4942,13 @@ static void pool_postsuspend(struct dm_target *ti)
 	cancel_delayed_work_sync(&pool->waker);
 	cancel_delayed_work_sync(&pool->no_space_timeout);
 	flush_workqueue(pool->wq);
+	if (pool->thin_wq) {
+		/* thin workers may have handed work back to the pool worker */
+		flush_workqueue(pool->thin_wq);
+		flush_workqueue(pool->wq);
+	}
+	/* the workers flushed above may have rearmed their cap wakers */
+	cancel_cap_wakers(pool);
 	(void) commit(pool);
 }
 
@@ -3819,6 +5023,9 @@ static int process_create_snap_mesg(unsigned argc, char **argv, struct pool *poo
 		return r;
 	}
 
+	/* the origin's blocks are shared now */
+	invalidate_thin_caches(pool, origin_dev_id, false);
+
 	return 0;
 }
 
@@ -3951,12 +5158,69 @@ static int pool_message(struct dm_target *ti, unsigned argc, char **argv)
 	return r;
 }
 
+static unsigned thin_queue_depth(struct thin_c *tc)
+{
+	unsigned long flags;
+	struct list_head *l;
+	unsigned depth;
+
+	spin_lock_irqsave(&tc->lock, flags);
+	depth = bio_list_size(&tc->deferred_bio_list);
+	list_for_each(l, &tc->deferred_cells)
+		depth++;
+	spin_unlock_irqrestore(&tc->lock, flags);
+
+	return depth;
+}
+
+/*
+ * Per thin worker: <queued bios and cells>/<runs>/<runtime in ms>
+ */
+static void emit_worker_stats(struct pool *pool, char *result,
+			      unsigned sz, unsigned maxlen)
+{
+	struct pool_worker *w;
+	struct thin_c *tc;
+	unsigned depth;
+
+	DMEMIT("workers:%u ", pool->nr_workers);
+	for (w = pool->workers; w < pool->workers + pool->nr_workers; w++) {
+		depth = 0;
+		rcu_read_lock();
+		list_for_each_entry_rcu(tc, &pool->active_thins, list)
+			if (tc->worker == w)
+				depth += thin_queue_depth(tc);
+		rcu_read_unlock();
+
+		DMEMIT("%u/%lu/%llu ", depth, ACCESS_ONCE(w->runs),
+		       (unsigned long long)div_u64(ACCESS_ONCE(w->runtime_ns),
+						   NSEC_PER_MSEC));
+	}
+}
+
+/*
+ * commit_ms:<count per latency bucket, see COMMIT_HIST_BUCKETS>
+ */
+static unsigned emit_commit_stats(struct pool *pool, char *result,
+				  unsigned sz, unsigned maxlen)
+{
+	unsigned i;
+
+	DMEMIT("commit_ms:");
+	for (i = 0; i < COMMIT_HIST_BUCKETS; i++)
+		DMEMIT("%s%lu", i ? "/" : "",
+		       atomic_long_read(&pool->commit_hist[i]));
+	DMEMIT(" ");
+
+	return sz;
+}
+
 static void emit_flags(struct pool_features *pf, char *result,
 		       unsigned sz, unsigned maxlen)
 {
 	unsigned count = !pf->zero_new_blocks + !pf->discard_enabled +
 		!pf->discard_passdown + (pf->mode == PM_READ_ONLY) +
-		pf->error_if_no_space;
+		pf->error_if_no_space + pf->sub_block_cow;
 	DMEMIT("%u ", count);
 
 	if (!pf->zero_new_blocks)
@@ -3973,6 +5237,9 @@ static void emit_flags(struct pool_features *pf, char *result,
 
 	if (pf->error_if_no_space)
 		DMEMIT("error_if_no_space ");
+
+	if (pf->sub_block_cow)
+		DMEMIT("sub_block_cow ");
 }
 
 /*
@@ -4090,6 +5357,9 @@ static void pool_status(struct dm_target *ti, status_type_t type,
 
 		DMEMIT("%llu ", (unsigned long long)calc_metadata_threshold(pt));
 
+		sz = emit_commit_stats(pool, result, sz, maxlen);
+		if (pool->nr_workers > 1)
+			emit_worker_stats(pool, result, sz, maxlen);
 		break;
 
 	case STATUSTYPE_TABLE:
@@ -4179,7 +5449,7 @@ static struct target_type pool_target = {
 	.name = "thin-pool",
 	.features = DM_TARGET_SINGLETON | DM_TARGET_ALWAYS_WRITEABLE |
 		    DM_TARGET_IMMUTABLE,
-	.version = {1, 21, 0},
+	.version = {1, 23, 0},
 	.module = THIS_MODULE,
 	.ctr = pool_ctr,
 	.dtr = pool_dtr,
@@ -4225,6 +5495,8 @@ static void thin_dtr(struct dm_target *ti)
 	mutex_lock(&dm_thin_pool_table.mutex);
 
 	__pool_dec(tc->pool);
+	free_percpu(tc->lat);
+	free_extent_cache(tc->cache);
 	dm_pool_close_thin_device(tc->td);
 	dm_put_device(ti, tc->pool_dev);
 	if (tc->origin_dev)
@@ -4253,6 +5525,7 @@ static int thin_ctr(struct dm_target *ti, unsigned argc, char **argv)
 	struct dm_dev *pool_dev, *origin_dev;
 	struct mapped_device *pool_md;
 	unsigned long flags;
+	sector_t nr_blocks;
 
 	mutex_lock(&dm_thin_pool_table.mutex);
 
@@ -4274,6 +5547,8 @@ static int thin_ctr(struct dm_target *ti, unsigned argc, char **argv)
 	bio_list_init(&tc->deferred_bio_list);
 	bio_list_init(&tc->retry_on_resume_list);
 	tc->sort_bio_list = RB_ROOT;
+	tc->weight = THIN_WEIGHT_DEFAULT;
+	tc->cap_refill = jiffies;
 
 	if (argc == 3) {
 		if (!strcmp(argv[0], argv[2])) {
@@ -4330,10 +5605,35 @@ static int thin_ctr(struct dm_target *ti, unsigned argc, char **argv)
 		goto bad_pool;
 	}
 
+	/*
+	 * Partial mappings are only created with sub_block_cow, so
+	 * without it and none in the metadata, the partial lookups can
+	 * be skipped.  Bios may still span sub-blocks; the worker fills
+	 * in whatever they touch.
+	 */
+	tc->partials = tc->pool->nr_sub_blocks &&
+		(tc->pool->pf.sub_block_cow ||
+		 dm_pool_has_partial_mappings(tc->pool->pmd));
 	r = dm_set_target_max_io_len(ti, tc->pool->sectors_per_block);
 	if (r)
 		goto bad;
 
+	nr_blocks = ti->len;
+	(void) sector_div(nr_blocks, tc->pool->sectors_per_block);
+	tc->cache = alloc_extent_cache(nr_blocks);
+	if (!tc->cache) {
+		ti->error = "Couldn't allocate extent cache";
+		r = -ENOMEM;
+		goto bad;
+	}
+
+	tc->lat = alloc_percpu(struct thin_lat_stats);
+	if (!tc->lat) {
+		ti->error = "Couldn't allocate latency stats";
+		r = -ENOMEM;
+		goto bad;
+	}
+
 	ti->num_flush_bios = 1;
 	ti->flush_supported = true;
 	ti->per_io_data_size = sizeof(struct dm_thin_endio_hook);
@@ -4358,6 +5658,7 @@ static int thin_ctr(struct dm_target *ti, unsigned argc, char **argv)
 	}
 	atomic_set(&tc->refcount, 1);
 	init_completion(&tc->can_destroy);
+	tc->worker = &tc->pool->workers[tc->dev_id % tc->pool->nr_workers];
 	list_add_tail_rcu(&tc->list, &tc->pool->active_thins);
 	spin_unlock_irqrestore(&tc->pool->lock, flags);
 	/*
@@ -4373,6 +5674,8 @@ static int thin_ctr(struct dm_target *ti, unsigned argc, char **argv)
 	return 0;
 
 bad:
+	free_percpu(tc->lat);
+	free_extent_cache(tc->cache);
 	dm_pool_close_thin_device(tc->td);
 bad_pool:
 	__pool_dec(tc->pool);
@@ -4398,6 +5701,41 @@ static int thin_map(struct dm_target *ti, struct bio *bio)
 	return thin_bio_map(ti, bio);
 }
 
+static void thin_account_latency(struct thin_c *tc, struct dm_thin_endio_hook *h)
+{
+	u64 ns = ktime_to_ns(ktime_sub(ktime_get(), h->start));
+	struct thin_lat_stats *st;
+	unsigned long flags;
+
+	local_irq_save(flags);
+	st = this_cpu_ptr(tc->lat);
+	st->ios++;
+	st->total_ns += ns;
+	if (ns > st->max_ns)
+		st->max_ns = ns;
+	local_irq_restore(flags);
+}
+
+static void thin_latency_stats(struct thin_c *tc, unsigned long long *ios,
+			       unsigned long long *avg_us,
+			       unsigned long long *max_us)
+{
+	struct thin_lat_stats *st;
+	u64 total = 0, max = 0;
+	int cpu;
+
+	*ios = 0;
+	for_each_possible_cpu(cpu) {
+		st = per_cpu_ptr(tc->lat, cpu);
+		*ios += ACCESS_ONCE(st->ios);
+		total += ACCESS_ONCE(st->total_ns);
+		max = max_t(u64, max, ACCESS_ONCE(st->max_ns));
+	}
+
+	*avg_us = *ios ? div64_u64(total, *ios * NSEC_PER_USEC) : 0;
+	*max_us = div_u64(max, NSEC_PER_USEC);
+}
+
 static int thin_endio(struct dm_target *ti, struct bio *bio, int err)
 {
 	unsigned long flags;
@@ -4406,6 +5744,9 @@ static int thin_endio(struct dm_target *ti, struct bio *bio, int err)
 	struct dm_thin_new_mapping *m, *tmp;
 	struct pool *pool = h->tc->pool;
 
+	if (!err)
+		thin_account_latency(h->tc, h);
+
 	if (h->shared_read_entry) {
 		INIT_LIST_HEAD(&work);
 		dm_deferred_entry_dec(h->shared_read_entry, &work);
@@ -4465,6 +5806,63 @@ static int thin_preresume(struct dm_target *ti)
 	return 0;
 }
 
+/*
+ * Thin messages, which don't survive a table reload:
+ *
+ *   weight <1-10000>		share of the worker, relative to 100
+ *   iops_limit <ios/s>		0 for no limit
+ *   bw_limit <KiB/s>		0 for no limit
+ */
+static int thin_message(struct dm_target *ti, unsigned argc, char **argv)
+{
+	struct thin_c *tc = ti->private;
+	unsigned long long value;
+	int r;
+
+	r = check_arg_count(argc, 2);
+	if (r)
+		return r;
+
+	if (kstrtoull(argv[1], 10, &value)) {
+		DMWARN("%s message: Unrecognised value %s.", argv[0], argv[1]);
+		return -EINVAL;
+	}
+
+	if (!strcasecmp(argv[0], "weight")) {
+		if (!value || value > THIN_WEIGHT_MAX) {
+			DMWARN("weight message: weight must be between 1 and %u.",
+			       THIN_WEIGHT_MAX);
+			return -EINVAL;
+		}
+		ACCESS_ONCE(tc->weight) = value;
+
+	} else if (!strcasecmp(argv[0], "iops_limit")) {
+		if (value > UINT_MAX) {
+			DMWARN("iops_limit message: limit %s too large.", argv[1]);
+			return -EINVAL;
+		}
+		ACCESS_ONCE(tc->iops_limit) = value;
+
+	} else if (!strcasecmp(argv[0], "bw_limit")) {
+		/* the token bucket holds up to twice limit * HZ */
+		if (value > min_t(unsigned long long, ULONG_MAX,
+				  LLONG_MAX / (2 * HZ)) >> 1) {
+			DMWARN("bw_limit message: limit %s too large.", argv[1]);
+			return -EINVAL;
+		}
+		ACCESS_ONCE(tc->bw_limit) = value << 1;
+
+	} else {
+		DMWARN("Unrecognised thin target message received: %s", argv[0]);
+		return -EINVAL;
+	}
+
+	/* bios may be waiting on the old limits */
+	wake_thin_worker(tc);
+
+	return 0;
+}
+
 /*
  * <nr mapped sectors> <highest mapped sector>
  */
@@ -4474,6 +5872,8 @@ static void thin_status(struct dm_target *ti, status_type_t type,
 	int r;
 	ssize_t sz = 0;
 	dm_block_t mapped, highest;
+	unsigned long long hits, misses, allocs, extents;
+	unsigned long long ios, avg_us, max_us;
 	char buf[BDEVNAME_SIZE];
 	struct thin_c *tc = ti->private;
 
@@ -4505,6 +5905,20 @@ static void thin_status(struct dm_target *ti, status_type_t type,
 						tc->pool->sectors_per_block) - 1);
 			else
 				DMEMIT("-");
+
+			extent_cache_stats(tc->cache, &hits, &misses);
+			DMEMIT(" cache_hits:%llu cache_misses:%llu", hits, misses);
+
+			allocs = ACCESS_ONCE(tc->alloc_blocks);
+			extents = ACCESS_ONCE(tc->alloc_extents);
+			DMEMIT(" alloc_blocks:%llu alloc_extents:%llu avg_extent_blocks:%llu",
+			       allocs, extents, extents ? div64_u64(allocs, extents) : 0ULL);
+
+			thin_latency_stats(tc, &ios, &avg_us, &max_us);
+			DMEMIT(" weight:%u iops_limit:%u bw_limit_kb:%lu"
+			       " lat_ios:%llu lat_avg_us:%llu lat_max_us:%llu",
+			       ACCESS_ONCE(tc->weight), ACCESS_ONCE(tc->iops_limit),
+			       ACCESS_ONCE(tc->bw_limit) >> 1, ios, avg_us, max_us);
 			break;
 
 		case STATUSTYPE_TABLE:
@@ -4559,7 +5973,7 @@ static void thin_io_hints(struct dm_target *ti, struct queue_limits *limits)
 
 static struct target_type thin_target = {
 	.name = "thin",
-	.version = {1, 21, 0},
+	.version = {1, 23, 0},
 	.module	= THIS_MODULE,
 	.ctr = thin_ctr,
 	.dtr = thin_dtr,
@@ -4568,6 +5982,7 @@ static struct target_type thin_target = {
 	.preresume = thin_preresume,
 	.presuspend = thin_presuspend,
 	.postsuspend = thin_postsuspend,
+	.message = thin_message,
 	.status = thin_status,
 	.iterate_devices = thin_iterate_devices,
 	.io_hints = thin_io_hints,
@@ -4619,6 +6034,12 @@ module_exit(dm_thin_exit);
 module_param_named(no_space_timeout, no_space_timeout_secs, uint, S_IRUGO | S_IWUSR);
 MODULE_PARM_DESC(no_space_timeout, "Out of data space queue IO timeout in seconds");
 
+module_param(pool_workers, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(pool_workers, "Number of workers processing the thin devices of a newly created pool");
+
+module_param(alloc_window_mb, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(alloc_window_mb, "Size of the data allocation window each thin device of a newly created pool extends (0 to disable)");
+
 MODULE_DESCRIPTION(DM_NAME " thin provisioning target");
 MODULE_AUTHOR("Joe Thornber <dm-devel@redhat.com>");
 MODULE_LICENSE("GPL");
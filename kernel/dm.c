@@ -23,6 +23,7 @@
 #include <linux/delay.h>
 #include <linux/wait.h>
 #include <linux/pr.h>
+#include <linux/shrinker.h>
 
 #define DM_MSG_PREFIX "core"
 
@@ -68,8 +69,45 @@ struct dm_io {
 	unsigned long start_time;
 	spinlock_t endio_lock;
 	struct dm_stats_aux stats_aux;
+	bool inline_tio_busy;
 };
 
+/*
+ * A dm_io is the front_pad of a bio from md->io_bs, laid out as
+ *	[struct dm_io][per-bio data][struct dm_target_io ... clone]
+ * so the first clone of a bio comes with its dm_io and dm_per_bio_data()
+ * works on it just as on clones from md->bs.
+ *
+ * Each cpu keeps a few free dm_ios and clones so the common case skips
+ * the mempools.  A bio is only kept while its bio_set's reserves are
+ * full, so the mempool guarantees still hold.
+ *
+ * How many are kept follows the cpu's allocation rate: one of each per
+ * DM_IO_CACHE_RATE allocations in the last DM_IO_CACHE_PERIOD, up to
+ * DM_IO_CACHE_SIZE.  A cpu doing 640 ios/s keeps one, and one doing
+ * 10k ios/s or more keeps the maximum.  A cpu that stops doing io keeps
+ * what it has until the shrinker frees it.
+ */
+#define DM_IO_CACHE_SIZE	16
+#define DM_IO_CACHE_RATE	64
+#define DM_IO_CACHE_PERIOD	(HZ / 10)
+
+struct dm_io_cache {
+	spinlock_t lock;		/* taken by the shrinker from other cpus */
+	unsigned nr_io;
+	unsigned nr_clone;
+	unsigned limit;			/* of each of io and clone */
+	unsigned allocs;		/* since stamp */
+	unsigned long stamp;
+	struct bio *io[DM_IO_CACHE_SIZE];	/* inline clones of free dm_ios */
+	struct bio *clone[DM_IO_CACHE_SIZE];	/* free clones from md->bs */
+};
+
+/* All bio-based devices with caches, for the shrinker */
+static DEFINE_SPINLOCK(_io_cache_lock);
+static LIST_HEAD(_io_cache_list);
+static atomic_long_t _io_cache_nr = ATOMIC_LONG_INIT(0);
+
 #define MINOR_ALLOCED ((void *)-1)
 
 /*
@@ -95,6 +133,8 @@ struct dm_md_mempools {
 	mempool_t *io_pool;
 	mempool_t *rq_pool;
 	struct bio_set *bs;
+	struct bio_set *io_bs;
+	unsigned io_tio_offset;
 };
 
 struct table_device {
@@ -103,7 +143,6 @@ struct table_device {
 	struct dm_dev dm_dev;
 };
 
-static struct kmem_cache *_io_cache;
 static struct kmem_cache *_rq_tio_cache;
 static struct kmem_cache *_rq_cache;
 
@@ -170,14 +209,9 @@ static int __init local_init(void)
 {
 	int r = -ENOMEM;
 
-	/* allocate a slab for the dm_ios */
-	_io_cache = KMEM_CACHE(dm_io, 0);
-	if (!_io_cache)
-		return r;
-
 	_rq_tio_cache = KMEM_CACHE(dm_rq_target_io, 0);
 	if (!_rq_tio_cache)
-		goto out_free_io_cache;
+		return r;
 
 	_rq_cache = kmem_cache_create("dm_old_clone_request", sizeof(struct request),
 				      __alignof__(struct request), 0, NULL);
@@ -202,6 +236,8 @@ static int __init local_init(void)
 	if (!_major)
 		_major = r;
 
+	register_shrinker(&dm_io_cache_shrinker);
+
 	return 0;
 
 out_free_workqueue:
@@ -212,20 +248,18 @@ out_free_rq_cache:
 	kmem_cache_destroy(_rq_cache);
 out_free_rq_tio_cache:
 	kmem_cache_destroy(_rq_tio_cache);
-out_free_io_cache:
-	kmem_cache_destroy(_io_cache);
 
 	return r;
 }
 
 static void local_exit(void)
 {
+	unregister_shrinker(&dm_io_cache_shrinker);
 	flush_scheduled_work();
 	destroy_workqueue(deferred_remove_workqueue);
 
 	kmem_cache_destroy(_rq_cache);
 	kmem_cache_destroy(_rq_tio_cache);
-	kmem_cache_destroy(_io_cache);
 	unregister_blkdev(_major, _name);
 	dm_uevent_exit();
 
@@ -480,19 +514,241 @@ out:
 	return r;
 }
 
-static struct dm_io *alloc_io(struct mapped_device *md)
+static inline struct dm_target_io *dm_io_inline_tio(struct mapped_device *md,
+						    struct dm_io *io)
+{
+	return (struct dm_target_io *)((char *)io + md->io_tio_offset);
+}
+
+/* lock this cpu's cache, irqs off */
+static struct dm_io_cache *dm_io_cache_lock(struct mapped_device *md,
+					    unsigned long *flags)
+{
+	struct dm_io_cache *cache;
+
+	local_irq_save(*flags);
+	cache = this_cpu_ptr(md->io_cache);
+	spin_lock(&cache->lock);
+	return cache;
+}
+
+static void dm_io_cache_unlock(struct dm_io_cache *cache, unsigned long flags)
+{
+	spin_unlock(&cache->lock);
+	local_irq_restore(flags);
+}
+
+/* take a cached bio with room for nr_iovecs, and note the allocation */
+static struct bio *dm_io_cache_get(struct dm_io_cache *cache,
+				   struct bio **slot, unsigned *nr,
+				   unsigned nr_iovecs)
 {
-	return mempool_alloc(md->io_pool, GFP_NOIO);
+	struct bio *bio;
+	unsigned i;
+
+	cache->allocs++;
+	if (time_after_eq(jiffies, cache->stamp + DM_IO_CACHE_PERIOD)) {
+		cache->limit = min_t(unsigned, DM_IO_CACHE_SIZE,
+				     DIV_ROUND_UP(cache->allocs, DM_IO_CACHE_RATE));
+		cache->allocs = 0;
+		cache->stamp = jiffies;
+	}
+
+	for (i = *nr; i--; ) {
+		bio = slot[i];
+		if (bio->bi_max_vecs >= nr_iovecs) {
+			slot[i] = slot[--(*nr)];
+			atomic_long_dec(&_io_cache_nr);
+			return bio;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Keep a bio that is done with for reuse.  Returns true if the caller's
+ * reference was taken over, false if the caller must bio_put() it.
+ * A bio that a lower layer still holds a reference on is not reused:
+ * dropping our reference is all there is to do.
+ */
+static bool dm_io_cache_put(struct dm_io_cache *cache, struct bio_set *bs,
+			    struct bio **slot, unsigned *nr, struct bio *bio)
+{
+	if (*nr >= cache->limit)
+		return false;
+	if (bs->bio_pool->curr_nr < bs->bio_pool->min_nr)
+		return false;
+	if (bio->bi_io_vec != bio->bi_inline_vecs &&
+	    bs->bvec_pool->curr_nr < bs->bvec_pool->min_nr)
+		return false;
+	if (!atomic_dec_and_test(&bio->bi_cnt))
+		return true;
+
+	bio_reset(bio);
+	atomic_set(&bio->bi_cnt, 1);
+	slot[(*nr)++] = bio;
+	atomic_long_inc(&_io_cache_nr);
+	return true;
+}
+
+/* free up to nr_to_scan of a cpu's cached bios, returns how many were */
+static unsigned long dm_io_cache_free(struct dm_io_cache *cache,
+				      unsigned long nr_to_scan)
+{
+	unsigned long flags, freed = 0;
+
+	spin_lock_irqsave(&cache->lock, flags);
+	while (cache->nr_io && freed < nr_to_scan) {
+		bio_put(cache->io[--cache->nr_io]);
+		freed++;
+	}
+	while (cache->nr_clone && freed < nr_to_scan) {
+		bio_put(cache->clone[--cache->nr_clone]);
+		freed++;
+	}
+	spin_unlock_irqrestore(&cache->lock, flags);
+
+	atomic_long_sub(freed, &_io_cache_nr);
+	return freed;
+}
+
+static void dm_io_cache_drain(struct mapped_device *md)
+{
+	int cpu;
+
+	if (!md->io_cache)
+		return;
+
+	for_each_possible_cpu(cpu)
+		dm_io_cache_free(per_cpu_ptr(md->io_cache, cpu), ULONG_MAX);
+}
+
+static int dm_io_cache_shrink(struct shrinker *shrinker,
+			      struct shrink_control *sc)
+{
+	unsigned long nr_to_scan = sc->nr_to_scan;
+	struct mapped_device *md;
+	struct dm_io_cache *cache;
+	int cpu;
+
+	if (nr_to_scan && atomic_long_read(&_io_cache_nr)) {
+		spin_lock(&_io_cache_lock);
+		list_for_each_entry(md, &_io_cache_list, io_cache_list) {
+			for_each_possible_cpu(cpu) {
+				cache = per_cpu_ptr(md->io_cache, cpu);
+				nr_to_scan -= dm_io_cache_free(cache, nr_to_scan);
+				if (!nr_to_scan)
+					goto out;
+			}
+		}
+out:
+		spin_unlock(&_io_cache_lock);
+	}
+
+	return min_t(long, atomic_long_read(&_io_cache_nr), INT_MAX);
+}
+
+static struct shrinker dm_io_cache_shrinker = {
+	.shrink = dm_io_cache_shrink,
+	.seeks = DEFAULT_SEEKS,
+};
+
+static int dm_io_cache_init(struct mapped_device *md)
+{
+	int cpu;
+
+	md->io_cache = alloc_percpu(struct dm_io_cache);
+	if (!md->io_cache)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu)
+		spin_lock_init(&per_cpu_ptr(md->io_cache, cpu)->lock);
+
+	spin_lock(&_io_cache_lock);
+	list_add(&md->io_cache_list, &_io_cache_list);
+	spin_unlock(&_io_cache_lock);
+
+	return 0;
+}
+
+static void dm_io_cache_exit(struct mapped_device *md)
+{
+	if (!md->io_cache)
+		return;
+
+	spin_lock(&_io_cache_lock);
+	list_del(&md->io_cache_list);
+	spin_unlock(&_io_cache_lock);
+
+	dm_io_cache_drain(md);
+	free_percpu(md->io_cache);
+	md->io_cache = NULL;
+}
+
+/*
+ * The dm_io's own bio carries the first clone of @bio, which needs
+ * room for nr_iovecs.  Pass 0 where that clone carries no data.
+ */
+static struct dm_io *alloc_io(struct mapped_device *md, struct bio *bio,
+			      unsigned nr_iovecs)
+{
+	struct dm_io_cache *cache;
+	struct dm_target_io *tio;
+	struct bio *clone;
+	unsigned long flags;
+	struct dm_io *io;
+
+	cache = dm_io_cache_lock(md, &flags);
+	clone = dm_io_cache_get(cache, cache->io, &cache->nr_io, nr_iovecs);
+	dm_io_cache_unlock(cache, flags);
+
+	if (!clone)
+		clone = bio_alloc_bioset(GFP_NOIO, nr_iovecs, md->io_bs);
+
+	tio = container_of(clone, struct dm_target_io, clone);
+	io = (struct dm_io *)((char *)tio - md->io_tio_offset);
+	io->inline_tio_busy = false;
+
+	return io;
 }
 
 static void free_io(struct mapped_device *md, struct dm_io *io)
 {
-	mempool_free(io, md->io_pool);
+	struct bio *clone = &dm_io_inline_tio(md, io)->clone;
+	struct dm_io_cache *cache;
+	unsigned long flags;
+	bool cached;
+
+	cache = dm_io_cache_lock(md, &flags);
+	cached = dm_io_cache_put(cache, md->io_bs, cache->io, &cache->nr_io,
+				 clone);
+	dm_io_cache_unlock(cache, flags);
+
+	if (!cached)
+		bio_put(clone);
 }
 
+/*
+ * Must be called before the tio's dm_io can complete: the inline tio
+ * goes away with its dm_io.
+ */
 static void free_tio(struct dm_target_io *tio)
 {
-	bio_put(&tio->clone);
+	struct mapped_device *md = tio->io->md;
+	struct dm_io_cache *cache;
+	unsigned long flags;
+	bool cached;
+
+	if (tio == dm_io_inline_tio(md, tio->io))
+		return;
+
+	cache = dm_io_cache_lock(md, &flags);
+	cached = dm_io_cache_put(cache, md->bs, cache->clone, &cache->nr_clone,
+				 &tio->clone);
+	dm_io_cache_unlock(cache, flags);
+
+	if (!cached)
+		bio_put(&tio->clone);
 }
 
 int md_in_flight(struct mapped_device *md)
@@ -1108,15 +1364,19 @@ static void __map_bio(struct dm_target_io *tio)
 
 		generic_make_request(clone);
 	} else if (r < 0 || r == DM_MAPIO_REQUEUE) {
+		struct dm_io *io = tio->io;
+
 		/* error the io and bail out, or requeue it if needed */
-		dec_pending(tio->io, r);
 		free_tio(tio);
+		dec_pending(io, r);
 	} else if (r != DM_MAPIO_SUBMITTED) {
 		DMWARN("unimplemented target map return value: %d", r);
 		BUG();
 	}
 }
 
+#define DM_TARGET_BATCH	8
+
 struct clone_info {
 	struct mapped_device *md;
 	struct dm_table *map;
@@ -1125,8 +1385,33 @@ struct clone_info {
 	sector_t sector;
 	sector_t sector_count;
 	unsigned short idx;
+
+	/* targets ahead of sector, see ci_find_target() */
+	unsigned nr_tis, next_ti;
+	struct dm_target *tis[DM_TARGET_BATCH];
 };
 
+/*
+ * Find the target for ci->sector.  A bio spanning many targets would
+ * search the table once per target; instead look them up in batches.
+ */
+static struct dm_target *ci_find_target(struct clone_info *ci)
+{
+	struct dm_target *ti;
+
+	for (; ci->next_ti < ci->nr_tis; ci->next_ti++) {
+		ti = ci->tis[ci->next_ti];
+		if (ci->sector >= ti->begin && ci->sector < ti->begin + ti->len)
+			return ti;
+	}
+
+	ci->nr_tis = dm_table_find_targets(ci->map, ci->sector,
+					   max_t(sector_t, ci->sector_count, 1),
+					   ci->tis, DM_TARGET_BATCH);
+	ci->next_ti = 0;
+	return ci->tis[0];
+}
+
 static void bio_setup_sector(struct bio *bio, sector_t sector, sector_t len)
 {
 	bio->bi_sector = sector;
@@ -1217,11 +1502,25 @@ static struct dm_target_io *alloc_tio(struct clone_info *ci,
 				      struct dm_target *ti, int nr_iovecs,
 				      unsigned target_bio_nr)
 {
-	struct dm_target_io *tio;
+	struct dm_target_io *tio = dm_io_inline_tio(ci->md, ci->io);
+	struct dm_io_cache *cache;
 	struct bio *clone;
+	unsigned long flags;
 
-	clone = bio_alloc_bioset(GFP_NOIO, nr_iovecs, ci->md->bs);
-	tio = container_of(clone, struct dm_target_io, clone);
+	if (!ci->io->inline_tio_busy && nr_iovecs <= tio->clone.bi_max_vecs) {
+		/* the first clone usually fits in the dm_io's own bio */
+		ci->io->inline_tio_busy = true;
+	} else {
+		cache = dm_io_cache_lock(ci->md, &flags);
+		clone = dm_io_cache_get(cache, cache->clone, &cache->nr_clone,
+					nr_iovecs);
+		dm_io_cache_unlock(cache, flags);
+
+		if (!clone)
+			clone = bio_alloc_bioset(GFP_NOIO, nr_iovecs,
+						 ci->md->bs);
+		tio = container_of(clone, struct dm_target_io, clone);
+	}
 
 	tio->io = ci->io;
 	tio->ti = ti;
@@ -1332,7 +1631,7 @@ static int __send_changing_extent_only(struct clone_info *ci,
 	unsigned num_bios;
 
 	do {
-		ti = dm_table_find_target(ci->map, ci->sector);
+		ti = ci_find_target(ci);
 		if (!dm_target_is_valid(ti))
 			return -EIO;
 
@@ -1403,7 +1702,7 @@ static int __split_bvec_across_targets(struct clone_info *ci,
 
 	do {
 		if (offset) {
-			ti = dm_table_find_target(ci->map, ci->sector);
+			ti = ci_find_target(ci);
 			if (!dm_target_is_valid(ti))
 				return -EIO;
 
@@ -1443,7 +1742,7 @@ static int __split_and_process_non_flush(struct clone_info *ci)
 	else if (unlikely(bio->bi_rw & REQ_WRITE_SAME))
 		return __send_write_same(ci);
 
-	ti = dm_table_find_target(ci->map, ci->sector);
+	ti = ci_find_target(ci);
 	if (!dm_target_is_valid(ti))
 		return -EIO;
 
@@ -1505,7 +1804,9 @@ static void __split_and_process_bio(struct mapped_device *md,
 
 	ci.map = map;
 	ci.md = md;
-	ci.io = alloc_io(md);
+	/* an empty flush is all the inline clone carries of a flush */
+	ci.io = alloc_io(md, bio, (bio->bi_rw & REQ_FLUSH) ?
+			 md->flush_bio.bi_max_vecs : bio->bi_max_vecs);
 	ci.io->error = 0;
 	atomic_set(&ci.io->io_count, 1);
 	ci.io->bio = bio;
@@ -1513,6 +1814,8 @@ static void __split_and_process_bio(struct mapped_device *md,
 	spin_lock_init(&ci.io->endio_lock);
 	ci.sector = bio->bi_sector;
 	ci.idx = bio->bi_idx;
+	ci.nr_tis = 0;
+	ci.next_ti = 0;
 
 	start_io_acct(ci.io);
 
@@ -1531,6 +1834,63 @@ static void __split_and_process_bio(struct mapped_device *md,
 	/* drop the extra reference count */
 	dec_pending(ci.io, error);
 }
+
+/*
+ * Can the bio go straight to the only target of the table, as one
+ * clone covering all of it?
+ */
+static struct dm_target *dm_direct_target(struct dm_table *map, struct bio *bio)
+{
+	struct dm_target *ti;
+
+	if (unlikely(!map) || dm_table_get_num_targets(map) != 1)
+		return NULL;
+	if (bio->bi_rw & (REQ_FLUSH | REQ_DISCARD | REQ_WRITE_SAME))
+		return NULL;
+
+	ti = dm_table_get_target(map, 0);
+	if (ti->num_write_bios && bio_data_dir(bio) == WRITE)
+		return NULL;
+	if (bio_sectors(bio) > max_io_len(bio->bi_sector, ti))
+		return NULL;
+
+	return ti;
+}
+
+/*
+ * Fast path for single target tables: the bio is mapped as one clone,
+ * the dm_io's inline one, without going through clone_info and the
+ * per-target split loop.  Suspend and table swaps are handled by the
+ * caller exactly as for __split_and_process_bio().
+ */
+static void __process_bio_direct(struct mapped_device *md,
+				 struct dm_target *ti, struct bio *bio)
+{
+	struct dm_io *io = alloc_io(md, bio, bio->bi_max_vecs);
+	struct dm_target_io *tio = dm_io_inline_tio(md, io);
+	int r;
+
+	io->error = 0;
+	atomic_set(&io->io_count, 1);
+	io->bio = bio;
+	io->md = md;
+	spin_lock_init(&io->endio_lock);
+	start_io_acct(io);
+
+	/* alloc_io() sized the inline clone for this bio */
+	io->inline_tio_busy = true;
+	tio->io = io;
+	tio->ti = ti;
+	tio->target_bio_nr = 0;
+
+	r = clone_bio(tio, bio, bio->bi_sector, bio->bi_idx,
+		      bio->bi_vcnt - bio->bi_idx, bio_sectors(bio));
+	if (likely(!r))
+		__map_bio(tio);
+
+	/* drop the extra reference count */
+	dec_pending(io, r);
+}
 /*-----------------------------------------------------------------
  * CRUD END
  *---------------------------------------------------------------*/
@@ -1600,6 +1960,7 @@ static void dm_make_request(struct request_queue *q, struct bio *bio)
 	int cpu;
 	int srcu_idx;
 	struct dm_table *map;
+	struct dm_target *ti;
 
 	map = dm_get_live_table(md, &srcu_idx);
 
@@ -1619,7 +1980,11 @@ static void dm_make_request(struct request_queue *q, struct bio *bio)
 		return;
 	}
 
-	__split_and_process_bio(md, map, bio);
+	ti = dm_direct_target(map, bio);
+	if (ti)
+		__process_bio_direct(md, ti, bio);
+	else
+		__split_and_process_bio(md, map, bio);
 	dm_put_live_table(md, srcu_idx);
 	return;
 }
@@ -1741,10 +2106,13 @@ static void cleanup_mapped_device(struct mapped_device *md)
 		destroy_workqueue(md->wq);
 	if (md->kworker_task)
 		kthread_stop(md->kworker_task);
+	dm_io_cache_exit(md);
 	mempool_destroy(md->io_pool);
 	mempool_destroy(md->rq_pool);
 	if (md->bs)
 		bioset_free(md->bs);
+	if (md->io_bs)
+		bioset_free(md->io_bs);
 
 	if (md->dax_dev) {
 		kill_dax(md->dax_dev);
@@ -1822,6 +2190,9 @@ static struct mapped_device *alloc_dev(int minor)
 	INIT_LIST_HEAD(&md->table_devices);
 	spin_lock_init(&md->uevent_lock);
 
+	if (dm_io_cache_init(md))
+		goto bad;
+
 	md->queue = blk_alloc_queue_node(GFP_KERNEL, numa_node_id, NULL);
 	if (!md->queue)
 		goto bad;
@@ -1918,11 +2289,17 @@ static void __bind_mempools(struct mapped_device *md, struct dm_table *t)
 		if (dm_table_bio_based(t)) {
 			/*
 			 * Reload bioset because front_pad may have changed
-			 * because a different table was loaded.
+			 * because a different table was loaded.  Cached
+			 * bios belong to the old biosets.
 			 */
+			dm_io_cache_drain(md);
 			bioset_free(md->bs);
 			md->bs = p->bs;
 			p->bs = NULL;
+			bioset_free(md->io_bs);
+			md->io_bs = p->io_bs;
+			p->io_bs = NULL;
+			md->io_tio_offset = p->io_tio_offset;
 		}
 		/*
 		 * There's no need to reload with request-based dm
@@ -1935,7 +2312,7 @@ static void __bind_mempools(struct mapped_device *md, struct dm_table *t)
 		goto out;
 	}
 
-	BUG_ON(!p || md->io_pool || md->rq_pool || md->bs);
+	BUG_ON(!p || md->io_pool || md->rq_pool || md->bs || md->io_bs);
 
 	md->io_pool = p->io_pool;
 	p->io_pool = NULL;
@@ -1943,6 +2320,9 @@ static void __bind_mempools(struct mapped_device *md, struct dm_table *t)
 	p->rq_pool = NULL;
 	md->bs = p->bs;
 	p->bs = NULL;
+	md->io_bs = p->io_bs;
+	p->io_bs = NULL;
+	md->io_tio_offset = p->io_tio_offset;
 
 out:
 	/* mempool bind completed, no longer need any mempools in the table */
@@ -2913,7 +3293,7 @@ struct dm_md_mempools *dm_alloc_md_mempools(struct mapped_device *md, enum dm_qu
 	struct dm_md_mempools *pools = kzalloc_node(sizeof(*pools), GFP_KERNEL, md->numa_node_id);
 	struct kmem_cache *cachep = NULL;
 	unsigned int pool_size = 0;
-	unsigned int front_pad;
+	unsigned int front_pad, per_bio_pad;
 
 	if (!pools)
 		return NULL;
@@ -2921,9 +3301,17 @@ struct dm_md_mempools *dm_alloc_md_mempools(struct mapped_device *md, enum dm_qu
 	switch (type) {
 	case DM_TYPE_BIO_BASED:
 	case DM_TYPE_DAX_BIO_BASED:
-		cachep = _io_cache;
 		pool_size = dm_get_reserved_bio_based_ios();
-		front_pad = roundup(per_io_data_size, __alignof__(struct dm_target_io)) + offsetof(struct dm_target_io, clone);
+		per_bio_pad = roundup(per_io_data_size, __alignof__(struct dm_target_io));
+		front_pad = per_bio_pad + offsetof(struct dm_target_io, clone);
+		pools->io_tio_offset = roundup(sizeof(struct dm_io),
+					       __alignof__(struct dm_target_io)) + per_bio_pad;
+		pools->io_bs = bioset_create(pool_size, pools->io_tio_offset +
+					     offsetof(struct dm_target_io, clone));
+		if (!pools->io_bs)
+			goto out;
+		if (integrity && bioset_integrity_create(pools->io_bs, pool_size))
+			goto out;
 		break;
 	case DM_TYPE_REQUEST_BASED:
 		cachep = _rq_tio_cache;
@@ -2973,6 +3361,8 @@ void dm_free_md_mempools(struct dm_md_mempools *pools)
 
 	if (pools->bs)
 		bioset_free(pools->bs);
+	if (pools->io_bs)
+		bioset_free(pools->io_bs);
 
 	kfree(pools);
 }
@@ -0,0 +1,624 @@
+/*
+ * md-badblocks.c: scalable bad block index for md member devices
+ *
+ * The fixed one-page struct badblocks table stays the first place ranges
+ * go, and it is what the v1.x bad block log is normally written from.
+ * Once it is full, its ranges move here and so do all further ones, so
+ * that lookups on a disk with many bad ranges walk the index under RCU
+ * rather than the table under its seqlock.  The on-disk log is then
+ * rebuilt from the index, merging adjacent ranges.  The index never
+ * holds more than the log can store, so that rebuild always fits.
+ */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/badblocks.h>
+#include "md.h"
+
+enum {
+	MD_BB_SET,
+	MD_BB_CLEAR,
+};
+
+void md_bb_index_init(struct md_bb_index *idx)
+{
+	RCU_INIT_POINTER(idx->root, NULL);
+	spin_lock_init(&idx->lock);
+	idx->nr_extents = 0;
+	idx->nr_unacked = 0;
+	idx->nr_log = 0;
+	idx->max_log = MAX_BADBLOCKS;
+	idx->changed = 0;
+}
+
+/* Set the size of the on-disk log the index has to fit */
+void md_bb_index_set_max_log(struct md_bb_index *idx, int entries)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&idx->lock, flags);
+	idx->max_log = clamp(entries, 0, MAX_BADBLOCKS);
+	spin_unlock_irqrestore(&idx->lock, flags);
+}
+EXPORT_SYMBOL_GPL(md_bb_index_set_max_log);
+
+/*
+ * Unpublish the tree and free it after a grace period.
+ * Called with idx->lock held.
+ */
+static void md_bb_index_drop(struct md_bb_index *idx)
+{
+	struct md_bb_root *root;
+	unsigned int i;
+
+	root = rcu_dereference_protected(idx->root,
+					 lockdep_is_held(&idx->lock));
+	RCU_INIT_POINTER(idx->root, NULL);
+	idx->nr_extents = 0;
+	idx->nr_unacked = 0;
+	idx->nr_log = 0;
+	idx->changed = 0;
+
+	if (!root)
+		return;
+	for (i = 0; i < root->nr; i++)
+		kfree_rcu(root->slot[i].leaf, rcu);
+	kfree_rcu(root, rcu);
+}
+
+/* Forget everything; readers may still be walking the old tree */
+void md_bb_index_exit(struct md_bb_index *idx)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&idx->lock, flags);
+	md_bb_index_drop(idx);
+	spin_unlock_irqrestore(&idx->lock, flags);
+}
+
+/* Last slot whose first extent starts at or before s, or 0 */
+static unsigned int md_bb_find_slot(struct md_bb_root *root, sector_t s)
+{
+	unsigned int lo = 0, hi = root->nr;
+
+	while (hi - lo > 1) {
+		unsigned int mid = (lo + hi) / 2;
+
+		if (root->slot[mid].first <= s)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Last extent in the leaf starting at or before s, or 0 */
+static unsigned int md_bb_find_ext(struct md_bb_leaf *leaf, sector_t s)
+{
+	unsigned int lo = 0, hi = leaf->nr;
+
+	while (hi - lo > 1) {
+		unsigned int mid = (lo + hi) / 2;
+
+		if (leaf->ext[mid].start <= s)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * Same contract as badblocks_check(): 0 if no part of the range is bad,
+ * 1 if bad ranges overlap it and all are acknowledged, -1 if any is not.
+ * first_bad/bad_sectors describe the first bad range found.
+ */
+int md_bb_index_check(struct md_bb_index *idx, sector_t s, int sectors,
+		      sector_t *first_bad, int *bad_sectors)
+{
+	sector_t target = s + sectors;
+	struct md_bb_root *root;
+	unsigned int i, j;
+	int rv = 0;
+
+	rcu_read_lock();
+	root = rcu_dereference(idx->root);
+	if (!root)
+		goto out;
+
+	i = md_bb_find_slot(root, s);
+	j = md_bb_find_ext(root->slot[i].leaf, s);
+	for (; i < root->nr; i++, j = 0) {
+		struct md_bb_leaf *leaf = root->slot[i].leaf;
+
+		for (; j < leaf->nr; j++) {
+			struct md_bb_extent *e = &leaf->ext[j];
+
+			if (e->start >= target)
+				goto out;
+			if (e->end <= s)
+				continue;
+			if (!rv) {
+				*first_bad = e->start;
+				*bad_sectors = min_t(sector_t, e->end - e->start,
+						     INT_MAX);
+				rv = 1;
+			}
+			if (!e->ack) {
+				rv = -1;
+				goto out;
+			}
+		}
+	}
+out:
+	rcu_read_unlock();
+	return rv;
+}
+EXPORT_SYMBOL_GPL(md_bb_index_check);
+
+/* Log entries an extent takes: each holds at most BB_MAX_LEN units */
+static unsigned int md_bb_log_len(struct md_bb_extent *e, int shift)
+{
+	return DIV_ROUND_UP((e->end - e->start) >> shift, BB_MAX_LEN);
+}
+
+/*
+ * Apply one update to the leaves that cover [lo, hi) and their
+ * neighbours, writing the result to freshly allocated leaves and a new
+ * root.  The old ones are freed after a grace period.  Fails with
+ * -ENOSPC, changing nothing, if the result would not fit the log.
+ * Called with idx->lock held, possibly from interrupt context.
+ */
+static int md_bb_rewrite(struct md_bb_index *idx, int op,
+			 sector_t lo, sector_t hi, bool ack, int shift)
+{
+	struct md_bb_root *old, *new = NULL;
+	struct md_bb_extent *out;
+	unsigned int first = 0, last = 0, kept = 0;
+	unsigned int n = 0, m = 0, nleaves, total, per, i, k;
+	unsigned int old_unacked = 0, new_unacked = 0;
+	unsigned int old_log = 0, new_log = 0;
+	bool added = false;
+	int ret = -ENOMEM;
+
+	old = rcu_dereference_protected(idx->root,
+					lockdep_is_held(&idx->lock));
+	if (old) {
+		/* include neighbours that may merge with [lo, hi) */
+		first = md_bb_find_slot(old, lo ? lo - 1 : 0);
+		last = md_bb_find_slot(old, hi) + 1;
+		for (i = first; i < last; i++)
+			n += old->slot[i].leaf->nr;
+		kept = old->nr - (last - first);
+	}
+
+	/* a set can add one extent, a clear can split one in two */
+	out = kmalloc_array(n + 2, sizeof(*out), GFP_ATOMIC);
+	if (!out)
+		return -ENOMEM;
+
+	for (i = first; i < last; i++) {
+		struct md_bb_leaf *leaf = old->slot[i].leaf;
+
+		for (k = 0; k < leaf->nr; k++) {
+			struct md_bb_extent e = leaf->ext[k];
+
+			if (!e.ack)
+				old_unacked++;
+			old_log += md_bb_log_len(&e, shift);
+			switch (op) {
+			case MD_BB_SET:
+				if (e.end < lo) {
+					out[m++] = e;
+				} else if (e.start > hi) {
+					if (!added) {
+						out[m].start = lo;
+						out[m].end = hi;
+						out[m].ack = ack;
+						m++;
+						added = true;
+					}
+					out[m++] = e;
+				} else {
+					/* overlapping or adjacent: merge */
+					lo = min(lo, e.start);
+					hi = max(hi, e.end);
+					ack = ack && e.ack;
+				}
+				break;
+			case MD_BB_CLEAR:
+				if (e.end <= lo || e.start >= hi) {
+					out[m++] = e;
+					break;
+				}
+				if (e.start < lo) {
+					out[m] = e;
+					out[m++].end = lo;
+				}
+				if (e.end > hi) {
+					out[m] = e;
+					out[m++].start = hi;
+				}
+				break;
+			}
+		}
+	}
+	if (op == MD_BB_SET && !added) {
+		out[m].start = lo;
+		out[m].end = hi;
+		out[m].ack = ack;
+		m++;
+	}
+	for (k = 0; k < m; k++) {
+		if (!out[k].ack)
+			new_unacked++;
+		new_log += md_bb_log_len(&out[k], shift);
+	}
+	if (idx->nr_log - old_log + new_log > idx->max_log) {
+		ret = -ENOSPC;
+		goto out;
+	}
+
+	/* Leave room in split leaves so the next insert does not split again */
+	if (m <= MD_BB_LEAF_MAX)
+		nleaves = m ? 1 : 0;
+	else
+		nleaves = DIV_ROUND_UP(m, MD_BB_LEAF_MAX * 3 / 4);
+	total = kept + nleaves;
+	if (total > MD_BB_ROOT_MAX) {
+		ret = -ENOSPC;
+		goto out;
+	}
+
+	if (total) {
+		new = kmalloc(sizeof(*new) + total * sizeof(new->slot[0]),
+			      GFP_ATOMIC);
+		if (!new)
+			goto out;
+		new->nr = total;
+		for (i = 0; i < first; i++)
+			new->slot[i] = old->slot[i];
+
+		per = nleaves ? DIV_ROUND_UP(m, nleaves) : 0;
+		for (i = 0, k = 0; i < nleaves; i++) {
+			unsigned int cnt = min(per, m - k);
+			struct md_bb_leaf *leaf;
+
+			leaf = kmalloc(sizeof(*leaf) + cnt * sizeof(leaf->ext[0]),
+				       GFP_ATOMIC);
+			if (!leaf) {
+				while (i--)
+					kfree(new->slot[first + i].leaf);
+				kfree(new);
+				goto out;
+			}
+			leaf->nr = cnt;
+			memcpy(leaf->ext, out + k, cnt * sizeof(*out));
+			new->slot[first + i].first = leaf->ext[0].start;
+			new->slot[first + i].leaf = leaf;
+			k += cnt;
+		}
+		for (i = last; old && i < old->nr; i++)
+			new->slot[first + nleaves + i - last] = old->slot[i];
+	}
+
+	rcu_assign_pointer(idx->root, new);
+	idx->nr_extents = idx->nr_extents - n + m;
+	idx->nr_unacked = idx->nr_unacked - old_unacked + new_unacked;
+	idx->nr_log = idx->nr_log - old_log + new_log;
+	idx->changed = 1;
+
+	if (old) {
+		for (i = first; i < last; i++)
+			kfree_rcu(old->slot[i].leaf, rcu);
+		kfree_rcu(old, rcu);
+	}
+	ret = 0;
+out:
+	kfree(out);
+	return ret;
+}
+
+/* Record [s, s+sectors) as bad, rounded out to the log granularity */
+int md_bb_index_set(struct md_bb_index *idx, sector_t s, int sectors,
+		    int shift, bool ack)
+{
+	sector_t lo = s, hi = s + sectors;
+	unsigned long flags;
+	int ret;
+
+	if (shift < 0)
+		/* badblocks are disabled */
+		return -EINVAL;
+	if (shift) {
+		/* round the start down, and the end up */
+		lo >>= shift;
+		lo <<= shift;
+		hi += (1 << shift) - 1;
+		hi >>= shift;
+		hi <<= shift;
+	}
+
+	spin_lock_irqsave(&idx->lock, flags);
+	ret = md_bb_rewrite(idx, MD_BB_SET, lo, hi, ack, shift);
+	spin_unlock_irqrestore(&idx->lock, flags);
+	return ret;
+}
+EXPORT_SYMBOL_GPL(md_bb_index_set);
+
+/* Forget [s, s+sectors), rounded in to the log granularity */
+int md_bb_index_clear(struct md_bb_index *idx, sector_t s, int sectors,
+		      int shift)
+{
+	sector_t lo = s, hi = s + sectors;
+	unsigned long flags;
+	int ret;
+
+	if (!md_bb_index_used(idx))
+		return 0;
+	if (shift > 0) {
+		/* round the start up, and the end down */
+		lo += (1 << shift) - 1;
+		lo >>= shift;
+		lo <<= shift;
+		hi >>= shift;
+		hi <<= shift;
+	}
+	if (lo >= hi)
+		return 0;
+
+	/* a clear that splits a range may not fit: then it stays bad */
+	spin_lock_irqsave(&idx->lock, flags);
+	ret = md_bb_rewrite(idx, MD_BB_CLEAR, lo, hi, false, max(shift, 0));
+	spin_unlock_irqrestore(&idx->lock, flags);
+	return ret;
+}
+EXPORT_SYMBOL_GPL(md_bb_index_clear);
+
+/*
+ * Move the ranges of a full table into the index, which takes all
+ * further ranges as well.  The table is left empty on success, and
+ * untouched, with the index still empty, on failure.
+ */
+int md_bb_index_absorb(struct md_bb_index *idx, struct badblocks *bb)
+{
+	unsigned long flags;
+	int i, ret = 0;
+
+	write_seqlock_irqsave(&bb->lock, flags);
+	spin_lock(&idx->lock);
+	for (i = 0; i < bb->count; i++) {
+		u64 p = bb->page[i];
+
+		ret = md_bb_rewrite(idx, MD_BB_SET, BB_OFFSET(p) << bb->shift,
+				    (BB_OFFSET(p) + BB_LEN(p)) << bb->shift,
+				    BB_ACK(p), bb->shift);
+		if (ret)
+			break;
+	}
+	if (ret)
+		md_bb_index_drop(idx);
+	else {
+		/* readers find all of it in the index now */
+		bb->count = 0;
+		bb->unacked_exist = 0;
+		bb->changed = 1;
+	}
+	spin_unlock(&idx->lock);
+	write_sequnlock_irqrestore(&bb->lock, flags);
+	return ret;
+}
+EXPORT_SYMBOL_GPL(md_bb_index_absorb);
+
+/*
+ * Everything up to the last md_bb_build_log() is now in the on-disk log.
+ * Like ack_all_badblocks(), ack nothing if ranges changed since then.
+ * Extents are acked in place: readers see either value of the flag.
+ */
+void md_bb_index_ack_all(struct md_bb_index *idx)
+{
+	struct md_bb_root *root;
+	unsigned long flags;
+	unsigned int i, j;
+
+	if (!md_bb_index_unacked(idx))
+		return;
+
+	spin_lock_irqsave(&idx->lock, flags);
+	if (idx->changed)
+		goto out;
+	root = rcu_dereference_protected(idx->root,
+					 lockdep_is_held(&idx->lock));
+	for (i = 0; root && i < root->nr; i++) {
+		struct md_bb_leaf *leaf = root->slot[i].leaf;
+
+		for (j = 0; j < leaf->nr; j++)
+			ACCESS_ONCE(leaf->ext[j].ack) = true;
+	}
+	idx->nr_unacked = 0;
+out:
+	spin_unlock_irqrestore(&idx->lock, flags);
+}
+EXPORT_SYMBOL_GPL(md_bb_index_ack_all);
+
+/* Append "sector length" lines after the first len bytes of page */
+ssize_t md_bb_index_show(struct md_bb_index *idx, char *page, size_t len,
+			 bool unack)
+{
+	struct md_bb_root *root;
+	unsigned int i, j;
+
+	rcu_read_lock();
+	root = rcu_dereference(idx->root);
+	for (i = 0; root && i < root->nr; i++) {
+		struct md_bb_leaf *leaf = root->slot[i].leaf;
+
+		for (j = 0; j < leaf->nr; j++) {
+			struct md_bb_extent *e = &leaf->ext[j];
+
+			if (len >= PAGE_SIZE - 40)
+				goto out;
+			if (unack && e->ack)
+				continue;
+			len += snprintf(page + len, PAGE_SIZE - len, "%llu %u\n",
+					(unsigned long long)e->start,
+					(unsigned int)(e->end - e->start));
+		}
+	}
+out:
+	rcu_read_unlock();
+	return len;
+}
+EXPORT_SYMBOL_GPL(md_bb_index_show);
+
+/*
+ * Walks the union of the fixed table and the index in ascending order,
+ * in units of 1 << shift sectors, merging overlapping and adjacent
+ * ranges.
+ */
+struct md_bb_iter {
+	struct badblocks	*bb;
+	struct md_bb_root	*root;
+	int			bi;
+	unsigned int		slot, ext;
+	bool			have;		/* start/end hold a lookahead */
+	sector_t		start, end;
+};
+
+static void md_bb_iter_start(struct md_bb_iter *it)
+{
+	it->bi = 0;
+	it->slot = 0;
+	it->ext = 0;
+	it->have = false;
+}
+
+static bool md_bb_iter_raw(struct md_bb_iter *it, sector_t *start,
+			   sector_t *end)
+{
+	int shift = it->bb->shift;
+	struct md_bb_extent *e = NULL;
+	bool use_bb;
+
+	while (it->root && it->slot < it->root->nr &&
+	       it->ext >= it->root->slot[it->slot].leaf->nr) {
+		it->slot++;
+		it->ext = 0;
+	}
+	if (it->root && it->slot < it->root->nr)
+		e = &it->root->slot[it->slot].leaf->ext[it->ext];
+
+	if (it->bi < it->bb->count)
+		use_bb = !e || BB_OFFSET(it->bb->page[it->bi]) <=
+			(e->start >> shift);
+	else if (e)
+		use_bb = false;
+	else
+		return false;
+
+	if (use_bb) {
+		*start = BB_OFFSET(it->bb->page[it->bi]);
+		*end = *start + BB_LEN(it->bb->page[it->bi]);
+		it->bi++;
+	} else {
+		*start = e->start >> shift;
+		*end = (e->end + (1 << shift) - 1) >> shift;
+		it->ext++;
+	}
+	return true;
+}
+
+static bool md_bb_iter_next(struct md_bb_iter *it, sector_t *start,
+			    sector_t *end)
+{
+	sector_t s, e;
+
+	if (!it->have && !md_bb_iter_raw(it, &it->start, &it->end))
+		return false;
+	*start = it->start;
+	*end = it->end;
+	it->have = false;
+	while (md_bb_iter_raw(it, &s, &e)) {
+		if (s > *end) {
+			it->start = s;
+			it->end = e;
+			it->have = true;
+			break;
+		}
+		*end = max(*end, e);
+	}
+	return true;
+}
+
+/* Emit [s, e) as log entries of at most BB_MAX_LEN units each */
+static unsigned long md_bb_emit(sector_t s, sector_t e, __le64 *log,
+				unsigned long n, int max_entries)
+{
+	unsigned long cnt = 0;
+
+	while (s < e) {
+		sector_t len = min_t(sector_t, e - s, BB_MAX_LEN);
+
+		if (log && n + cnt < max_entries)
+			log[n + cnt] = cpu_to_le64(((u64)s << 10) | len);
+		cnt++;
+		s += len;
+	}
+	return cnt;
+}
+
+/*
+ * Fill the on-disk bad block log from the fixed table and the index, in
+ * one pass.  Only overlapping and adjacent ranges are merged: good
+ * sectors are never recorded as bad.  Returns the number of entries, or
+ * -ENOSPC if they do not fit, which the max_log check in
+ * md_bb_rewrite() rules out for a log of max_entries.
+ * Called with bb->lock read-held (via a seqcount retry loop).
+ */
+int md_bb_build_log(struct badblocks *bb, struct md_bb_index *idx,
+		    __le64 *log, int max_entries)
+{
+	struct md_bb_iter it = { .bb = bb };
+	unsigned long n = 0;
+	sector_t s, e;
+	int ret;
+
+	rcu_read_lock();
+	it.root = rcu_dereference(idx->root);
+
+	md_bb_iter_start(&it);
+	while (md_bb_iter_next(&it, &s, &e)) {
+		n += md_bb_emit(s, e, log, n, max_entries);
+		if (n > max_entries)
+			break;
+	}
+	ret = n > max_entries ? -ENOSPC : n;
+
+	rcu_read_unlock();
+	return ret;
+}
+EXPORT_SYMBOL_GPL(md_bb_build_log);
+
+/* badblocks_check() over both the fixed table and the index */
+int md_badblocks_check(struct md_rdev *rdev, sector_t s, int sectors,
+		       sector_t *first_bad, int *bad_sectors)
+{
+	sector_t fb;
+	int bs, rv = 0, rv2;
+
+	if (rdev->badblocks.count)
+		rv = badblocks_check(&rdev->badblocks, s, sectors,
+				     first_bad, bad_sectors);
+	if (!md_bb_index_used(&rdev->bb_index))
+		return rv;
+
+	rv2 = md_bb_index_check(&rdev->bb_index, s, sectors, &fb, &bs);
+	if (!rv2)
+		return rv;
+	if (!rv || fb < *first_bad) {
+		*first_bad = fb;
+		*bad_sectors = bs;
+	}
+	return (rv < 0 || rv2 < 0) ? -1 : 1;
+}
+EXPORT_SYMBOL_GPL(md_badblocks_check);
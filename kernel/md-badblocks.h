@@ -0,0 +1,93 @@
+/*
+ * md-badblocks.h: scalable bad block index for md member devices
+ */
+#ifndef _MD_BADBLOCKS_H
+#define _MD_BADBLOCKS_H
+
+#include <linux/rcupdate.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+
+/*
+ * struct badblocks holds at most one page of ranges, which is also the
+ * size of the on-disk bad block log.  Once it is full its ranges, and
+ * all later ones, are kept in an md_bb_index: a two-level tree of
+ * sorted extent arrays.
+ * The index only takes ranges while it still fits the on-disk log
+ * (max_log entries), so a full log refuses a record rather than
+ * failing the device when the superblock is next written.
+ * Readers walk it under rcu_read_lock() with no shared writes.
+ * Updaters copy the leaves they touch plus the root and publish the
+ * new root, so readers never see a half-updated leaf.  Only the ack
+ * flags are set in place.
+ */
+struct md_bb_extent {
+	sector_t		start;
+	sector_t		end;		/* exclusive */
+	bool			ack;
+};
+
+struct md_bb_leaf {
+	struct rcu_head		rcu;
+	unsigned int		nr;
+	struct md_bb_extent	ext[0];
+};
+
+struct md_bb_slot {
+	sector_t		first;		/* == leaf->ext[0].start */
+	struct md_bb_leaf	*leaf;
+};
+
+struct md_bb_root {
+	struct rcu_head		rcu;
+	unsigned int		nr;
+	struct md_bb_slot	slot[0];
+};
+
+#define MD_BB_LEAF_MAX	((PAGE_SIZE - sizeof(struct md_bb_leaf)) / \
+			 sizeof(struct md_bb_extent))
+#define MD_BB_ROOT_MAX	((PAGE_SIZE - sizeof(struct md_bb_root)) / \
+			 sizeof(struct md_bb_slot))
+
+struct md_bb_index {
+	struct md_bb_root __rcu	*root;
+	spinlock_t		lock;		/* serialises updaters */
+	unsigned int		nr_extents;
+	unsigned int		nr_unacked;
+	unsigned int		nr_log;		/* log entries the extents take */
+	unsigned int		max_log;	/* log entries on disk */
+	int			changed;	/* not yet in the on-disk log */
+};
+
+static inline bool md_bb_index_used(struct md_bb_index *idx)
+{
+	return ACCESS_ONCE(idx->nr_extents) != 0;
+}
+
+static inline bool md_bb_index_unacked(struct md_bb_index *idx)
+{
+	return ACCESS_ONCE(idx->nr_unacked) != 0;
+}
+
+struct badblocks;
+struct md_rdev;
+
+extern void md_bb_index_init(struct md_bb_index *idx);
+extern void md_bb_index_exit(struct md_bb_index *idx);
+extern int md_bb_index_check(struct md_bb_index *idx, sector_t s, int sectors,
+			     sector_t *first_bad, int *bad_sectors);
+extern int md_bb_index_set(struct md_bb_index *idx, sector_t s, int sectors,
+			   int shift, bool ack);
+extern int md_bb_index_clear(struct md_bb_index *idx, sector_t s, int sectors,
+			     int shift);
+extern int md_bb_index_absorb(struct md_bb_index *idx, struct badblocks *bb);
+extern void md_bb_index_set_max_log(struct md_bb_index *idx, int entries);
+extern void md_bb_index_ack_all(struct md_bb_index *idx);
+extern ssize_t md_bb_index_show(struct md_bb_index *idx, char *page,
+				size_t len, bool unack);
+extern int md_bb_build_log(struct badblocks *bb, struct md_bb_index *idx,
+			   __le64 *log, int max_entries);
+extern int md_badblocks_check(struct md_rdev *rdev, sector_t s, int sectors,
+			      sector_t *first_bad, int *bad_sectors);
+
+#endif
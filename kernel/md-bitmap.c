@@ -35,6 +35,197 @@ static inline char *bmname(struct bitmap *bitmap)
 	return bitmap->mddev ? mdname(bitmap->mddev) : "mdX";
 }
 
+/*
+ * counter page locking
+ *
+ * Each counter page is covered by one lock shard.  All state of a
+ * bitmap_page (map, hijacked, pending, count) and the counters in it are
+ * protected by that shard's lock.
+ */
+static inline unsigned long bitmap_counter_page(struct bitmap_counts *counts,
+					       sector_t offset)
+{
+	return (offset >> counts->chunkshift) >> PAGE_COUNTER_SHIFT;
+}
+
+static inline struct bitmap_lock_shard *
+bitmap_page_shard(struct bitmap_counts *counts, unsigned long page)
+{
+	return &counts->shards[page & counts->shard_mask];
+}
+
+/* interrupts must already be disabled */
+static void bitmap_shard_lock(struct bitmap_counts *counts, unsigned long page)
+{
+	struct bitmap_lock_shard *shard = bitmap_page_shard(counts, page);
+
+	if (likely(!counts->lock_stats)) {
+		spin_lock(&shard->lock);
+		return;
+	}
+	if (!spin_trylock(&shard->lock)) {
+		spin_lock(&shard->lock);
+		shard->contended++;
+	}
+	shard->acquired++;
+	shard->since = local_clock();
+}
+
+static void bitmap_shard_unlock(struct bitmap_counts *counts,
+				unsigned long page)
+{
+	struct bitmap_lock_shard *shard = bitmap_page_shard(counts, page);
+
+	if (unlikely(shard->since)) {
+		u64 held = local_clock() - shard->since;
+
+		shard->hold_ns += held;
+		if (held > shard->max_hold_ns)
+			shard->max_hold_ns = held;
+		shard->since = 0;
+	}
+	spin_unlock(&shard->lock);
+}
+
+static void bitmap_page_lock_irq(struct bitmap_counts *counts,
+				 unsigned long page)
+{
+	local_irq_disable();
+	bitmap_shard_lock(counts, page);
+}
+
+static void bitmap_page_unlock_irq(struct bitmap_counts *counts,
+				   unsigned long page)
+{
+	bitmap_shard_unlock(counts, page);
+	local_irq_enable();
+}
+
+static void bitmap_page_lock_irqsave(struct bitmap_counts *counts,
+				     unsigned long page, unsigned long *flags)
+{
+	local_irq_save(*flags);
+	bitmap_shard_lock(counts, page);
+}
+
+static void bitmap_page_unlock_irqrestore(struct bitmap_counts *counts,
+					  unsigned long page,
+					  unsigned long flags)
+{
+	bitmap_shard_unlock(counts, page);
+	local_irq_restore(flags);
+}
+
+static int bitmap_alloc_shards(struct bitmap_counts *counts)
+{
+	unsigned int nr, i;
+
+	nr = roundup_pow_of_two(min_t(unsigned int, num_possible_cpus() * 4,
+				      BITMAP_MAX_SHARDS));
+	counts->shards = kcalloc(nr, sizeof(*counts->shards), GFP_KERNEL);
+	if (!counts->shards)
+		return -ENOMEM;
+	for (i = 0; i < nr; i++)
+		spin_lock_init(&counts->shards[i].lock);
+	counts->shard_mask = nr - 1;
+	return 0;
+}
+
+/*
+ * sparse counter pages
+ *
+ * Returns the bitmap_page for 'page', or NULL if its group is not
+ * allocated, in which case every counter in the group is zero.  The
+ * caller holds the page lock (or owns 'counts' exclusively).
+ */
+static inline struct bitmap_page *
+bitmap_page_entry(struct bitmap_counts *counts, unsigned long page)
+{
+	struct bitmap_page_group *grp;
+
+	grp = rcu_dereference_raw(counts->groups[page / BITMAP_GROUP_PAGES]);
+	if (!grp)
+		return NULL;
+	return &grp->pages[page % BITMAP_GROUP_PAGES];
+}
+
+/*
+ * Take a reference on the group holding 'page', allocating it if needed.
+ * Called without the page lock as it may sleep.
+ */
+static struct bitmap_page_group *
+bitmap_get_group(struct bitmap_counts *counts, unsigned long page)
+{
+	unsigned long g = page / BITMAP_GROUP_PAGES;
+	struct bitmap_page_group *grp, *new = NULL;
+	unsigned long flags;
+
+	BUILD_BUG_ON(sizeof(*grp) > BITMAP_GROUP_BYTES);
+
+	for (;;) {
+		spin_lock_irqsave(&counts->group_lock, flags);
+		grp = counts->groups[g];
+		if (!grp && new) {
+			grp = new;
+			new = NULL;
+			rcu_assign_pointer(counts->groups[g], grp);
+			atomic_long_inc(&counts->nr_groups);
+		}
+		if (grp) {
+			grp->active++;
+			spin_unlock_irqrestore(&counts->group_lock, flags);
+			kfree(new);
+			return grp;
+		}
+		spin_unlock_irqrestore(&counts->group_lock, flags);
+		/* can't hijack anything without the group, so must wait */
+		new = kzalloc(sizeof(*new), GFP_NOIO | __GFP_NOFAIL);
+	}
+}
+
+static void bitmap_free_group_rcu(struct rcu_head *head)
+{
+	kfree(container_of(head, struct bitmap_page_group, rcu));
+}
+
+/* drop a reference taken by bitmap_get_group(), freeing the group on last */
+static void bitmap_put_group(struct bitmap_counts *counts, unsigned long page)
+{
+	unsigned long g = page / BITMAP_GROUP_PAGES;
+	struct bitmap_page_group *grp;
+	unsigned long flags;
+
+	spin_lock_irqsave(&counts->group_lock, flags);
+	grp = counts->groups[g];
+	if (--grp->active == 0) {
+		RCU_INIT_POINTER(counts->groups[g], NULL);
+		atomic_long_dec(&counts->nr_groups);
+		call_rcu_sched(&grp->rcu, bitmap_free_group_rcu);
+	}
+	spin_unlock_irqrestore(&counts->group_lock, flags);
+}
+
+/* free all counters of a bitmap_counts nobody else can see any more */
+static void bitmap_free_counts(struct bitmap_counts *counts)
+{
+	unsigned long g, k;
+
+	if (!counts->groups)
+		return;
+	for (g = 0; g < DIV_ROUND_UP(counts->pages, BITMAP_GROUP_PAGES); g++) {
+		struct bitmap_page_group *grp = counts->groups[g];
+
+		if (!grp)
+			continue;
+		for (k = 0; k < BITMAP_GROUP_PAGES; k++)
+			if (!grp->pages[k].hijacked)
+				kfree(grp->pages[k].map);
+		kfree(grp);
+	}
+	kfree(counts->groups);
+	counts->groups = NULL;
+}
+
 /*
  * check a page and, if necessary, allocate it (or hijack it if the alloc fails)
  *
@@ -47,9 +238,11 @@ static inline char *bmname(struct bitmap *bitmap)
  */
 static int bitmap_checkpage(struct bitmap_counts *bitmap,
 			    unsigned long page, int create)
-__releases(bitmap->lock)
-__acquires(bitmap->lock)
+__releases(page shard lock)
+__acquires(page shard lock)
 {
+	struct bitmap_page_group *grp;
+	struct bitmap_page *bp;
 	unsigned char *mappage;
 
 	if (page >= bitmap->pages) {
@@ -60,37 +253,40 @@ __acquires(bitmap->lock)
 		return -EINVAL;
 	}
 
-	if (bitmap->bp[page].hijacked) /* it's hijacked, don't try to alloc */
+	bp = bitmap_page_entry(bitmap, page);
+	if (bp && bp->hijacked) /* it's hijacked, don't try to alloc */
 		return 0;
 
-	if (bitmap->bp[page].map) /* page is already allocated, just return */
+	if (bp && bp->map) /* page is already allocated, just return */
 		return 0;
 
 	if (!create)
 		return -ENOENT;
 
-	/* this page has not been allocated yet */
+	/* this page has not been allocated yet.  The group reference we
+	 * take keeps the group around until the page is freed again. */
 
-	spin_unlock_irq(&bitmap->lock);
+	bitmap_page_unlock_irq(bitmap, page);
+	grp = bitmap_get_group(bitmap, page);
 	mappage = kzalloc(PAGE_SIZE, GFP_NOIO);
-	spin_lock_irq(&bitmap->lock);
+	bitmap_page_lock_irq(bitmap, page);
+	bp = &grp->pages[page % BITMAP_GROUP_PAGES];
 
-	if (mappage == NULL) {
+	if (bp->map || bp->hijacked) {
+		/* somebody beat us to getting the page */
+		kfree(mappage);
+		bitmap_put_group(bitmap, page);
+	} else if (mappage == NULL) {
 		pr_debug("md/bitmap: map page allocation failed, hijacking\n");
 		/* failed - set the hijacked flag so that we can use the
 		 * pointer as a counter */
-		if (!bitmap->bp[page].map)
-			bitmap->bp[page].hijacked = 1;
-	} else if (bitmap->bp[page].map ||
-		   bitmap->bp[page].hijacked) {
-		/* somebody beat us to getting the page */
-		kfree(mappage);
+		bp->hijacked = 1;
 	} else {
 
 		/* no page was in place and we have one, so install it */
 
-		bitmap->bp[page].map = mappage;
-		bitmap->missing_pages--;
+		bp->map = mappage;
+		atomic_long_dec(&bitmap->missing_pages);
 	}
 	return 0;
 }
@@ -100,23 +296,31 @@ __acquires(bitmap->lock)
 /* Note: lock should be held when calling this */
 static void bitmap_checkfree(struct bitmap_counts *bitmap, unsigned long page)
 {
+	struct bitmap_page *bp = bitmap_page_entry(bitmap, page);
 	char *ptr;
 
-	if (bitmap->bp[page].count) /* page is still busy */
+	if (bp->count) /* page is still busy */
 		return;
 
 	/* page is no longer in use, it can be released */
 
-	if (bitmap->bp[page].hijacked) { /* page was hijacked, undo this now */
-		bitmap->bp[page].hijacked = 0;
-		bitmap->bp[page].map = NULL;
+	if (bp->hijacked) { /* page was hijacked, undo this now */
+		bp->hijacked = 0;
+		bp->map = NULL;
 	} else {
 		/* normal case, free the page */
-		ptr = bitmap->bp[page].map;
-		bitmap->bp[page].map = NULL;
-		bitmap->missing_pages++;
+		ptr = bp->map;
+		bp->map = NULL;
+		atomic_long_inc(&bitmap->missing_pages);
 		kfree(ptr);
 	}
+	bp->pending = 0;
+	/* keep the clearing history of a page that was just active,
+	 * otherwise the group may go now */
+	if ((bp->heat || bp->recent) && !bp->warm)
+		bp->warm = 1;
+	else
+		bitmap_put_group(bitmap, page);
 }
 
 /*
@@ -191,14 +395,27 @@ static struct md_rdev *next_active_rdev(struct md_rdev *rdev, struct mddev *mdde
 	return NULL;
 }
 
-static int write_sb_page(struct bitmap *bitmap, struct page *page, int wait)
+/*
+ * Write 'nr' bitmap pages with consecutive indexes to every active device,
+ * one multi-page bio per device where the queue allows it.  Returns the
+ * number of bios submitted or -EINVAL if the bitmap would overlap data
+ * or metadata.
+ */
+static int write_sb_pages(struct bitmap *bitmap, struct page **pages, int nr,
+			  int wait)
 {
 	struct md_rdev *rdev;
 	struct block_device *bdev;
 	struct mddev *mddev = bitmap->mddev;
 	struct bitmap_storage *store = &bitmap->storage;
+	struct page *page = pages[nr - 1];	/* the checks below are
+						 * monotonic in the index, so
+						 * checking the last page
+						 * covers the whole run */
+	int bios;
 
 restart:
+	bios = 0;
 	rdev = NULL;
 	while ((rdev = next_active_rdev(rdev, mddev)) != NULL) {
 		int size = PAGE_SIZE;
@@ -248,21 +465,36 @@ restart:
 		} else {
 			/* DATA METADATA BITMAP - no problems */
 		}
-		md_super_write(mddev, rdev,
-			       rdev->sb_start + offset
-			       + page->index * (PAGE_SIZE/512),
-			       size,
-			       page);
+		if (nr == 1) {
+			md_super_write(mddev, rdev,
+				       rdev->sb_start + offset
+				       + page->index * (PAGE_SIZE/512),
+				       size,
+				       page);
+			bios++;
+		} else
+			bios += md_super_write_pages(mddev, rdev,
+						     rdev->sb_start + offset
+						     + pages[0]->index
+						     * (PAGE_SIZE/512),
+						     pages, nr, size);
 	}
 
 	if (wait && md_super_wait(mddev) < 0)
 		goto restart;
-	return 0;
+	return bios;
 
  bad_alignment:
 	return -EINVAL;
 }
 
+static int write_sb_page(struct bitmap *bitmap, struct page *page, int wait)
+{
+	int ret = write_sb_pages(bitmap, &page, 1, wait);
+
+	return ret < 0 ? ret : 0;
+}
+
 static void bitmap_file_kick(struct bitmap *bitmap);
 /*
  * write out a page to a file
@@ -900,6 +1132,36 @@ static void bitmap_file_clear_bit(struct bitmap *bitmap, sector_t block)
 	}
 }
 
+/* write nr consecutive filemap pages, from start, as one run */
+static void bitmap_unplug_run(struct bitmap *bitmap, unsigned long start,
+			      unsigned long nr)
+{
+	int bios;
+
+	if (!nr)
+		return;
+	bios = write_sb_pages(bitmap, &bitmap->storage.filemap[start], nr, 0);
+	if (bios < 0)
+		set_bit(BITMAP_WRITE_ERROR, &bitmap->flags);
+	else
+		atomic_long_add(bios, &bitmap->unplug_bios);
+}
+
+static void bitmap_account_unplug(struct bitmap *bitmap, u64 start,
+				  unsigned long pages)
+{
+	s64 ns = local_clock() - start;
+	int slot = 0;
+
+	md_lat_record(bitmap->mddev, MD_LAT_BITMAP_UNPLUG, start);
+	if (ns >= NSEC_PER_USEC)
+		slot = min_t(int, ilog2(div_u64(ns, NSEC_PER_USEC)) + 1,
+			     BITMAP_UNPLUG_HIST_SLOTS - 1);
+	atomic_long_inc(&bitmap->unplug_hist[slot]);
+	atomic_long_inc(&bitmap->unplugs);
+	atomic_long_add(pages, &bitmap->unplug_pages);
+}
+
 /* this gets called when the md device is ready to unplug its underlying
  * (slave) device queues -- before we let any writes go down, we need to
  * sync the dirty pages of the bitmap file to disk */
@@ -907,14 +1169,18 @@ void bitmap_unplug(struct bitmap *bitmap)
 {
 	unsigned long i;
 	int dirty, need_write;
-	int writing = 0;
+	unsigned long writing = 0;
+	unsigned long run_start = 0, run_len = 0;
+	u64 start = 0;
 
 	if (!bitmap || !bitmap->storage.filemap ||
 	    test_bit(BITMAP_STALE, &bitmap->flags))
 		return;
 
 	/* look at each page to see if there are any set bits that need to be
-	 * flushed out to disk */
+	 * flushed out to disk.  Pages in the superblock area are gathered
+	 * into runs of consecutive pages, each written with one bio per
+	 * device, and all runs are in flight before we wait. */
 	for (i = 0; i < bitmap->storage.file_pages; i++) {
 		if (!bitmap->storage.filemap)
 			return;
@@ -922,15 +1188,30 @@ void bitmap_unplug(struct bitmap *bitmap)
 		need_write = test_and_clear_page_attr(bitmap, i,
 						      BITMAP_PAGE_NEEDWRITE);
 		if (dirty || need_write) {
-			if (!writing)
+			if (!writing) {
+				start = md_lat_start();
 				bitmap_wait_writes(bitmap);
+			}
 			clear_page_attr(bitmap, i, BITMAP_PAGE_PENDING);
-			write_page(bitmap, bitmap->storage.filemap[i], 0);
-			writing = 1;
+			writing++;
+			if (bitmap->storage.file) {
+				write_page(bitmap, bitmap->storage.filemap[i], 0);
+				continue;
+			}
+			if (run_len && run_start + run_len == i) {
+				run_len++;
+				continue;
+			}
+			bitmap_unplug_run(bitmap, run_start, run_len);
+			run_start = i;
+			run_len = 1;
 		}
 	}
-	if (writing)
+	bitmap_unplug_run(bitmap, run_start, run_len);
+	if (writing) {
 		bitmap_wait_writes(bitmap);
+		bitmap_account_unplug(bitmap, start, writing);
+	}
 
 	if (test_bit(BITMAP_WRITE_ERROR, &bitmap->flags))
 		bitmap_file_kick(bitmap);
@@ -1094,7 +1375,8 @@ static void bitmap_count_page(struct bitmap_counts *bitmap,
 {
 	sector_t chunk = offset >> bitmap->chunkshift;
 	unsigned long page = chunk >> PAGE_COUNTER_SHIFT;
-	bitmap->bp[page].count += inc;
+	bitmap_page_entry(bitmap, page)->count += inc;
+	atomic_long_add(inc, &bitmap->dirty_chunks);
 	bitmap_checkfree(bitmap, page);
 }
 
@@ -1102,7 +1384,7 @@ static void bitmap_set_pending(struct bitmap_counts *bitmap, sector_t offset)
 {
 	sector_t chunk = offset >> bitmap->chunkshift;
 	unsigned long page = chunk >> PAGE_COUNTER_SHIFT;
-	struct bitmap_page *bp = &bitmap->bp[page];
+	struct bitmap_page *bp = bitmap_page_entry(bitmap, page);
 
 	if (!bp->pending)
 		bp->pending = 1;
@@ -1112,6 +1394,71 @@ static bitmap_counter_t *bitmap_get_counter(struct bitmap_counts *bitmap,
 					    sector_t offset, sector_t *blocks,
 					    int create);
 
+/*
+ * Adaptive clearing.  Clearing a bit costs a bitmap write and so does
+ * setting it again, so a region that is rewritten every few seconds is
+ * better left set.  Each counter page tracks how often its bits get set
+ * again within BITMAP_RECENT_PASSES daemon passes of being cleared
+ * ('heat').  Bits on pages at least BITMAP_HEAT_HOLD hot stay set while
+ * the page keeps being written; bits on pages with no heat are cleared
+ * after one idle pass instead of two, which keeps the resync exposure
+ * after a crash small.  Heat decays by one on every pass.
+ */
+#define BITMAP_HEAT_MAX		8
+#define BITMAP_HEAT_HOLD	2
+#define BITMAP_RECENT_PASSES	4
+
+/* a bit on this page is being set, page lock held */
+static void bitmap_page_dirtied(struct bitmap *bitmap, sector_t offset,
+				bitmap_counter_t old)
+{
+	struct bitmap_counts *counts = &bitmap->counts;
+	struct bitmap_page *bp;
+
+	bp = bitmap_page_entry(counts, bitmap_counter_page(counts, offset));
+	if (old == 0 && bp->recent) {
+		bp->heat = min(bp->heat + 2, BITMAP_HEAT_MAX);
+		atomic_long_inc(&bitmap->clear_redirtied);
+	} else if (old == 1 && bp->heat >= BITMAP_HEAT_HOLD) {
+		bp->heat = min(bp->heat + 1, BITMAP_HEAT_MAX);
+		if (bitmap->adaptive_clear)
+			atomic_long_inc(&bitmap->clear_saved);
+	}
+}
+
+/*
+ * Age the clearing state of a page once per daemon pass.  Returns false
+ * if the page entry has gone away.
+ */
+static bool bitmap_page_cool(struct bitmap_counts *counts, unsigned long page,
+			     struct bitmap_page *bp)
+{
+	if (bp->recent)
+		bp->recent--;
+	if (bp->heat)
+		bp->heat--;
+	if (bp->warm && !bp->heat && !bp->recent) {
+		bp->warm = 0;
+		bitmap_put_group(counts, page);
+		return bitmap_page_entry(counts, page) != NULL;
+	}
+	return true;
+}
+
+/* clear a counter that has no writes outstanding, page lock held */
+static void bitmap_clear_counter(struct bitmap *bitmap, sector_t block,
+				 bitmap_counter_t *bmc)
+{
+	struct bitmap_counts *counts = &bitmap->counts;
+
+	/* before bitmap_count_page() may free the page */
+	bitmap_page_entry(counts, bitmap_counter_page(counts, block))->recent =
+		BITMAP_RECENT_PASSES;
+	*bmc = 0;
+	bitmap_count_page(counts, block, -1);
+	bitmap_file_clear_bit(bitmap, block);
+}
+
 /*
  * bitmap daemon -- periodically wakes up to clean bits and flush pages
  *			out to disk
@@ -1122,6 +1469,9 @@ void bitmap_daemon_work(struct mddev *mddev)
 	struct bitmap *bitmap;
 	unsigned long j;
 	unsigned long nextpage;
+	unsigned long lockedpage = 0;
+	bool locked = false;
+	bool hot = false, cold = false;
 	sector_t blocks;
 	struct bitmap_counts *counts;
 
@@ -1174,19 +1524,42 @@ void bitmap_daemon_work(struct mddev *mddev)
 	 * decrement and handle accordingly.
 	 */
 	counts = &bitmap->counts;
-	spin_lock_irq(&counts->lock);
 	nextpage = 0;
 	for (j = 0; j < counts->chunks; j++) {
 		bitmap_counter_t *bmc;
 		sector_t  block = (sector_t)j << counts->chunkshift;
+		unsigned long page = j >> PAGE_COUNTER_SHIFT;
+		struct bitmap_page *bp;
 
 		if (j == nextpage) {
+			/* move on to the next page, and its lock */
+			if (locked)
+				bitmap_page_unlock_irq(counts, lockedpage);
+			locked = false;
+			if (!ACCESS_ONCE(counts->groups[page /
+							BITMAP_GROUP_PAGES])) {
+				/* nothing in this group, skip all of it */
+				nextpage = (page / BITMAP_GROUP_PAGES + 1) *
+					BITMAP_GROUP_PAGES << PAGE_COUNTER_SHIFT;
+				j = nextpage - 1;
+				continue;
+			}
+			bitmap_page_lock_irq(counts, page);
+			locked = true;
+			lockedpage = page;
 			nextpage += PAGE_COUNTER_RATIO;
-			if (!counts->bp[j >> PAGE_COUNTER_SHIFT].pending) {
+			bp = bitmap_page_entry(counts, page);
+			if (bp && (bp->pending || bp->heat || bp->recent) &&
+			    !bitmap_page_cool(counts, page, bp))
+				bp = NULL;
+			if (!bp || !bp->pending) {
 				j |= PAGE_COUNTER_MASK;
 				continue;
 			}
-			counts->bp[j >> PAGE_COUNTER_SHIFT].pending = 0;
+			bp->pending = 0;
+			hot = bitmap->adaptive_clear &&
+				bp->heat >= BITMAP_HEAT_HOLD;
+			cold = bitmap->adaptive_clear && !bp->heat;
 		}
 		bmc = bitmap_get_counter(counts,
 					 block,
@@ -1196,18 +1569,26 @@ void bitmap_daemon_work(struct mddev *mddev)
 			j |= PAGE_COUNTER_MASK;
 			continue;
 		}
-		if (*bmc == 1 && !bitmap->need_sync) {
+		if (*bmc == 1 && !bitmap->need_sync && hot) {
+			/* still being rewritten, keep it for now */
+			bitmap_set_pending(counts, block);
+			bitmap->allclean = 0;
+			atomic_long_inc(&bitmap->clear_held);
+		} else if (*bmc == 1 && !bitmap->need_sync) {
 			/* We can clear the bit */
-			*bmc = 0;
-			bitmap_count_page(counts, block, -1);
-			bitmap_file_clear_bit(bitmap, block);
+			bitmap_clear_counter(bitmap, block, bmc);
+		} else if (*bmc == 2 && !bitmap->need_sync && cold) {
+			/* idle page, no need to wait another pass */
+			bitmap_clear_counter(bitmap, block, bmc);
+			atomic_long_inc(&bitmap->clear_early);
 		} else if (*bmc && *bmc <= 2) {
 			*bmc = 1;
 			bitmap_set_pending(counts, block);
 			bitmap->allclean = 0;
 		}
 	}
-	spin_unlock_irq(&counts->lock);
+	if (locked)
+		bitmap_page_unlock_irq(counts, lockedpage);
 
 	bitmap_wait_writes(bitmap);
 	/* Now start writeout on any page in NEEDWRITE that isn't DIRTY.
@@ -1243,50 +1624,66 @@ void bitmap_daemon_work(struct mddev *mddev)
 static bitmap_counter_t *bitmap_get_counter(struct bitmap_counts *bitmap,
 					    sector_t offset, sector_t *blocks,
 					    int create)
-__releases(bitmap->lock)
-__acquires(bitmap->lock)
+__releases(page shard lock)
+__acquires(page shard lock)
 {
-	/* If 'create', we might release the lock and reclaim it.
+	/* The caller holds the lock of the page covering 'offset'.
+	 * If 'create', we might release the lock and reclaim it.
 	 * The lock must have been taken with interrupts enabled.
 	 * If !create, we don't release the lock.
 	 */
 	sector_t chunk = offset >> bitmap->chunkshift;
 	unsigned long page = chunk >> PAGE_COUNTER_SHIFT;
 	unsigned long pageoff = (chunk & PAGE_COUNTER_MASK) << COUNTER_BYTE_SHIFT;
+	struct bitmap_page *bp = NULL;
 	sector_t csize;
 	int err;
 
 	err = bitmap_checkpage(bitmap, page, create);
+	if (err != -EINVAL)
+		bp = bitmap_page_entry(bitmap, page);
 
-	if (bitmap->bp[page].hijacked ||
-	    bitmap->bp[page].map == NULL)
-		csize = ((sector_t)1) << (bitmap->chunkshift +
-					  PAGE_COUNTER_SHIFT - 1);
-	else
-		csize = ((sector_t)1) << bitmap->chunkshift;
-	*blocks = csize - (offset & (csize - 1));
+	if (!bp) {
+		/* the whole group is clean, up to the start of the next */
+		sector_t next = (sector_t)(page / BITMAP_GROUP_PAGES + 1) *
+			BITMAP_GROUP_PAGES;
+
+		*blocks = (next << (bitmap->chunkshift + PAGE_COUNTER_SHIFT)) -
+			offset;
+	} else {
+		if (bp->hijacked || bp->map == NULL)
+			csize = ((sector_t)1) << (bitmap->chunkshift +
+						  PAGE_COUNTER_SHIFT - 1);
+		else
+			csize = ((sector_t)1) << bitmap->chunkshift;
+		*blocks = csize - (offset & (csize - 1));
+	}
 
 	if (err < 0)
 		return NULL;
 
 	/* now locked ... */
 
-	if (bitmap->bp[page].hijacked) { /* hijacked pointer */
+	if (bp->hijacked) { /* hijacked pointer */
 		/* should we use the first or second counter field
 		 * of the hijacked pointer? */
 		int hi = (pageoff > PAGE_COUNTER_MASK);
 		return  &((bitmap_counter_t *)
-			  &bitmap->bp[page].map)[hi];
+			  &bp->map)[hi];
 	} else /* page is allocated */
 		return (bitmap_counter_t *)
-			&(bitmap->bp[page].map[pageoff]);
+			&(bp->map[pageoff]);
 }
 
 int bitmap_startwrite(struct bitmap *bitmap, sector_t offset, unsigned long sectors, int behind)
 {
+	u64 start;
+
 	if (!bitmap)
 		return 0;
 
+	start = md_lat_start();
+
 	if (behind) {
 		int bw;
 		atomic_inc(&bitmap->behind_writes);
@@ -1301,12 +1698,14 @@ int bitmap_startwrite(struct bitmap *bitmap, sector_t offset, unsigned long sect
 	while (sectors) {
 		sector_t blocks;
 		bitmap_counter_t *bmc;
+		unsigned long page = bitmap_counter_page(&bitmap->counts,
+							 offset);
 
-		spin_lock_irq(&bitmap->counts.lock);
+		bitmap_page_lock_irq(&bitmap->counts, page);
 		bmc = bitmap_get_counter(&bitmap->counts, offset, &blocks, 1);
 		if (!bmc) {
-			spin_unlock_irq(&bitmap->counts.lock);
-			return 0;
+			bitmap_page_unlock_irq(&bitmap->counts, page);
+			break;
 		}
 
 		if (unlikely(COUNTER(*bmc) == COUNTER_MAX)) {
@@ -1317,12 +1716,15 @@ int bitmap_startwrite(struct bitmap *bitmap, sector_t offset, unsigned long sect
 			 */
 			prepare_to_wait(&bitmap->overflow_wait, &__wait,
 					TASK_UNINTERRUPTIBLE);
-			spin_unlock_irq(&bitmap->counts.lock);
+			bitmap_page_unlock_irq(&bitmap->counts, page);
 			schedule();
 			finish_wait(&bitmap->overflow_wait, &__wait);
 			continue;
 		}
 
+		if (*bmc <= 1)
+			bitmap_page_dirtied(bitmap, offset, *bmc);
+
 		switch (*bmc) {
 		case 0:
 			bitmap_file_set_bit(bitmap, offset);
@@ -1334,7 +1736,7 @@ int bitmap_startwrite(struct bitmap *bitmap, sector_t offset, unsigned long sect
 
 		(*bmc)++;
 
-		spin_unlock_irq(&bitmap->counts.lock);
+		bitmap_page_unlock_irq(&bitmap->counts, page);
 
 		offset += blocks;
 		if (sectors > blocks)
@@ -1342,6 +1744,7 @@ int bitmap_startwrite(struct bitmap *bitmap, sector_t offset, unsigned long sect
 		else
 			sectors = 0;
 	}
+	md_lat_record(bitmap->mddev, MD_LAT_BITMAP_START, start);
 	return 0;
 }
 EXPORT_SYMBOL(bitmap_startwrite);
@@ -1363,11 +1766,14 @@ void bitmap_endwrite(struct bitmap *bitmap, sector_t offset, unsigned long secto
 		sector_t blocks;
 		unsigned long flags;
 		bitmap_counter_t *bmc;
+		unsigned long page = bitmap_counter_page(&bitmap->counts,
+							 offset);
 
-		spin_lock_irqsave(&bitmap->counts.lock, flags);
+		bitmap_page_lock_irqsave(&bitmap->counts, page, &flags);
 		bmc = bitmap_get_counter(&bitmap->counts, offset, &blocks, 0);
 		if (!bmc) {
-			spin_unlock_irqrestore(&bitmap->counts.lock, flags);
+			bitmap_page_unlock_irqrestore(&bitmap->counts, page,
+						      flags);
 			return;
 		}
 
@@ -1389,7 +1795,7 @@ void bitmap_endwrite(struct bitmap *bitmap, sector_t offset, unsigned long secto
 			bitmap_set_pending(&bitmap->counts, offset);
 			bitmap->allclean = 0;
 		}
-		spin_unlock_irqrestore(&bitmap->counts.lock, flags);
+		bitmap_page_unlock_irqrestore(&bitmap->counts, page, flags);
 		offset += blocks;
 		if (sectors > blocks)
 			sectors -= blocks;
@@ -1403,12 +1809,14 @@ static int __bitmap_start_sync(struct bitmap *bitmap, sector_t offset, sector_t
 			       int degraded)
 {
 	bitmap_counter_t *bmc;
+	unsigned long page;
 	int rv;
 	if (bitmap == NULL) {/* FIXME or bitmap set as 'failed' */
 		*blocks = 1024;
 		return 1; /* always resync if no bitmap */
 	}
-	spin_lock_irq(&bitmap->counts.lock);
+	page = bitmap_counter_page(&bitmap->counts, offset);
+	bitmap_page_lock_irq(&bitmap->counts, page);
 	bmc = bitmap_get_counter(&bitmap->counts, offset, blocks, 0);
 	rv = 0;
 	if (bmc) {
@@ -1423,7 +1831,7 @@ static int __bitmap_start_sync(struct bitmap *bitmap, sector_t offset, sector_t
 			}
 		}
 	}
-	spin_unlock_irq(&bitmap->counts.lock);
+	bitmap_page_unlock_irq(&bitmap->counts, page);
 	return rv;
 }
 
@@ -1455,12 +1863,14 @@ void bitmap_end_sync(struct bitmap *bitmap, sector_t offset, sector_t *blocks, i
 {
 	bitmap_counter_t *bmc;
 	unsigned long flags;
+	unsigned long page;
 
 	if (bitmap == NULL) {
 		*blocks = 1024;
 		return;
 	}
-	spin_lock_irqsave(&bitmap->counts.lock, flags);
+	page = bitmap_counter_page(&bitmap->counts, offset);
+	bitmap_page_lock_irqsave(&bitmap->counts, page, &flags);
 	bmc = bitmap_get_counter(&bitmap->counts, offset, blocks, 0);
 	if (bmc == NULL)
 		goto unlock;
@@ -1478,7 +1888,7 @@ void bitmap_end_sync(struct bitmap *bitmap, sector_t offset, sector_t *blocks, i
 		}
 	}
  unlock:
-	spin_unlock_irqrestore(&bitmap->counts.lock, flags);
+	bitmap_page_unlock_irqrestore(&bitmap->counts, page, flags);
 }
 EXPORT_SYMBOL(bitmap_end_sync);
 
@@ -1538,10 +1948,12 @@ static void bitmap_set_memory_bits(struct bitmap *bitmap, sector_t offset, int n
 
 	sector_t secs;
 	bitmap_counter_t *bmc;
-	spin_lock_irq(&bitmap->counts.lock);
+	unsigned long page = bitmap_counter_page(&bitmap->counts, offset);
+
+	bitmap_page_lock_irq(&bitmap->counts, page);
 	bmc = bitmap_get_counter(&bitmap->counts, offset, &secs, 1);
 	if (!bmc) {
-		spin_unlock_irq(&bitmap->counts.lock);
+		bitmap_page_unlock_irq(&bitmap->counts, page);
 		return;
 	}
 	if (!*bmc) {
@@ -1550,7 +1962,7 @@ static void bitmap_set_memory_bits(struct bitmap *bitmap, sector_t offset, int n
 		bitmap_set_pending(&bitmap->counts, offset);
 		bitmap->allclean = 0;
 	}
-	spin_unlock_irq(&bitmap->counts.lock);
+	bitmap_page_unlock_irq(&bitmap->counts, page);
 }
 
 /* dirty the memory and file bits for bitmap chunks "s" to "e" */
@@ -1600,9 +2012,6 @@ void bitmap_flush(struct mddev *mddev)
  */
 static void bitmap_free(struct bitmap *bitmap)
 {
-	unsigned long k, pages;
-	struct bitmap_page *bp;
-
 	if (!bitmap) /* there was no bitmap */
 		return;
 
@@ -1616,16 +2025,12 @@ static void bitmap_free(struct bitmap *bitmap)
 	/* release the bitmap file  */
 	bitmap_file_unmap(&bitmap->storage);
 
-	bp = bitmap->counts.bp;
-	pages = bitmap->counts.pages;
-
 	/* free all allocated memory */
 
-	if (bp) /* deallocate the page memory */
-		for (k = 0; k < pages; k++)
-			if (bp[k].map && !bp[k].hijacked)
-				kfree(bp[k].map);
-	kfree(bp);
+	bitmap_free_counts(&bitmap->counts);
+	/* groups released while running may still be waiting to be freed */
+	rcu_barrier_sched();
+	kfree(bitmap->counts.shards);
 	kfree(bitmap);
 }
 
@@ -1674,7 +2079,13 @@ int bitmap_create(struct mddev *mddev)
 	if (!bitmap)
 		return -ENOMEM;
 
-	spin_lock_init(&bitmap->counts.lock);
+	err = bitmap_alloc_shards(&bitmap->counts);
+	if (err) {
+		kfree(bitmap);
+		return err;
+	}
+	spin_lock_init(&bitmap->counts.group_lock);
+	bitmap->adaptive_clear = 1;
 	atomic_set(&bitmap->pending_writes, 0);
 	init_waitqueue_head(&bitmap->write_wait);
 	init_waitqueue_head(&bitmap->overflow_wait);
@@ -1789,7 +2200,7 @@ EXPORT_SYMBOL_GPL(bitmap_load);
 
 void bitmap_status(struct seq_file *seq, struct bitmap *bitmap)
 {
-	unsigned long chunk_kb;
+	unsigned long chunk_kb, used;
 	struct bitmap_counts *counts;
 
 	if (!bitmap)
@@ -1798,12 +2209,15 @@ void bitmap_status(struct seq_file *seq, struct bitmap *bitmap)
 	counts = &bitmap->counts;
 
 	chunk_kb = bitmap->mddev->bitmap_info.chunksize >> 10;
+	used = counts->pages - atomic_long_read(&counts->missing_pages);
+	/* memory used includes the groups describing the pages */
 	seq_printf(seq, "bitmap: %lu/%lu pages [%luKB], "
 		   "%lu%s chunk",
-		   counts->pages - counts->missing_pages,
+		   used,
 		   counts->pages,
-		   (counts->pages - counts->missing_pages)
-		   << (PAGE_SHIFT - 10),
+		   (used << (PAGE_SHIFT - 10)) +
+		   ((atomic_long_read(&counts->nr_groups) *
+		     sizeof(struct bitmap_page_group)) >> 10),
 		   chunk_kb ? chunk_kb : bitmap->mddev->bitmap_info.chunksize,
 		   chunk_kb ? "KB" : "B");
 	if (bitmap->storage.file) {
@@ -1835,7 +2249,7 @@ int bitmap_resize(struct bitmap *bitmap, sector_t blocks,
 	int chunkshift;
 	int ret = 0;
 	long pages;
-	struct bitmap_page *new_bp;
+	struct bitmap_page_group **new_groups;
 
 	if (bitmap->storage.file && !init) {
 		pr_info("md: cannot resize file-based bitmap\n");
@@ -1884,9 +2298,10 @@ int bitmap_resize(struct bitmap *bitmap, sector_t blocks,
 
 	pages = DIV_ROUND_UP(chunks, PAGE_COUNTER_RATIO);
 
-	new_bp = kzalloc(pages * sizeof(*new_bp), GFP_KERNEL);
+	new_groups = kcalloc(DIV_ROUND_UP(pages, BITMAP_GROUP_PAGES),
+			     sizeof(*new_groups), GFP_KERNEL);
 	ret = -ENOMEM;
-	if (!new_bp) {
+	if (!new_groups) {
 		bitmap_file_unmap(&store);
 		goto err;
 	}
@@ -1905,9 +2320,11 @@ int bitmap_resize(struct bitmap *bitmap, sector_t blocks,
 	bitmap->storage = store;
 
 	old_counts = bitmap->counts;
-	bitmap->counts.bp = new_bp;
+	bitmap->counts.groups = new_groups;
+	atomic_long_set(&bitmap->counts.nr_groups, 0);
+	atomic_long_set(&bitmap->counts.dirty_chunks, 0);
 	bitmap->counts.pages = pages;
-	bitmap->counts.missing_pages = pages;
+	atomic_long_set(&bitmap->counts.missing_pages, pages);
 	bitmap->counts.chunkshift = chunkshift;
 	bitmap->counts.chunks = chunks;
 	bitmap->mddev->bitmap_info.chunksize = 1 << (chunkshift +
@@ -1916,9 +2333,10 @@ int bitmap_resize(struct bitmap *bitmap, sector_t blocks,
 	blocks = min(old_counts.chunks << old_counts.chunkshift,
 		     chunks << chunkshift);
 
-	spin_lock_irq(&bitmap->counts.lock);
+	/* old_counts is private now, only the new pages need locking */
 	for (block = 0; block < blocks; ) {
 		bitmap_counter_t *bmc_old, *bmc_new;
+		unsigned long page;
 		int set;
 
 		bmc_old = bitmap_get_counter(&old_counts, block,
@@ -1926,6 +2344,8 @@ int bitmap_resize(struct bitmap *bitmap, sector_t blocks,
 		set = bmc_old && NEEDED(*bmc_old);
 
 		if (set) {
+			page = bitmap_counter_page(&bitmap->counts, block);
+			bitmap_page_lock_irq(&bitmap->counts, page);
 			bmc_new = bitmap_get_counter(&bitmap->counts, block,
 						     &new_blocks, 1);
 			if (*bmc_new == 0) {
@@ -1944,24 +2364,24 @@ int bitmap_resize(struct bitmap *bitmap, sector_t blocks,
 						   block);
 			}
 			*bmc_new |= NEEDED_MASK;
+			bitmap_page_unlock_irq(&bitmap->counts, page);
 			if (new_blocks < old_blocks)
 				old_blocks = new_blocks;
 		}
 		block += old_blocks;
 	}
 
-	if (bitmap->counts.bp != old_counts.bp) {
-		unsigned long k;
-		for (k = 0; k < old_counts.pages; k++)
-			if (!old_counts.bp[k].hijacked)
-				kfree(old_counts.bp[k].map);
-		kfree(old_counts.bp);
-	}
+	/* the array is quiesced, nobody can be looking at the old groups */
+	bitmap_free_counts(&old_counts);
 
 	if (!init) {
 		int i;
 		while (block < (chunks << chunkshift)) {
 			bitmap_counter_t *bmc;
+			unsigned long page;
+
+			page = bitmap_counter_page(&bitmap->counts, block);
+			bitmap_page_lock_irq(&bitmap->counts, page);
 			bmc = bitmap_get_counter(&bitmap->counts, block,
 						 &new_blocks, 1);
 			if (bmc) {
@@ -1976,12 +2396,12 @@ int bitmap_resize(struct bitmap *bitmap, sector_t blocks,
 							   block);
 				}
 			}
+			bitmap_page_unlock_irq(&bitmap->counts, page);
 			block += new_blocks;
 		}
 		for (i = 0; i < bitmap->storage.file_pages; i++)
 			set_page_attr(bitmap, i, BITMAP_PAGE_DIRTY);
 	}
-	spin_unlock_irq(&bitmap->counts.lock);
 
 	if (!init) {
 		bitmap_unplug(bitmap);
@@ -2321,6 +2741,229 @@ static struct md_sysfs_entry max_backlog_used =
 __ATTR(max_backlog_used, S_IRUGO | S_IWUSR,
        behind_writes_used_show, behind_writes_used_reset);
 
+/*
+ * Counter lock statistics, summed over all shards.  Writing 1 resets and
+ * enables them, 0 disables them.
+ */
+static ssize_t
+lock_stats_show(struct mddev *mddev, char *page)
+{
+	struct bitmap_counts *counts;
+	u64 acquired = 0, contended = 0, hold_ns = 0, max_hold_ns = 0;
+	unsigned int i;
+	ssize_t ret;
+
+	spin_lock(&mddev->lock);
+	if (mddev->bitmap == NULL) {
+		spin_unlock(&mddev->lock);
+		return sprintf(page, "\n");
+	}
+	counts = &mddev->bitmap->counts;
+	for (i = 0; i <= counts->shard_mask; i++) {
+		struct bitmap_lock_shard *shard = &counts->shards[i];
+
+		acquired += shard->acquired;
+		contended += shard->contended;
+		hold_ns += shard->hold_ns;
+		max_hold_ns = max(max_hold_ns, shard->max_hold_ns);
+	}
+	ret = sprintf(page, "enabled %d\nshards %u\nacquired %llu\n"
+		      "contended %llu\nhold_ns %llu\nmax_hold_ns %llu\n",
+		      counts->lock_stats, counts->shard_mask + 1,
+		      (unsigned long long)acquired,
+		      (unsigned long long)contended,
+		      (unsigned long long)hold_ns,
+		      (unsigned long long)max_hold_ns);
+	spin_unlock(&mddev->lock);
+	return ret;
+}
+
+static ssize_t
+lock_stats_store(struct mddev *mddev, const char *buf, size_t len)
+{
+	struct bitmap_counts *counts;
+	unsigned long enable;
+	unsigned int i;
+	int rv;
+
+	rv = kstrtoul(buf, 10, &enable);
+	if (rv)
+		return rv;
+
+	rv = mddev_lock(mddev);
+	if (rv)
+		return rv;
+	if (mddev->bitmap == NULL) {
+		mddev_unlock(mddev);
+		return -ENOENT;
+	}
+	counts = &mddev->bitmap->counts;
+	counts->lock_stats = 0;
+	if (enable) {
+		for (i = 0; i <= counts->shard_mask; i++) {
+			struct bitmap_lock_shard *shard = &counts->shards[i];
+
+			spin_lock_irq(&shard->lock);
+			shard->acquired = 0;
+			shard->contended = 0;
+			shard->hold_ns = 0;
+			shard->max_hold_ns = 0;
+			spin_unlock_irq(&shard->lock);
+		}
+		counts->lock_stats = 1;
+	}
+	mddev_unlock(mddev);
+	return len;
+}
+
+static struct md_sysfs_entry bitmap_lock_stats =
+__ATTR(lock_stats, S_IRUGO | S_IWUSR, lock_stats_show, lock_stats_store);
+
+/*
+ * Latency of bitmap_unplug() calls that had pages to write, as a log2
+ * histogram: each line is the lower bound of a bucket in usecs and its
+ * count.  Any write resets it.
+ */
+static ssize_t
+unplug_latency_show(struct mddev *mddev, char *page)
+{
+	struct bitmap *bitmap;
+	ssize_t len;
+	int i;
+
+	spin_lock(&mddev->lock);
+	bitmap = mddev->bitmap;
+	if (bitmap == NULL) {
+		spin_unlock(&mddev->lock);
+		return sprintf(page, "\n");
+	}
+	len = sprintf(page, "unplugs %ld\npages %ld\nbios %ld\n",
+		      atomic_long_read(&bitmap->unplugs),
+		      atomic_long_read(&bitmap->unplug_pages),
+		      atomic_long_read(&bitmap->unplug_bios));
+	for (i = 0; i < BITMAP_UNPLUG_HIST_SLOTS; i++)
+		len += sprintf(page + len, "%lu %ld\n",
+			       i ? 1UL << (i - 1) : 0UL,
+			       atomic_long_read(&bitmap->unplug_hist[i]));
+	spin_unlock(&mddev->lock);
+	return len;
+}
+
+static ssize_t
+unplug_latency_reset(struct mddev *mddev, const char *buf, size_t len)
+{
+	struct bitmap *bitmap;
+	int i;
+
+	spin_lock(&mddev->lock);
+	bitmap = mddev->bitmap;
+	if (bitmap) {
+		atomic_long_set(&bitmap->unplugs, 0);
+		atomic_long_set(&bitmap->unplug_pages, 0);
+		atomic_long_set(&bitmap->unplug_bios, 0);
+		for (i = 0; i < BITMAP_UNPLUG_HIST_SLOTS; i++)
+			atomic_long_set(&bitmap->unplug_hist[i], 0);
+	}
+	spin_unlock(&mddev->lock);
+	return len;
+}
+
+static struct md_sysfs_entry bitmap_unplug_latency =
+__ATTR(unplug_latency, S_IRUGO | S_IWUSR,
+       unplug_latency_show, unplug_latency_reset);
+
+static ssize_t
+adaptive_clear_show(struct mddev *mddev, char *page)
+{
+	ssize_t len;
+
+	spin_lock(&mddev->lock);
+	if (mddev->bitmap)
+		len = sprintf(page, "%d\n", mddev->bitmap->adaptive_clear);
+	else
+		len = sprintf(page, "\n");
+	spin_unlock(&mddev->lock);
+	return len;
+}
+
+static ssize_t
+adaptive_clear_store(struct mddev *mddev, const char *buf, size_t len)
+{
+	unsigned long enable;
+	int rv = kstrtoul(buf, 10, &enable);
+
+	if (rv)
+		return rv;
+	if (enable > 1)
+		return -EINVAL;
+
+	rv = mddev_lock(mddev);
+	if (rv)
+		return rv;
+	if (mddev->bitmap == NULL) {
+		mddev_unlock(mddev);
+		return -ENOENT;
+	}
+	mddev->bitmap->adaptive_clear = enable;
+	mddev_unlock(mddev);
+	return len;
+}
+
+static struct md_sysfs_entry bitmap_adaptive_clear =
+__ATTR(adaptive_clear, S_IRUGO | S_IWUSR,
+       adaptive_clear_show, adaptive_clear_store);
+
+/*
+ * What the clearing policy did, and how much of the array would need
+ * resyncing after a crash right now.  Any write resets the event counts.
+ */
+static ssize_t
+clear_stats_show(struct mddev *mddev, char *page)
+{
+	struct bitmap *bitmap;
+	long dirty;
+	ssize_t len;
+
+	spin_lock(&mddev->lock);
+	bitmap = mddev->bitmap;
+	if (bitmap == NULL) {
+		spin_unlock(&mddev->lock);
+		return sprintf(page, "\n");
+	}
+	dirty = atomic_long_read(&bitmap->counts.dirty_chunks);
+	len = sprintf(page, "held %ld\nearly %ld\nredirtied %ld\n"
+		      "writes_saved %ld\ndirty_chunks %ld\n"
+		      "exposure_sectors %llu\n",
+		      atomic_long_read(&bitmap->clear_held),
+		      atomic_long_read(&bitmap->clear_early),
+		      atomic_long_read(&bitmap->clear_redirtied),
+		      atomic_long_read(&bitmap->clear_saved),
+		      dirty,
+		      (unsigned long long)dirty << bitmap->counts.chunkshift);
+	spin_unlock(&mddev->lock);
+	return len;
+}
+
+static ssize_t
+clear_stats_reset(struct mddev *mddev, const char *buf, size_t len)
+{
+	struct bitmap *bitmap;
+
+	spin_lock(&mddev->lock);
+	bitmap = mddev->bitmap;
+	if (bitmap) {
+		atomic_long_set(&bitmap->clear_held, 0);
+		atomic_long_set(&bitmap->clear_early, 0);
+		atomic_long_set(&bitmap->clear_redirtied, 0);
+		atomic_long_set(&bitmap->clear_saved, 0);
+	}
+	spin_unlock(&mddev->lock);
+	return len;
+}
+
+static struct md_sysfs_entry bitmap_clear_stats =
+__ATTR(clear_stats, S_IRUGO | S_IWUSR, clear_stats_show, clear_stats_reset);
+
 static struct attribute *md_bitmap_attrs[] = {
 	&bitmap_location.attr,
 	&bitmap_space.attr,
@@ -2330,6 +2973,10 @@ static struct attribute *md_bitmap_attrs[] = {
 	&bitmap_metadata.attr,
 	&bitmap_can_clear.attr,
 	&max_backlog_used.attr,
+	&bitmap_lock_stats.attr,
+	&bitmap_unplug_latency.attr,
+	&bitmap_adaptive_clear.attr,
+	&bitmap_clear_stats.attr,
 	NULL
 };
 struct attribute_group md_bitmap_group = {
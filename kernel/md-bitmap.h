@@ -170,17 +170,74 @@ struct bitmap_page {
 	 * count of dirty bits on the page
 	 */
 	unsigned int  count:30;
+	/*
+	 * clearing policy, see bitmap_daemon_work(): 'heat' grows when bits
+	 * on this page are set again soon after being cleared, 'recent'
+	 * counts down the daemon passes since a bit here was cleared, and
+	 * 'warm' means the entry holds a group reference to keep both.
+	 */
+	unsigned char heat;
+	unsigned char recent;
+	unsigned char warm;
 };
 
+/*
+ * bitmap_pages are kept in groups that are only allocated while one of
+ * their pages holds counters, so large clean regions of the array cost a
+ * single NULL pointer in counts->groups.  A missing group reads as all
+ * counters zero.  Groups are freed via RCU-sched: lookups happen with a
+ * page lock held and interrupts disabled.
+ * A group, header included, fills a 2 KiB kmalloc object (126 pages on
+ * 64-bit), so BITMAP_GROUP_PAGES is not a power of two.
+ */
+#define BITMAP_GROUP_BYTES 2048
+#define BITMAP_GROUP_PAGES ((BITMAP_GROUP_BYTES - sizeof(struct rcu_head) - \
+			     sizeof(long)) / sizeof(struct bitmap_page))
+
+struct bitmap_page_group {
+	struct rcu_head rcu;
+	unsigned int active;		/* pages with a map or hijacked,
+					 * plus allocations in progress */
+	struct bitmap_page pages[BITMAP_GROUP_PAGES];
+};
+
+/*
+ * Counter pages are protected by a small set of hashed locks instead of
+ * a single lock for the whole bitmap, so writes to different regions of
+ * the array don't contend.  Each shard has its own cache line and carries
+ * hold-time statistics that are only gathered while enabled through
+ * md/bitmap/lock_stats.
+ */
+struct bitmap_lock_shard {
+	spinlock_t lock;
+	u64 since;			/* local_clock() at acquisition */
+	u64 acquired;
+	u64 contended;
+	u64 hold_ns;
+	u64 max_hold_ns;
+} ____cacheline_aligned_in_smp;
+
+#define BITMAP_MAX_SHARDS 256
+
+/* bitmap_unplug() latency, slot n > 0 counts [2^(n-1), 2^n) usecs */
+#define BITMAP_UNPLUG_HIST_SLOTS 20
+
 /* the main bitmap structure - one per mddev */
 struct bitmap {
 
 	struct bitmap_counts {
-		spinlock_t lock;
-		struct bitmap_page *bp;
+		struct bitmap_lock_shard *shards; /* page -> shard is
+						   * page & shard_mask */
+		unsigned int shard_mask;
+		int lock_stats;			/* gather lock statistics */
+		struct bitmap_page_group **groups;
+		spinlock_t group_lock;		/* protects groups[] and
+						 * group->active */
+		atomic_long_t nr_groups;	/* groups allocated */
+		atomic_long_t dirty_chunks;	/* chunks with their bit set */
 		unsigned long pages;		/* total number of pages
 						 * in the bitmap */
-		unsigned long missing_pages;	/* number of pages
+		atomic_long_t missing_pages;	/* number of pages
 						 * not yet allocated */
 		unsigned long chunkshift;	/* chunksize = 2^chunkshift
 						 * (for bitops) */
@@ -212,6 +269,12 @@ struct bitmap {
 	atomic_t behind_writes;
 	unsigned long behind_writes_used; /* highest actual value at runtime */
 
+	int adaptive_clear;		/* hold hot bits, clear idle ones early */
+	atomic_long_t clear_held;	/* clears deferred on hot pages */
+	atomic_long_t clear_early;	/* bits cleared after a single pass */
+	atomic_long_t clear_redirtied;	/* bits set again soon after clearing */
+	atomic_long_t clear_saved;	/* held bits written again */
+
 	/*
 	 * the bitmap daemon - periodically wakes up and sweeps the bitmap
 	 * file, cleaning up bits and flushing out pages to disk as necessary
@@ -222,6 +285,13 @@ struct bitmap {
 
 	atomic_t pending_writes; /* pending writes to the bitmap file */
 	wait_queue_head_t write_wait;
+
+	/* unplugs that wrote something, and what they wrote */
+	atomic_long_t unplugs;
+	atomic_long_t unplug_pages;
+	atomic_long_t unplug_bios;
+	atomic_long_t unplug_hist[BITMAP_UNPLUG_HIST_SLOTS];
+
 	wait_queue_head_t overflow_wait;
 	wait_queue_head_t behind_wait;
 
@@ -42,6 +42,21 @@
  *
  * Requests are always sent to the device.  If they are to fail,
  * we clone the bio and insert a new b_end_io into the chain.
+ *
+ * Independently of the failure modes, requests can be made slow so the
+ * device behaves like slow or jittery hardware.  These are set at run
+ * time through md/faulty/ and combine:
+ *   delay_us      every request is delayed by a fixed amount
+ *   latency_dist  a random extra delay following a distribution given as
+ *                 "percentile:usecs" points, e.g. "50:200 99.9:8000 100:20000".
+ *                 Between points the delay is interpolated linearly,
+ *                 starting from 0:0.
+ *   stall         "period_ms duration_ms": for duration_ms out of every
+ *                 period_ms the device accepts nothing, requests wait
+ *                 for the stall to end.
+ *   bandwidth     KB/sec the device transfers at most, requests queue
+ *                 behind each other.
+ * Delayed requests are held back before being sent to the device.
  */
 
 #define	WriteTransient	0
@@ -62,10 +77,15 @@
 #define	ModeShift	5
 
 #define MaxFault	50
+
+#define MaxDistPoints	8
 #include <linux/blkdev.h>
 #include <linux/module.h>
 #include <linux/raid/md_u.h>
 #include <linux/slab.h>
+#include <linux/ctype.h>
+#include <linux/hrtimer.h>
+#include <linux/random.h>
 #include "md.h"
 #include <linux/seq_file.h>
 
@@ -82,6 +102,17 @@ static void faulty_fail(struct bio *bio, int error)
 	bio_io_error(b);
 }
 
+struct faulty_dist_point {
+	unsigned int pct;	/* in 1/100 of a percent */
+	unsigned int us;
+};
+
+struct faulty_delayed {
+	struct list_head list;
+	struct bio *bio;
+	ktime_t due;
+};
+
 struct faulty_conf {
 	int period[Modes];
 	atomic_t counters[Modes];
@@ -89,8 +120,157 @@ struct faulty_conf {
 	int	modes[MaxFault];
 	int nfaults;
 	struct md_rdev *rdev;
+
+	/* latency emulation, all under delay_lock */
+	spinlock_t delay_lock;
+	unsigned int delay_us;
+	struct faulty_dist_point dist[MaxDistPoints];
+	int ndist;
+	unsigned int stall_period_ms, stall_ms;
+	unsigned int bandwidth;		/* KB/sec, 0 = unlimited */
+	ktime_t bw_next;		/* when the device is free again */
+	struct list_head delayed;	/* faulty_delayed, unsorted */
+	unsigned long ndelayed, total_delayed;
+	struct hrtimer delay_timer;
+	struct work_struct delay_work;
 };
 
+static bool faulty_delaying(struct faulty_conf *conf)
+{
+	return conf->delay_us || conf->ndist || conf->stall_ms ||
+		conf->bandwidth;
+}
+
+/* random extra delay in usecs, delay_lock held */
+static unsigned int faulty_dist_sample(struct faulty_conf *conf)
+{
+	unsigned int r = prandom_u32() % 10000;
+	unsigned int lo_pct = 0, lo_us = 0;
+	int i;
+
+	for (i = 0; i < conf->ndist; i++) {
+		struct faulty_dist_point *p = &conf->dist[i];
+
+		if (r < p->pct)
+			return lo_us + (u64)(p->us - lo_us) * (r - lo_pct) /
+				(p->pct - lo_pct);
+		lo_pct = p->pct;
+		lo_us = p->us;
+	}
+	return lo_us;
+}
+
+/* when a request of 'bytes' arriving now may go to the device */
+static ktime_t faulty_due(struct faulty_conf *conf, unsigned int bytes)
+{
+	ktime_t now = ktime_get();
+	s64 t = ktime_to_ns(now);
+	u64 extra_us = conf->delay_us;
+
+	if (conf->stall_ms && conf->stall_period_ms) {
+		u64 period = (u64)conf->stall_period_ms * NSEC_PER_MSEC;
+		u64 phase = t - div64_u64(t, period) * period;
+
+		if (phase < (u64)conf->stall_ms * NSEC_PER_MSEC)
+			t += (u64)conf->stall_ms * NSEC_PER_MSEC - phase;
+	}
+	if (conf->bandwidth) {
+		s64 busy = ktime_to_ns(conf->bw_next);
+
+		if (busy > t)
+			t = busy;
+		t += div_u64((u64)bytes * NSEC_PER_SEC,
+			     conf->bandwidth * 1024ULL);
+		conf->bw_next = ns_to_ktime(t);
+	}
+	if (conf->ndist)
+		extra_us += faulty_dist_sample(conf);
+	return ns_to_ktime(t + extra_us * NSEC_PER_USEC);
+}
+
+/*
+ * Queue the bio until it is due.  Returns false if it should be sent
+ * now, either because no delay is configured or we are out of memory.
+ */
+static bool faulty_delay_bio(struct faulty_conf *conf, struct bio *bio)
+{
+	struct faulty_delayed *d;
+	unsigned long flags;
+
+	if (!faulty_delaying(conf))
+		return false;
+	d = kmalloc(sizeof(*d), GFP_NOIO);
+	if (!d)
+		return false;
+
+	spin_lock_irqsave(&conf->delay_lock, flags);
+	if (!faulty_delaying(conf)) {
+		spin_unlock_irqrestore(&conf->delay_lock, flags);
+		kfree(d);
+		return false;
+	}
+	d->bio = bio;
+	d->due = faulty_due(conf, bio->bi_size);
+	list_add_tail(&d->list, &conf->delayed);
+	conf->ndelayed++;
+	conf->total_delayed++;
+	if (!hrtimer_is_queued(&conf->delay_timer) ||
+	    ktime_to_ns(d->due) <
+	    ktime_to_ns(hrtimer_get_expires(&conf->delay_timer)))
+		hrtimer_start(&conf->delay_timer, d->due, HRTIMER_MODE_ABS);
+	spin_unlock_irqrestore(&conf->delay_lock, flags);
+	return true;
+}
+
+static enum hrtimer_restart faulty_delay_timer(struct hrtimer *timer)
+{
+	struct faulty_conf *conf = container_of(timer, struct faulty_conf,
+						delay_timer);
+
+	schedule_work(&conf->delay_work);
+	return HRTIMER_NORESTART;
+}
+
+/* send delayed bios that are due, or all of them if 'all' */
+static void faulty_release_delayed(struct faulty_conf *conf, bool all)
+{
+	struct faulty_delayed *d, *tmp;
+	struct blk_plug plug;
+	LIST_HEAD(due);
+	s64 now = ktime_to_ns(ktime_get());
+	s64 next = 0;
+
+	spin_lock_irq(&conf->delay_lock);
+	list_for_each_entry_safe(d, tmp, &conf->delayed, list) {
+		s64 t = ktime_to_ns(d->due);
+
+		if (all || t <= now) {
+			list_move_tail(&d->list, &due);
+			conf->ndelayed--;
+		} else if (!next || t < next)
+			next = t;
+	}
+	if (next)
+		hrtimer_start(&conf->delay_timer, ns_to_ktime(next),
+			      HRTIMER_MODE_ABS);
+	spin_unlock_irq(&conf->delay_lock);
+
+	blk_start_plug(&plug);
+	list_for_each_entry_safe(d, tmp, &due, list) {
+		generic_make_request(d->bio);
+		kfree(d);
+	}
+	blk_finish_plug(&plug);
+}
+
+static void faulty_delay_work(struct work_struct *work)
+{
+	struct faulty_conf *conf = container_of(work, struct faulty_conf,
+						delay_work);
+
+	faulty_release_delayed(conf, false);
+}
+
 static int check_mode(struct faulty_conf *conf, int mode)
 {
 	if (conf->period[mode] == 0 &&
@@ -236,7 +416,8 @@ static bool faulty_make_request(struct mddev *mddev, struct bio *bio)
 	} else
 		bio->bi_bdev = conf->rdev->bdev;
 
-	generic_make_request(bio);
+	if (!faulty_delay_bio(conf, bio))
+		generic_make_request(bio);
 	return true;
 }
 
@@ -270,8 +451,309 @@ static void faulty_status(struct seq_file *seq, struct mddev *mddev)
 		seq_printf(seq, " WriteAll");
 
 	seq_printf(seq, " nfaults=%d", conf->nfaults);
+
+	spin_lock_irq(&conf->delay_lock);
+	if (conf->delay_us)
+		seq_printf(seq, " delay=%uus", conf->delay_us);
+	if (conf->ndist)
+		seq_printf(seq, " latency_dist=%d", conf->ndist);
+	if (conf->stall_ms)
+		seq_printf(seq, " stall=%u/%ums",
+			   conf->stall_ms, conf->stall_period_ms);
+	if (conf->bandwidth)
+		seq_printf(seq, " bandwidth=%uK/sec", conf->bandwidth);
+	if (conf->ndelayed)
+		seq_printf(seq, " delayed=%lu", conf->ndelayed);
+	spin_unlock_irq(&conf->delay_lock);
+}
+
+static ssize_t
+faulty_show_delay_us(struct mddev *mddev, char *page)
+{
+	struct faulty_conf *conf;
+	int ret = 0;
+
+	spin_lock(&mddev->lock);
+	conf = mddev->private;
+	if (conf)
+		ret = sprintf(page, "%u\n", conf->delay_us);
+	spin_unlock(&mddev->lock);
+	return ret;
+}
+
+static ssize_t
+faulty_store_delay_us(struct mddev *mddev, const char *page, size_t len)
+{
+	struct faulty_conf *conf;
+	unsigned long new;
+	int err;
+
+	if (len >= PAGE_SIZE)
+		return -EINVAL;
+	if (kstrtoul(page, 10, &new) || new > UINT_MAX)
+		return -EINVAL;
+
+	err = mddev_lock(mddev);
+	if (err)
+		return err;
+	conf = mddev->private;
+	if (!conf)
+		err = -ENODEV;
+	else {
+		spin_lock_irq(&conf->delay_lock);
+		conf->delay_us = new;
+		spin_unlock_irq(&conf->delay_lock);
+	}
+	mddev_unlock(mddev);
+	return err ?: len;
+}
+
+static struct md_sysfs_entry
+faulty_delay_us = __ATTR(delay_us, S_IRUGO | S_IWUSR,
+			 faulty_show_delay_us,
+			 faulty_store_delay_us);
+
+static ssize_t
+faulty_show_latency_dist(struct mddev *mddev, char *page)
+{
+	struct faulty_conf *conf;
+	int ret = 0;
+	int i;
+
+	spin_lock(&mddev->lock);
+	conf = mddev->private;
+	if (conf) {
+		spin_lock_irq(&conf->delay_lock);
+		for (i = 0; i < conf->ndist; i++) {
+			struct faulty_dist_point *p = &conf->dist[i];
+
+			ret += sprintf(page + ret, "%s%u", i ? " " : "",
+				       p->pct / 100);
+			if (p->pct % 100)
+				ret += sprintf(page + ret, ".%02u",
+					       p->pct % 100);
+			ret += sprintf(page + ret, ":%u", p->us);
+		}
+		spin_unlock_irq(&conf->delay_lock);
+		ret += sprintf(page + ret, "\n");
+	}
+	spin_unlock(&mddev->lock);
+	return ret;
+}
+
+/*
+ * Parse "percentile:usecs ..." with percentiles rising up to 100 and at
+ * most two decimals, usecs not falling.  Returns the number of points.
+ */
+static int faulty_parse_dist(const char *buf, struct faulty_dist_point *dist)
+{
+	int n = 0;
+
+	while (1) {
+		unsigned long whole, us;
+		unsigned int frac = 0, scale = 100;
+		char *end;
+
+		buf = skip_spaces(buf);
+		if (!*buf)
+			break;
+		if (n >= MaxDistPoints)
+			return -EINVAL;
+
+		whole = simple_strtoul(buf, &end, 10);
+		if (end == buf || whole > 100)
+			return -EINVAL;
+		buf = end;
+		if (*buf == '.')
+			for (buf++; isdigit(*buf); buf++)
+				if (scale > 1) {
+					scale /= 10;
+					frac += (*buf - '0') * scale;
+				}
+		if (*buf++ != ':')
+			return -EINVAL;
+		us = simple_strtoul(buf, &end, 10);
+		if (end == buf || us > UINT_MAX)
+			return -EINVAL;
+		buf = end;
+
+		dist[n].pct = whole * 100 + frac;
+		dist[n].us = us;
+		if (dist[n].pct == 0 || dist[n].pct > 10000)
+			return -EINVAL;
+		if (n && (dist[n].pct <= dist[n-1].pct ||
+			  dist[n].us < dist[n-1].us))
+			return -EINVAL;
+		n++;
+	}
+	return n;
+}
+
+static ssize_t
+faulty_store_latency_dist(struct mddev *mddev, const char *page, size_t len)
+{
+	struct faulty_dist_point dist[MaxDistPoints];
+	struct faulty_conf *conf;
+	int n, err;
+
+	if (len >= PAGE_SIZE)
+		return -EINVAL;
+	n = faulty_parse_dist(page, dist);
+	if (n < 0)
+		return n;
+
+	err = mddev_lock(mddev);
+	if (err)
+		return err;
+	conf = mddev->private;
+	if (!conf)
+		err = -ENODEV;
+	else {
+		spin_lock_irq(&conf->delay_lock);
+		memcpy(conf->dist, dist, n * sizeof(dist[0]));
+		conf->ndist = n;
+		spin_unlock_irq(&conf->delay_lock);
+	}
+	mddev_unlock(mddev);
+	return err ?: len;
+}
+
+static struct md_sysfs_entry
+faulty_latency_dist = __ATTR(latency_dist, S_IRUGO | S_IWUSR,
+			     faulty_show_latency_dist,
+			     faulty_store_latency_dist);
+
+static ssize_t
+faulty_show_stall(struct mddev *mddev, char *page)
+{
+	struct faulty_conf *conf;
+	int ret = 0;
+
+	spin_lock(&mddev->lock);
+	conf = mddev->private;
+	if (conf)
+		ret = sprintf(page, "%u %u\n",
+			      conf->stall_period_ms, conf->stall_ms);
+	spin_unlock(&mddev->lock);
+	return ret;
 }
 
+static ssize_t
+faulty_store_stall(struct mddev *mddev, const char *page, size_t len)
+{
+	struct faulty_conf *conf;
+	unsigned int period, stall;
+	int err;
+
+	if (len >= PAGE_SIZE)
+		return -EINVAL;
+	if (sscanf(page, "%u %u", &period, &stall) != 2)
+		return -EINVAL;
+	if (stall >= period && stall)
+		return -EINVAL;
+
+	err = mddev_lock(mddev);
+	if (err)
+		return err;
+	conf = mddev->private;
+	if (!conf)
+		err = -ENODEV;
+	else {
+		spin_lock_irq(&conf->delay_lock);
+		conf->stall_period_ms = period;
+		conf->stall_ms = stall;
+		spin_unlock_irq(&conf->delay_lock);
+	}
+	mddev_unlock(mddev);
+	return err ?: len;
+}
+
+static struct md_sysfs_entry
+faulty_stall = __ATTR(stall, S_IRUGO | S_IWUSR,
+		      faulty_show_stall,
+		      faulty_store_stall);
+
+static ssize_t
+faulty_show_bandwidth(struct mddev *mddev, char *page)
+{
+	struct faulty_conf *conf;
+	int ret = 0;
+
+	spin_lock(&mddev->lock);
+	conf = mddev->private;
+	if (conf)
+		ret = sprintf(page, "%u\n", conf->bandwidth);
+	spin_unlock(&mddev->lock);
+	return ret;
+}
+
+static ssize_t
+faulty_store_bandwidth(struct mddev *mddev, const char *page, size_t len)
+{
+	struct faulty_conf *conf;
+	unsigned long new;
+	int err;
+
+	if (len >= PAGE_SIZE)
+		return -EINVAL;
+	if (kstrtoul(page, 10, &new) || new > UINT_MAX)
+		return -EINVAL;
+
+	err = mddev_lock(mddev);
+	if (err)
+		return err;
+	conf = mddev->private;
+	if (!conf)
+		err = -ENODEV;
+	else {
+		spin_lock_irq(&conf->delay_lock);
+		conf->bandwidth = new;
+		conf->bw_next = ktime_set(0, 0);
+		spin_unlock_irq(&conf->delay_lock);
+	}
+	mddev_unlock(mddev);
+	return err ?: len;
+}
+
+static struct md_sysfs_entry
+faulty_bandwidth = __ATTR(bandwidth, S_IRUGO | S_IWUSR,
+			  faulty_show_bandwidth,
+			  faulty_store_bandwidth);
+
+static ssize_t
+faulty_show_delayed(struct mddev *mddev, char *page)
+{
+	struct faulty_conf *conf;
+	int ret = 0;
+
+	spin_lock(&mddev->lock);
+	conf = mddev->private;
+	if (conf) {
+		spin_lock_irq(&conf->delay_lock);
+		ret = sprintf(page, "%lu %lu\n",
+			      conf->ndelayed, conf->total_delayed);
+		spin_unlock_irq(&conf->delay_lock);
+	}
+	spin_unlock(&mddev->lock);
+	return ret;
+}
+
+static struct md_sysfs_entry
+faulty_delayed = __ATTR(delayed, S_IRUGO, faulty_show_delayed, NULL);
+
+static struct attribute *faulty_attrs[] = {
+	&faulty_delay_us.attr,
+	&faulty_latency_dist.attr,
+	&faulty_stall.attr,
+	&faulty_bandwidth.attr,
+	&faulty_delayed.attr,
+	NULL,
+};
+static struct attribute_group faulty_attrs_group = {
+	.name = "faulty",
+	.attrs = faulty_attrs,
+};
+
 
 static int faulty_reshape(struct mddev *mddev)
 {
@@ -332,6 +814,20 @@ static int faulty_run(struct mddev *mddev)
 	}
 	conf->nfaults = 0;
 
+	spin_lock_init(&conf->delay_lock);
+	conf->delay_us = 0;
+	conf->ndist = 0;
+	conf->stall_period_ms = 0;
+	conf->stall_ms = 0;
+	conf->bandwidth = 0;
+	conf->bw_next = ktime_set(0, 0);
+	INIT_LIST_HEAD(&conf->delayed);
+	conf->ndelayed = 0;
+	conf->total_delayed = 0;
+	hrtimer_init(&conf->delay_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	conf->delay_timer.function = faulty_delay_timer;
+	INIT_WORK(&conf->delay_work, faulty_delay_work);
+
 	rdev_for_each(rdev, mddev) {
 		conf->rdev = rdev;
 		disk_stack_limits(mddev->gendisk, rdev->bdev,
@@ -343,6 +839,13 @@ static int faulty_run(struct mddev *mddev)
 
 	faulty_reshape(mddev);
 
+	if (mddev->to_remove == &faulty_attrs_group)
+		mddev->to_remove = NULL;
+	else if (mddev->kobj.sd &&
+		 sysfs_create_group(&mddev->kobj, &faulty_attrs_group))
+		pr_warn("md: cannot register extra attributes for %s\n",
+			mdname(mddev));
+
 	return 0;
 }
 
@@ -350,6 +853,13 @@ static void faulty_free(struct mddev *mddev, void *priv)
 {
 	struct faulty_conf *conf = priv;
 
+	/* nothing may stay queued once the device is let go */
+	hrtimer_cancel(&conf->delay_timer);
+	cancel_work_sync(&conf->delay_work);
+	faulty_release_delayed(conf, true);
+	hrtimer_cancel(&conf->delay_timer);
+
+	mddev->to_remove = &faulty_attrs_group;
 	kfree(conf);
 }
 
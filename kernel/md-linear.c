@@ -27,29 +27,65 @@
 /*
  * find which device holds a particular offset
  */
-static inline struct dev_info *which_dev(struct mddev *mddev, sector_t sector)
+static inline struct dev_info *which_dev(struct linear_conf *conf,
+					 sector_t sector)
 {
-	int lo, mid, hi;
-	struct linear_conf *conf;
+	sector_t slot = sector >> conf->index_shift;
+	unsigned int i;
 
-	lo = 0;
-	hi = mddev->raid_disks - 1;
-	conf = mddev->private;
+	if (unlikely(slot >= conf->index_slots))
+		slot = conf->index_slots - 1;
+	i = conf->index[slot];
+	while (sector >= conf->disks[i].end_sector &&
+	       i < conf->raid_disks - 1)
+		i++;
 
-	/*
-	 * Binary Search
-	 */
+	return conf->disks + i;
+}
+
+static int linear_build_index(struct linear_conf *conf)
+{
+	sector_t smallest = 0;
+	unsigned int slot;
+	int i, shift;
+
+	for (i = 0; i < conf->raid_disks; i++) {
+		sector_t sectors = conf->disks[i].rdev->sectors;
 
-	while (hi > lo) {
+		if (sectors && (!smallest || sectors < smallest))
+			smallest = sectors;
+	}
+	shift = smallest ? ilog2(smallest) : 0;
+	while ((conf->array_sectors >> shift) >= LINEAR_INDEX_SLOTS)
+		shift++;
+
+	conf->index_shift = shift;
+	conf->index_slots = (conf->array_sectors >> shift) + 1;
+	conf->index = kcalloc(conf->index_slots, sizeof(unsigned int),
+			      GFP_KERNEL);
+	if (!conf->index)
+		return -ENOMEM;
 
-		mid = (hi + lo) / 2;
-		if (sector < conf->disks[mid].end_sector)
-			hi = mid;
-		else
-			lo = mid + 1;
+	for (slot = 0, i = 0; slot < conf->index_slots; slot++) {
+		sector_t start = (sector_t)slot << shift;
+
+		while (start >= conf->disks[i].end_sector &&
+		       i < conf->raid_disks - 1)
+			i++;
+		conf->index[slot] = i;
 	}
+	return 0;
+}
 
-	return conf->disks + lo;
+static void linear_free_conf(struct linear_conf *conf)
+{
+	kfree(conf->index);
+	kfree(conf);
+}
+
+static void linear_free_conf_rcu(struct rcu_head *head)
+{
+	linear_free_conf(container_of(head, struct linear_conf, rcu));
 }
 
 /**
@@ -70,7 +106,8 @@ static int linear_mergeable_bvec(struct mddev *mddev,
 	int maxbytes = biovec->bv_len;
 	struct request_queue *subq;
 
-	dev0 = which_dev(mddev, sector);
+	/* md_mergeable_bvec() holds rcu_read_lock() for us */
+	dev0 = which_dev(rcu_dereference(mddev->private), sector);
 	maxsectors = dev0->end_sector - sector;
 	subq = bdev_get_queue(dev0->rdev->bdev);
 	if (subq->merge_bvec_fn) {
@@ -206,10 +243,13 @@ static struct linear_conf *linear_conf(struct mddev *mddev, int raid_disks)
 	 */
 	conf->raid_disks = raid_disks;
 
+	if (linear_build_index(conf))
+		goto out;
+
 	return conf;
 
 out:
-	kfree(conf);
+	linear_free_conf(conf);
 	return NULL;
 }
 
@@ -229,7 +269,7 @@ static int linear_run (struct mddev *mddev)
 
 	ret =  md_integrity_register(mddev);
 	if (ret) {
-		kfree(conf);
+		linear_free_conf(conf);
 		mddev->private = NULL;
 	}
 	return ret;
@@ -240,10 +280,9 @@ static int linear_add(struct mddev *mddev, struct md_rdev *rdev)
 	/* Adding a drive to a linear array allows the array to grow.
 	 * It is permitted if the new drive has a matching superblock
 	 * already on it, with raid_disk equal to raid_disks.
-	 * It is achieved by creating a new linear_private_data structure
-	 * and swapping it in in-place of the current one.
-	 * The current one is never freed until the array is stopped.
-	 * This avoids races.
+	 * It is achieved by creating a new linear_private_data structure,
+	 * with its own lookup index, and swapping it in in-place of the
+	 * current one under RCU.
 	 */
 	struct linear_conf *newconf, *oldconf;
 
@@ -261,8 +300,9 @@ static int linear_add(struct mddev *mddev, struct md_rdev *rdev)
 	/* newconf->raid_disks already keeps a copy of * the increased
 	 * value of mddev->raid_disks, WARN_ONCE() is just used to make
 	 * sure of this. It is possible that oldconf is still referenced
-	 * in linear_congested(), therefore kfree_rcu() is used to free
-	 * oldconf until no one uses it anymore.
+	 * in linear_congested() or linear_mergeable_bvec(), therefore it
+	 * is freed after an RCU grace period.  linear_make_request() is
+	 * kept out by mddev_suspend().
 	 */
 	mddev_suspend(mddev);
 	oldconf = rcu_dereference_protected(mddev->private,
@@ -275,7 +315,7 @@ static int linear_add(struct mddev *mddev, struct md_rdev *rdev)
 	set_capacity(mddev->gendisk, mddev->array_sectors);
 	mddev_resume(mddev);
 	revalidate_disk(mddev->gendisk);
-	kfree_rcu(oldconf, rcu);
+	call_rcu(&oldconf->rcu, linear_free_conf_rcu);
 	return 0;
 }
 
@@ -283,11 +323,46 @@ static void linear_free(struct mddev *mddev, void *priv)
 {
 	struct linear_conf *conf = priv;
 
-	kfree(conf);
+	linear_free_conf(conf);
+}
+
+/*
+ * Send each member its part of a bio that crosses member boundaries,
+ * in one pass: every part is a trimmed clone chained to the original.
+ */
+static void linear_split(struct mddev *mddev, struct dev_info *dev,
+			 struct bio *bio)
+{
+	sector_t sector = bio->bi_sector;
+	sector_t end = bio_end_sector(bio);
+
+	while (sector < end) {
+		struct bio *split;
+		sector_t start_sector;
+		int len;
+
+		while (dev->end_sector <= sector)
+			dev++;
+		start_sector = dev->end_sector - dev->rdev->sectors;
+		len = min(end, dev->end_sector) - sector;
+
+		split = bio_clone_mddev(bio, GFP_NOIO, mddev);
+		bio_trim(split, sector - bio->bi_sector, len);
+		split->bi_bdev = dev->rdev->bdev;
+		split->bi_sector = sector - start_sector +
+			dev->rdev->data_offset;
+		bio_chain(split, bio);
+		generic_make_request(split);
+
+		sector += len;
+	}
+	bio_endio(bio, 0);
 }
 
 static bool linear_make_request(struct mddev *mddev, struct bio *bio)
 {
+	/* stable while requests are active, see linear_add() */
+	struct linear_conf *conf = rcu_dereference_raw(mddev->private);
 	struct dev_info *tmp_dev;
 	sector_t start_sector;
 	unsigned int max_sectors = blk_queue_get_max_sectors(mddev->queue,
@@ -314,7 +389,7 @@ static bool linear_make_request(struct mddev *mddev, struct bio *bio)
 		return true;
 	}
 
-	tmp_dev = which_dev(mddev, bio->bi_sector);
+	tmp_dev = which_dev(conf, bio->bi_sector);
 	start_sector = tmp_dev->end_sector - tmp_dev->rdev->sectors;
 
 	if (unlikely(bio->bi_sector >= (tmp_dev->end_sector)
@@ -337,6 +412,11 @@ static bool linear_make_request(struct mddev *mddev, struct bio *bio)
 		struct bio_pair *bp;
 		sector_t end_sector = tmp_dev->end_sector;
 
+		if (!do_discard && !do_same) {
+			linear_split(mddev, tmp_dev, bio);
+			return true;
+		}
+
 		bp = bio_split(bio, end_sector - bio->bi_sector);
 
 		linear_make_request(mddev, &bp->bio1);
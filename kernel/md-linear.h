@@ -6,11 +6,22 @@ struct dev_info {
 	sector_t	end_sector;
 };
 
+/*
+ * The array is cut into index slots of 1 << index_shift sectors, and
+ * index[] holds the first disk that ends after the start of each slot.
+ * Slots are no larger than the smallest member where the slot count
+ * allows, so a lookup rarely has to step past more than one disk.
+ */
+#define LINEAR_INDEX_SLOTS	4096
+
 struct linear_conf
 {
 	struct rcu_head		rcu;
 	sector_t		array_sectors;
 	int			raid_disks; /* a copy of mddev->raid_disks */
+	int			index_shift;
+	unsigned int		index_slots;
+	unsigned int		*index;
 	struct dev_info		disks[0];
 };
 #endif
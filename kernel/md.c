@@ -263,6 +263,8 @@ static DEFINE_SPINLOCK(all_mddevs_lock);
  * We hold a refcount over the call to ->make_request.  By the time that
  * call has finished, the bio has been linked into some internal structure
  * and so is visible to ->quiesce(), so we don't need the refcount any more.
+ * The refcount is a percpu_ref so that the hot path never writes a shared
+ * cache line; mddev_suspend() kills it and waits for it to drain.
  */
 static bool is_suspended(struct mddev *mddev, struct bio *bio)
 {
@@ -282,7 +284,6 @@ static bool is_suspended(struct mddev *mddev, struct bio *bio)
 void md_handle_request(struct mddev *mddev, struct bio *bio)
 {
 check_suspended:
-	rcu_read_lock();
 	if (is_suspended(mddev, bio)) {
 		DEFINE_WAIT(__wait);
 		for (;;) {
@@ -290,23 +291,21 @@ check_suspended:
 					TASK_UNINTERRUPTIBLE);
 			if (!is_suspended(mddev, bio))
 				break;
-			rcu_read_unlock();
 			schedule();
-			rcu_read_lock();
 		}
 		finish_wait(&mddev->sb_wait, &__wait);
 	}
-	atomic_inc(&mddev->active_io);
-	rcu_read_unlock();
+	/* Fails once mddev_suspend() has killed the ref */
+	if (!percpu_ref_tryget_live(&mddev->active_io))
+		goto check_suspended;
 
 	if (!mddev->pers->make_request(mddev, bio)) {
-		atomic_dec(&mddev->active_io);
+		percpu_ref_put(&mddev->active_io);
 		wake_up(&mddev->sb_wait);
 		goto check_suspended;
 	}
 
-	if (atomic_dec_and_test(&mddev->active_io) && mddev->suspended)
-		wake_up(&mddev->sb_wait);
+	percpu_ref_put(&mddev->active_io);
 }
 EXPORT_SYMBOL(md_handle_request);
 
@@ -353,11 +352,10 @@ void mddev_suspend(struct mddev *mddev)
 	lockdep_assert_held(&mddev->reconfig_mutex);
 	if (mddev->suspended++)
 		return;
-	synchronize_rcu();
 	wake_up(&mddev->sb_wait);
 	set_bit(MD_ALLOW_SB_UPDATE, &mddev->flags);
-	smp_mb__after_atomic();
-	wait_event(mddev->sb_wait, atomic_read(&mddev->active_io) == 0);
+	percpu_ref_kill(&mddev->active_io);
+	wait_event(mddev->sb_wait, percpu_ref_is_zero(&mddev->active_io));
 	mddev->pers->quiesce(mddev, 1);
 	clear_bit_unlock(MD_ALLOW_SB_UPDATE, &mddev->flags);
 	wait_event(mddev->sb_wait, !test_bit(MD_UPDATING_SB, &mddev->flags));
@@ -371,6 +369,7 @@ void mddev_resume(struct mddev *mddev)
 	lockdep_assert_held(&mddev->reconfig_mutex);
 	if (--mddev->suspended)
 		return;
+	percpu_ref_reinit(&mddev->active_io);
 	wake_up(&mddev->sb_wait);
 	mddev->pers->quiesce(mddev, 0);
 
@@ -425,6 +424,11 @@ static int md_mergeable_bvec(struct request_queue *q,
 }
 /*
  * Generic flush handling for md
+ *
+ * Flushes are issued in generations.  Any bio that arrives while a
+ * generation is in flight is queued on flush_pending and shares the next
+ * generation, so member flushes are issued once per generation however
+ * many callers are waiting, and callers never block here.
  */
 
 static void md_end_flush(struct bio *bio, int err)
@@ -448,7 +452,13 @@ static void submit_flushes(struct work_struct *ws)
 	struct mddev *mddev = container_of(ws, struct mddev, flush_work);
 	struct md_rdev *rdev;
 
-	mddev->start_flush = ktime_get_boottime();
+	/* Everything queued so far belongs to this generation */
+	spin_lock_irq(&mddev->lock);
+	bio_list_merge(&mddev->flush_bios, &mddev->flush_pending_bios);
+	bio_list_init(&mddev->flush_pending_bios);
+	mddev->flush_since = mddev->flush_pending_since;
+	spin_unlock_irq(&mddev->lock);
+
 	INIT_WORK(&mddev->flush_work, md_submit_flush_data);
 	atomic_set(&mddev->flush_pending, 1);
 	rcu_read_lock();
@@ -480,54 +490,57 @@ static void submit_flushes(struct work_struct *ws)
 static void md_submit_flush_data(struct work_struct *ws)
 {
 	struct mddev *mddev = container_of(ws, struct mddev, flush_work);
-	struct bio *bio = mddev->flush_bio;
+	struct bio_list bios;
+	struct bio *bio;
+	u64 since;
+	bool next;
 
 	/*
-	 * must reset flush_bio before calling into md_handle_request to avoid a
-	 * deadlock, because other bios passed md_handle_request suspend check
-	 * could wait for this and below md_handle_request could wait for those
-	 * bios because of suspend check
+	 * Take this generation's bios and, if more arrived while it was in
+	 * flight, start the next generation before calling into
+	 * md_handle_request, which may block on a suspended array.
 	 */
-	mddev->last_flush = mddev->start_flush;
-	mddev->flush_bio = NULL;
-	wake_up(&mddev->sb_wait);
+	spin_lock_irq(&mddev->lock);
+	bios = mddev->flush_bios;
+	bio_list_init(&mddev->flush_bios);
+	since = mddev->flush_since;
+	next = !bio_list_empty(&mddev->flush_pending_bios);
+	if (!next)
+		mddev->flush_running = false;
+	spin_unlock_irq(&mddev->lock);
 
-	if (bio->bi_size == 0) {
-		/* an empty barrier - all done */
-		bio_endio(bio, 0);
-	} else {
-		bio->bi_rw &= ~REQ_FLUSH;
-		md_handle_request(mddev, bio);
+	if (next) {
+		INIT_WORK(&mddev->flush_work, submit_flushes);
+		queue_work(md_wq, &mddev->flush_work);
+	}
+	md_lat_record(mddev, MD_LAT_FLUSH, since);
+
+	while ((bio = bio_list_pop(&bios))) {
+		if (bio->bi_size == 0) {
+			/* an empty barrier - all done */
+			bio_endio(bio, 0);
+		} else {
+			bio->bi_rw &= ~REQ_FLUSH;
+			md_handle_request(mddev, bio);
+		}
 	}
 }
 
 void md_flush_request(struct mddev *mddev, struct bio *bio)
 {
-	ktime_t start = ktime_get_boottime();
+	bool start;
+
 	spin_lock_irq(&mddev->lock);
-	wait_event_lock_irq(mddev->sb_wait,
-			    !mddev->flush_bio ||
-			    ktime_after(mddev->last_flush, start),
-			    mddev->lock);
-	if (!ktime_after(mddev->last_flush, start)) {
-		WARN_ON(mddev->flush_bio);
-		mddev->flush_bio = bio;
-		bio = NULL;
-	}
+	if (bio_list_empty(&mddev->flush_pending_bios))
+		mddev->flush_pending_since = md_lat_start();
+	bio_list_add(&mddev->flush_pending_bios, bio);
+	start = !mddev->flush_running;
+	mddev->flush_running = true;
 	spin_unlock_irq(&mddev->lock);
 
-	if (!bio) {
+	if (start) {
 		INIT_WORK(&mddev->flush_work, submit_flushes);
 		queue_work(md_wq, &mddev->flush_work);
-	} else {
-		/* flush was performed for some other bio while we waited. */
-		if (bio->bi_size == 0)
-			/* an empty barrier - all done */
-			bio_endio(bio, 0);
-		else {
-			bio->bi_rw &= ~REQ_FLUSH;
-			mddev->pers->make_request(mddev, bio);
-		}
 	}
 }
 EXPORT_SYMBOL(md_flush_request);
@@ -563,8 +576,10 @@ static void mddev_put(struct mddev *mddev)
 			 */
 			INIT_WORK(&mddev->del_work, mddev_delayed_delete);
 			queue_work(md_misc_wq, &mddev->del_work);
-		} else
+		} else {
+			mddev_destroy(mddev);
 			kfree(mddev);
+		}
 	}
 	spin_unlock(&all_mddevs_lock);
 	if (bs)
@@ -575,8 +590,24 @@ static void mddev_put(struct mddev *mddev)
 
 static void md_safemode_timeout(unsigned long data);
 
-void mddev_init(struct mddev *mddev)
+static void active_io_release(struct percpu_ref *ref)
 {
+	struct mddev *mddev = container_of(ref, struct mddev, active_io);
+
+	wake_up(&mddev->sb_wait);
+}
+
+int mddev_init(struct mddev *mddev)
+{
+	if (percpu_ref_init(&mddev->active_io, active_io_release,
+			    0, GFP_KERNEL))
+		return -ENOMEM;
+	mddev->lat_stats = alloc_percpu(struct md_lat_stats);
+	if (!mddev->lat_stats) {
+		percpu_ref_exit(&mddev->active_io);
+		return -ENOMEM;
+	}
+
 	mutex_init(&mddev->open_mutex);
 	mutex_init(&mddev->reconfig_mutex);
 	mutex_init(&mddev->bitmap_info.mutex);
@@ -586,9 +617,10 @@ void mddev_init(struct mddev *mddev)
 		    (unsigned long) mddev);
 	atomic_set(&mddev->active, 1);
 	atomic_set(&mddev->openers, 0);
-	atomic_set(&mddev->active_io, 0);
 	spin_lock_init(&mddev->lock);
 	atomic_set(&mddev->flush_pending, 0);
+	bio_list_init(&mddev->flush_bios);
+	bio_list_init(&mddev->flush_pending_bios);
 	init_waitqueue_head(&mddev->sb_wait);
 	init_waitqueue_head(&mddev->recovery_wait);
 	mddev->reshape_position = MaxSector;
@@ -597,9 +629,49 @@ void mddev_init(struct mddev *mddev)
 	mddev->resync_min = 0;
 	mddev->resync_max = MaxSector;
 	mddev->level = LEVEL_NONE;
+	return 0;
 }
 EXPORT_SYMBOL_GPL(mddev_init);
 
+void mddev_destroy(struct mddev *mddev)
+{
+	free_percpu(mddev->lat_stats);
+	mddev->lat_stats = NULL;
+	percpu_ref_exit(&mddev->active_io);
+}
+EXPORT_SYMBOL_GPL(mddev_destroy);
+
+/*
+ * Account the time since 'start' (from md_lat_start()) to 'stage'.
+ * Cheap enough for the I/O path and callable from interrupt context.
+ */
+void md_lat_record(struct mddev *mddev, enum md_lat_stage stage, u64 start)
+{
+	s64 ns = local_clock() - start;
+	unsigned long us;
+	int slot = 0;
+
+	if (!mddev->lat_stats)
+		return;
+	/* start may have been taken on another CPU */
+	if (ns < 0)
+		ns = 0;
+	us = div_u64(ns, NSEC_PER_USEC);
+	if (us)
+		slot = min_t(int, ilog2(us) + 1, MD_LAT_SLOTS - 1);
+	this_cpu_inc(mddev->lat_stats->count[stage][slot]);
+	this_cpu_add(mddev->lat_stats->total_ns[stage], ns);
+}
+EXPORT_SYMBOL_GPL(md_lat_record);
+
+static void mddev_free(struct mddev *mddev)
+{
+	if (!mddev)
+		return;
+	mddev_destroy(mddev);
+	kfree(mddev);
+}
+
 static struct mddev *mddev_find(dev_t unit)
 {
 	struct mddev *mddev, *new = NULL;
@@ -615,7 +687,7 @@ static struct mddev *mddev_find(dev_t unit)
 			if (mddev->unit == unit) {
 				mddev_get(mddev);
 				spin_unlock(&all_mddevs_lock);
-				kfree(new);
+				mddev_free(new);
 				return mddev;
 			}
 
@@ -639,7 +711,7 @@ static struct mddev *mddev_find(dev_t unit)
 			if (next_minor == start) {
 				/* Oh dear, all in use. */
 				spin_unlock(&all_mddevs_lock);
-				kfree(new);
+				mddev_free(new);
 				return NULL;
 			}
 
@@ -669,7 +741,10 @@ static struct mddev *mddev_find(dev_t unit)
 	else
 		new->md_minor = MINOR(unit) >> MdpMinorShift;
 
-	mddev_init(new);
+	if (mddev_init(new)) {
+		kfree(new);
+		return NULL;
+	}
 
 	goto retry;
 }
@@ -796,6 +871,7 @@ void md_rdev_clear(struct md_rdev *rdev)
 		rdev->bb_page = NULL;
 	}
 	badblocks_exit(&rdev->badblocks);
+	md_bb_index_exit(&rdev->bb_index);
 }
 EXPORT_SYMBOL_GPL(md_rdev_clear);
 
@@ -823,8 +899,9 @@ static void super_written(struct bio *bio, int error)
 	bio_put(bio);
 }
 
-void md_super_write(struct mddev *mddev, struct md_rdev *rdev,
-		   sector_t sector, int size, struct page *page)
+static void __md_super_write(struct mddev *mddev, struct md_rdev *rdev,
+			     sector_t sector, int size, struct page *page,
+			     int rw)
 {
 	/* write first size bytes of page to sector of rdev
 	 * Increment mddev->pending_writes before returning
@@ -833,7 +910,7 @@ void md_super_write(struct mddev *mddev, struct md_rdev *rdev,
 	 * If an error occurred, call md_error
 	 */
 	struct bio *bio;
-	int ff = WRITE_FLUSH_FUA;
+	int ff = rw;
 
 	if (!page)
 		return;
@@ -857,9 +934,67 @@ void md_super_write(struct mddev *mddev, struct md_rdev *rdev,
 		ff |= MD_FAILFAST;
 
 	atomic_inc(&mddev->pending_writes);
+	atomic64_inc(&mddev->sb_stat_writes);
 	submit_bio(ff, bio);
 }
 
+void md_super_write(struct mddev *mddev, struct md_rdev *rdev,
+		   sector_t sector, int size, struct page *page)
+{
+	__md_super_write(mddev, rdev, sector, size, page, WRITE_FLUSH_FUA);
+}
+
+/*
+ * Write a run of pages that are contiguous on the device, using as few
+ * bios as the queue limits allow.  All but the last page are written in
+ * full; only last_size bytes of the last one are.  Completion is
+ * accounted in mddev->pending_writes just like md_super_write().
+ * Returns the number of bios submitted.
+ */
+int md_super_write_pages(struct mddev *mddev, struct md_rdev *rdev,
+			 sector_t sector, struct page **pages, int nr,
+			 int last_size)
+{
+	int bios = 0;
+
+	while (nr && !test_bit(Faulty, &rdev->flags)) {
+		struct bio *bio;
+		int ff = WRITE_FLUSH_FUA;
+		int i;
+
+		bio = bio_alloc_mddev(GFP_NOIO, min(nr, BIO_MAX_PAGES), mddev);
+
+		atomic_inc(&rdev->nr_pending);
+
+		bio->bi_bdev = rdev->meta_bdev ? rdev->meta_bdev : rdev->bdev;
+		bio->bi_sector = sector;
+		bio->bi_private = rdev;
+		bio->bi_end_io = super_written;
+		/* a single page always fits in an empty bio */
+		for (i = 0; i < nr; i++) {
+			int size = (i == nr - 1) ? last_size : PAGE_SIZE;
+
+			if (bio_add_page(bio, pages[i], size, 0) < size)
+				break;
+		}
+
+		if (test_bit(MD_FAILFAST_SUPPORTED, &mddev->flags) &&
+		    test_bit(FailFast, &rdev->flags) &&
+		    !test_bit(LastDev, &rdev->flags))
+			ff |= MD_FAILFAST;
+
+		atomic_inc(&mddev->pending_writes);
+		atomic64_inc(&mddev->sb_stat_writes);
+		submit_bio(ff, bio);
+		bios++;
+
+		sector += i << (PAGE_SHIFT - 9);
+		pages += i;
+		nr -= i;
+	}
+	return bios;
+}
+
 int md_super_wait(struct mddev *mddev)
 {
 	/* wait for all superblock writes that were scheduled to complete */
@@ -869,6 +1004,50 @@ int md_super_wait(struct mddev *mddev)
 	return 0;
 }
 
+/*
+ * Superblock updates are numbered.  md_update_sb() bumps sb_gen_started
+ * under mddev->lock when it snapshots the state to write, and sets
+ * sb_gen_done once that snapshot is on disk.  A change that is pending
+ * when we look is therefore covered by the next generation to start, and
+ * a waiter need not keep waiting while later changes keep
+ * MD_SB_CHANGE_PENDING set.
+ */
+static bool md_sb_gen_done(struct mddev *mddev, unsigned long gen)
+{
+	return (long)(ACCESS_ONCE(mddev->sb_gen_done) - gen) >= 0;
+}
+
+/*
+ * Wait until any superblock change pending now has been written.
+ * With stop_on_suspend, returns false if we gave up because the array
+ * is being suspended; otherwise it always waits and returns true.
+ */
+bool md_wait_for_sb_update(struct mddev *mddev, bool stop_on_suspend)
+{
+	unsigned long need;
+	ktime_t start;
+	bool done;
+
+	if (!test_bit(MD_SB_CHANGE_PENDING, &mddev->sb_flags))
+		return true;
+	smp_rmb(); /* Match the spin_unlock after bumping sb_gen_started */
+	need = ACCESS_ONCE(mddev->sb_gen_started) + 1;
+
+	start = ktime_get();
+	wait_event(mddev->sb_wait,
+		   !test_bit(MD_SB_CHANGE_PENDING, &mddev->sb_flags) ||
+		   md_sb_gen_done(mddev, need) ||
+		   (stop_on_suspend && mddev->suspended));
+	done = !test_bit(MD_SB_CHANGE_PENDING, &mddev->sb_flags) ||
+		md_sb_gen_done(mddev, need);
+
+	atomic64_inc(&mddev->sb_stat_waits);
+	atomic64_add(ktime_to_us(ktime_sub(ktime_get(), start)),
+		     &mddev->sb_stat_wait_us);
+	return done;
+}
+EXPORT_SYMBOL(md_wait_for_sb_update);
+
 int sync_page_io(struct md_rdev *rdev, sector_t sector, int size,
 		 struct page *page, int rw, bool metadata_op)
 {
@@ -1592,6 +1771,7 @@ static int super_1_load(struct md_rdev *rdev, struct md_rdev *refdev, int minor_
 			return -EIO;
 		bbp = (u64 *)page_address(rdev->bb_page);
 		rdev->badblocks.shift = sb->bblog_shift;
+		md_bb_index_set_max_log(&rdev->bb_index, sectors << (9-3));
 		for (i = 0 ; i < (sectors << (9-3)) ; i++, bbp++) {
 			u64 bb = le64_to_cpu(*bbp);
 			int count = bb & (0x3ff);
@@ -1600,7 +1780,9 @@ static int super_1_load(struct md_rdev *rdev, struct md_rdev *refdev, int minor_
 			count <<= sb->bblog_shift;
 			if (bb + 1 == 0)
 				break;
-			if (badblocks_set(&rdev->badblocks, sector, count, 1))
+			if (badblocks_set(&rdev->badblocks, sector, count, 1) &&
+			    md_bb_index_set(&rdev->bb_index, sector, count,
+					    sb->bblog_shift, true))
 				return -EINVAL;
 		}
 	} else if (sb->bblog_offset != 0)
@@ -1892,25 +2074,34 @@ static void super_1_sync(struct mddev *mddev, struct md_rdev *rdev)
 		}
 	}
 
-	if (rdev->badblocks.count == 0)
+	if (rdev->badblocks.count == 0 && !md_bb_index_used(&rdev->bb_index))
 		/* Nothing to do for bad blocks*/ ;
 	else if (sb->bblog_offset == 0)
 		/* Cannot record bad blocks on this device */
 		md_error(mddev, rdev);
 	else {
 		struct badblocks *bb = &rdev->badblocks;
+		struct md_bb_index *idx = &rdev->bb_index;
 		u64 *bbp = (u64 *)page_address(rdev->bb_page);
 		u64 *p = bb->page;
 		sb->feature_map |= cpu_to_le32(MD_FEATURE_BAD_BLOCKS);
-		if (bb->changed) {
+		if (bb->changed || idx->changed) {
 			unsigned seq;
+			int max_entries = min_t(int, PAGE_SIZE / 8,
+				le16_to_cpu(sb->bblog_size) << (9 - 3));
+			int err = 0;
 
 retry:
 			seq = read_seqbegin(&bb->lock);
 
 			memset(bbp, 0xff, PAGE_SIZE);
 
-			for (i = 0 ; i < bb->count ; i++) {
+			if (md_bb_index_used(idx)) {
+				/* overflowed the table: merge into the log */
+				idx->changed = 0;
+				err = md_bb_build_log(bb, idx, (__le64 *)bbp,
+						      max_entries);
+			} else for (i = 0 ; i < bb->count ; i++) {
 				u64 internal_bb = p[i];
 				u64 store_bb = ((BB_OFFSET(internal_bb) << 10)
 						| BB_LEN(internal_bb));
@@ -1919,6 +2110,8 @@ retry:
 			bb->changed = 0;
 			if (read_seqretry(&bb->lock, seq))
 				goto retry;
+			/* the index refuses ranges that would not fit */
+			WARN_ON_ONCE(err < 0);
 
 			bb->sector = (rdev->sb_start +
 				      (int)le32_to_cpu(sb->bblog_offset));
@@ -2293,6 +2486,7 @@ static void unbind_rdev_from_array(struct md_rdev *rdev)
 	sysfs_put(rdev->sysfs_state);
 	rdev->sysfs_state = NULL;
 	rdev->badblocks.count = 0;
+	md_bb_index_exit(&rdev->bb_index);
 	/* We need to delay this, otherwise we can deadlock when
 	 * writing to 'remove' to "dev/state".  We also need
 	 * to delay it due to rcu usage.
@@ -2423,6 +2617,9 @@ void md_update_sb(struct mddev *mddev, int force_change)
 	int sync_req;
 	int nospares = 0;
 	int any_badblocks_changed = 0;
+	unsigned long gen;
+	sector_t recovery_cp;
+	int rw;
 
 	if (mddev->ro) {
 		if (force_change)
@@ -2455,9 +2652,12 @@ repeat:
 		if (!mddev->external) {
 			clear_bit(MD_SB_CHANGE_PENDING, &mddev->sb_flags);
 			rdev_for_each(rdev, mddev) {
-				if (rdev->badblocks.changed) {
+				if (rdev->badblocks.changed ||
+				    rdev->bb_index.changed) {
 					rdev->badblocks.changed = 0;
+					rdev->bb_index.changed = 0;
 					ack_all_badblocks(&rdev->badblocks);
+					md_bb_index_ack_all(&rdev->bb_index);
 					md_error(mddev, rdev);
 				}
 				clear_bit(Blocked, &rdev->flags);
@@ -2519,13 +2719,28 @@ repeat:
 	WARN_ON(mddev->events == 0);
 
 	rdev_for_each(rdev, mddev) {
-		if (rdev->badblocks.changed)
+		if (rdev->badblocks.changed || rdev->bb_index.changed)
 			any_badblocks_changed++;
 		if (test_bit(Faulty, &rdev->flags))
 			set_bit(FaultRecorded, &rdev->flags);
 	}
 
 	sync_sbs(mddev, nospares);
+	gen = ++mddev->sb_gen_started;
+	/*
+	 * Marking a clean array dirty needs nothing else on stable storage
+	 * first, so FUA alone is enough.  Anything else (clean marks,
+	 * device changes, resync checkpoints, bad blocks) must follow the
+	 * data it describes.
+	 */
+	recovery_cp = mddev->recovery_cp;
+	if (nospares && !sync_req && mddev->sb_written_clean &&
+	    recovery_cp == mddev->sb_written_recovery_cp &&
+	    !any_badblocks_changed &&
+	    !test_bit(MD_RECOVERY_RUNNING, &mddev->recovery))
+		rw = WRITE_FUA;
+	else
+		rw = WRITE_FLUSH_FUA;
 	spin_unlock(&mddev->lock);
 
 	pr_debug("md: updating %s RAID superblock on device (in sync %d)\n",
@@ -2540,18 +2755,18 @@ rewrite:
 			continue; /* no noise on spare devices */
 
 		if (!test_bit(Faulty, &rdev->flags)) {
-			md_super_write(mddev,rdev,
-				       rdev->sb_start, rdev->sb_size,
-				       rdev->sb_page);
+			__md_super_write(mddev, rdev,
+					 rdev->sb_start, rdev->sb_size,
+					 rdev->sb_page, rw);
 			pr_debug("md: (write) %s's sb offset: %llu\n",
 				 bdevname(rdev->bdev, b),
 				 (unsigned long long)rdev->sb_start);
 			rdev->sb_events = mddev->events;
 			if (rdev->badblocks.size) {
-				md_super_write(mddev, rdev,
-					       rdev->badblocks.sector,
-					       rdev->badblocks.size << 9,
-					       rdev->bb_page);
+				__md_super_write(mddev, rdev,
+						 rdev->badblocks.sector,
+						 rdev->badblocks.size << 9,
+						 rdev->bb_page, rw);
 				rdev->badblocks.size = 0;
 			}
 
@@ -2567,6 +2782,13 @@ rewrite:
 		goto rewrite;
 	/* if there was a failure, MD_SB_CHANGE_DEVS was set, and we re-write super */
 
+	mddev->sb_written_clean = sync_req;
+	mddev->sb_written_recovery_cp = recovery_cp;
+	atomic64_inc(&mddev->sb_stat_updates);
+	smp_wmb(); /* sb writes complete before the generation is visible */
+	mddev->sb_gen_done = gen;
+	wake_up(&mddev->sb_wait);
+
 	if (mddev->in_sync != sync_req ||
 	    !bit_clear_unless(&mddev->sb_flags, BIT(MD_SB_CHANGE_PENDING),
 			       BIT(MD_SB_CHANGE_DEVS) | BIT(MD_SB_CHANGE_CLEAN)))
@@ -2580,8 +2802,10 @@ rewrite:
 		if (test_and_clear_bit(FaultRecorded, &rdev->flags))
 			clear_bit(Blocked, &rdev->flags);
 
-		if (any_badblocks_changed)
+		if (any_badblocks_changed) {
 			ack_all_badblocks(&rdev->badblocks);
+			md_bb_index_ack_all(&rdev->bb_index);
+		}
 		clear_bit(BlockedBadBlocks, &rdev->flags);
 		wake_up(&rdev->blocked_wait);
 	}
@@ -2657,7 +2881,7 @@ state_show(struct md_rdev *rdev, char *page)
 
 	if (test_bit(Faulty, &flags) ||
 	    (!test_bit(ExternalBbl, &flags) &&
-	    rdev->badblocks.unacked_exist))
+	    rdev_has_unacked_badblocks(rdev)))
 		len += sprintf(page+len, "faulty%s", sep);
 	if (test_bit(In_sync, &flags))
 		len += sprintf(page+len, "in_sync%s", sep);
@@ -2666,7 +2890,7 @@ state_show(struct md_rdev *rdev, char *page)
 	if (test_bit(WriteMostly, &flags))
 		len += sprintf(page+len, "write_mostly%s", sep);
 	if (test_bit(Blocked, &flags) ||
-	    (rdev->badblocks.unacked_exist
+	    (rdev_has_unacked_badblocks(rdev)
 	     && !test_bit(Faulty, &flags)))
 		len += sprintf(page+len, "blocked%s", sep);
 	if (!test_bit(Faulty, &flags) &&
@@ -2743,7 +2967,7 @@ state_store(struct md_rdev *rdev, const char *buf, size_t len)
 	} else if (cmd_match(buf, "-blocked")) {
 		if (!test_bit(Faulty, &rdev->flags) &&
 		    !test_bit(ExternalBbl, &rdev->flags) &&
-		    rdev->badblocks.unacked_exist) {
+		    rdev_has_unacked_badblocks(rdev)) {
 			/* metadata handler doesn't understand badblocks,
 			 * so we need to fail the device
 			 */
@@ -3200,7 +3424,9 @@ __ATTR(recovery_start, S_IRUGO|S_IWUSR, recovery_start_show, recovery_start_stor
  */
 static ssize_t bb_show(struct md_rdev *rdev, char *page)
 {
-	return badblocks_show(&rdev->badblocks, page, 0);
+	ssize_t len = badblocks_show(&rdev->badblocks, page, 0);
+
+	return md_bb_index_show(&rdev->bb_index, page, len, false);
 }
 static ssize_t bb_store(struct md_rdev *rdev, const char *page, size_t len)
 {
@@ -3215,7 +3441,9 @@ __ATTR(bad_blocks, S_IRUGO|S_IWUSR, bb_show, bb_store);
 
 static ssize_t ubb_show(struct md_rdev *rdev, char *page)
 {
-	return badblocks_show(&rdev->badblocks, page, 1);
+	ssize_t len = badblocks_show(&rdev->badblocks, page, 1);
+
+	return md_bb_index_show(&rdev->bb_index, page, len, true);
 }
 static ssize_t ubb_store(struct md_rdev *rdev, const char *page, size_t len)
 {
@@ -3386,6 +3614,7 @@ int md_rdev_init(struct md_rdev *rdev)
 	 * This reserves the space even on arrays where it cannot
 	 * be used - I wonder if that matters
 	 */
+	md_bb_index_init(&rdev->bb_index);
 	return badblocks_init(&rdev->badblocks, 0);
 }
 EXPORT_SYMBOL_GPL(md_rdev_init);
@@ -4574,6 +4803,91 @@ mismatch_cnt_show(struct mddev *mddev, char *page)
 
 static struct md_sysfs_entry md_mismatches = __ATTR_RO(mismatch_cnt);
 
+static ssize_t
+sb_stats_show(struct mddev *mddev, char *page)
+{
+	return sprintf(page, "updates %llu\nwrites %llu\nwaits %llu\n"
+		       "wait_us %llu\n",
+		       (unsigned long long)atomic64_read(&mddev->sb_stat_updates),
+		       (unsigned long long)atomic64_read(&mddev->sb_stat_writes),
+		       (unsigned long long)atomic64_read(&mddev->sb_stat_waits),
+		       (unsigned long long)atomic64_read(&mddev->sb_stat_wait_us));
+}
+
+static struct md_sysfs_entry md_sb_stats = __ATTR_RO(sb_stats);
+
+static const char *md_lat_names[MD_LAT_NR] = {
+	[MD_LAT_BARRIER]	= "barrier",
+	[MD_LAT_STRIPE]		= "get_stripe",
+	[MD_LAT_HANDLE_STRIPE]	= "handle_stripe",
+	[MD_LAT_BITMAP_START]	= "bitmap_startwrite",
+	[MD_LAT_BITMAP_UNPLUG]	= "bitmap_unplug",
+	[MD_LAT_JOURNAL]	= "journal",
+	[MD_LAT_FLUSH]		= "flush",
+	[MD_LAT_MEMBER_WRITE]	= "member_write",
+	[MD_LAT_MEMBER_READ]	= "member_read",
+};
+
+/*
+ * One line per stage: name, count, total usecs and the histogram
+ * buckets (bucket n > 0 is [2^(n-1), 2^n) usecs).  Stages that never
+ * ran are left out.  Writing anything resets the statistics.
+ */
+static ssize_t
+latency_show(struct mddev *mddev, char *page)
+{
+	struct md_lat_stats *sum;
+	ssize_t len = 0;
+	int cpu, s, i;
+
+	if (!mddev->lat_stats)
+		return -ENODEV;
+	sum = kzalloc(sizeof(*sum), GFP_KERNEL);
+	if (!sum)
+		return -ENOMEM;
+	for_each_possible_cpu(cpu) {
+		struct md_lat_stats *st = per_cpu_ptr(mddev->lat_stats, cpu);
+
+		for (s = 0; s < MD_LAT_NR; s++) {
+			for (i = 0; i < MD_LAT_SLOTS; i++)
+				sum->count[s][i] += st->count[s][i];
+			sum->total_ns[s] += st->total_ns[s];
+		}
+	}
+	for (s = 0; s < MD_LAT_NR; s++) {
+		unsigned long n = 0;
+
+		for (i = 0; i < MD_LAT_SLOTS; i++)
+			n += sum->count[s][i];
+		if (!n)
+			continue;
+		len += sprintf(page + len, "%s %lu %llu", md_lat_names[s], n,
+			       (unsigned long long)div_u64(sum->total_ns[s],
+							   NSEC_PER_USEC));
+		for (i = 0; i < MD_LAT_SLOTS; i++)
+			len += sprintf(page + len, " %lu", sum->count[s][i]);
+		len += sprintf(page + len, "\n");
+	}
+	kfree(sum);
+	return len;
+}
+
+static ssize_t
+latency_store(struct mddev *mddev, const char *buf, size_t len)
+{
+	int cpu;
+
+	if (!mddev->lat_stats)
+		return -ENODEV;
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(mddev->lat_stats, cpu), 0,
+		       sizeof(struct md_lat_stats));
+	return len;
+}
+
+static struct md_sysfs_entry md_latency =
+__ATTR(latency, S_IRUGO|S_IWUSR, latency_show, latency_store);
+
 static ssize_t
 sync_min_show(struct mddev *mddev, char *page)
 {
@@ -4632,6 +4946,48 @@ sync_max_store(struct mddev *mddev, const char *buf, size_t len)
 static struct md_sysfs_entry md_sync_max =
 __ATTR(sync_speed_max, S_IRUGO|S_IWUSR, sync_max_show, sync_max_store);
 
+/*
+ * Foreground latency that resync should not push the array past, in
+ * usecs.  0 leaves resync throttling to sync_speed_{min,max} and the
+ * idle check.
+ */
+static ssize_t
+sync_latency_target_show(struct mddev *mddev, char *page)
+{
+	return sprintf(page, "%u\n", mddev->sync_latency_target);
+}
+
+static ssize_t
+sync_latency_target_store(struct mddev *mddev, const char *buf, size_t len)
+{
+	unsigned int target;
+	int rv;
+
+	rv = kstrtouint(buf, 10, &target);
+	if (rv < 0)
+		return rv;
+	mddev->sync_latency_target = target;
+	return len;
+}
+
+static struct md_sysfs_entry md_sync_latency_target =
+__ATTR(sync_latency_target, S_IRUGO|S_IWUSR,
+       sync_latency_target_show, sync_latency_target_store);
+
+static ssize_t
+sync_rate_show(struct mddev *mddev, char *page)
+{
+	struct md_sync_ctl *ctl = &mddev->sync_ctl;
+	const char *reason = ACCESS_ONCE(ctl->reason);
+
+	if (!mddev->sync_latency_target || !mddev->curr_resync || !reason)
+		return sprintf(page, "none\n");
+	return sprintf(page, "%u %s (latency %uus)\n", ACCESS_ONCE(ctl->rate),
+		       reason, ACCESS_ONCE(ctl->latency_us));
+}
+
+static struct md_sysfs_entry md_sync_rate = __ATTR_RO(sync_rate);
+
 static ssize_t
 degraded_show(struct mddev *mddev, char *page)
 {
@@ -5071,6 +5427,8 @@ static struct attribute *md_default_attrs[] = {
 	&md_array_size.attr,
 	&max_corr_read_errors.attr,
 	&md_consistency_policy.attr,
+	&md_sb_stats.attr,
+	&md_latency.attr,
 	NULL,
 };
 
@@ -5081,6 +5439,8 @@ static struct attribute *md_redundancy_attrs[] = {
 	&md_sync_min.attr,
 	&md_sync_max.attr,
 	&md_sync_speed.attr,
+	&md_sync_latency_target.attr,
+	&md_sync_rate.attr,
 	&md_sync_force_parallel.attr,
 	&md_sync_completed.attr,
 	&md_min_sync.attr,
@@ -5156,6 +5516,7 @@ static void md_free(struct kobject *ko)
 	if (mddev->queue)
 		blk_cleanup_queue(mddev->queue);
 	percpu_ref_exit(&mddev->writes_pending);
+	mddev_destroy(mddev);
 
 	kfree(mddev);
 }
@@ -7810,6 +8171,176 @@ int unregister_md_personality(struct md_personality *p)
 }
 EXPORT_SYMBOL(unregister_md_personality);
 
+/*
+ * Latency driven resync throttling.
+ *
+ * Every MD_SYNC_CTL_TICK the controller looks at the foreground latency
+ * of the last interval and adjusts the resync rate: additive increase
+ * while the latency is comfortably below sync_latency_target (or there
+ * is no foreground I/O), multiplicative decrease while it is above.
+ * sync_speed_min and sync_speed_max stay hard bounds.
+ *
+ * Foreground latency is the 95th percentile of member reads and writes
+ * recorded by the personality (raid1, raid10); resync io is not
+ * recorded there.  Where there are too few samples, the members' disk
+ * statistics only tell whether there is foreground io at all, as in
+ * is_mddev_idle(): their completion times include resync io, so they
+ * are not used as a latency.
+ */
+#define MD_SYNC_CTL_TICK	(HZ / 10)
+#define MD_SYNC_CTL_SAMPLES	16	/* member writes for a percentile */
+#define MD_SYNC_CTL_IDLE	64	/* foreground sectors per tick */
+
+/* member sectors that were not resync io */
+static unsigned long md_sync_ctl_fg_sectors(struct mddev *mddev)
+{
+	struct md_rdev *rdev;
+	unsigned long fg = 0;
+
+	rcu_read_lock();
+	rdev_for_each_rcu(rdev, mddev) {
+		struct gendisk *disk = rdev->bdev->bd_contains->bd_disk;
+
+		fg += part_stat_read(&disk->part0, sectors[0]) +
+		      part_stat_read(&disk->part0, sectors[1]) -
+		      atomic_read(&disk->sync_io);
+	}
+	rcu_read_unlock();
+	return fg;
+}
+
+/*
+ * A counter that went backwards was reset (md/latency) or lost a member:
+ * count what it has now.
+ */
+static unsigned long md_sync_ctl_delta(unsigned long cur, unsigned long old)
+{
+	return cur >= old ? cur - old : cur;
+}
+
+/* member io latency percentile since the last call, or 0 */
+static unsigned int md_sync_ctl_member_latency(struct mddev *mddev)
+{
+	struct md_sync_ctl *ctl = &mddev->sync_ctl;
+	unsigned long cur[MD_LAT_SLOTS] = { 0 };
+	unsigned long n = 0, seen = 0, delta;
+	unsigned int lat = 0;
+	int cpu, i;
+
+	if (!mddev->lat_stats)
+		return 0;
+	for_each_possible_cpu(cpu) {
+		struct md_lat_stats *st = per_cpu_ptr(mddev->lat_stats, cpu);
+
+		for (i = 0; i < MD_LAT_SLOTS; i++)
+			cur[i] += st->count[MD_LAT_MEMBER_WRITE][i] +
+				  st->count[MD_LAT_MEMBER_READ][i];
+	}
+	for (i = 0; i < MD_LAT_SLOTS; i++)
+		n += md_sync_ctl_delta(cur[i], ctl->lat_snap[i]);
+	if (n >= MD_SYNC_CTL_SAMPLES) {
+		for (i = 0; i < MD_LAT_SLOTS; i++) {
+			delta = md_sync_ctl_delta(cur[i], ctl->lat_snap[i]);
+			seen += delta;
+			if (seen * 100 >= n * 95) {
+				/* upper bound of the bucket */
+				lat = 1U << i;
+				break;
+			}
+		}
+	}
+	memcpy(ctl->lat_snap, cur, sizeof(cur));
+	return lat;
+}
+
+static void md_sync_ctl_init(struct mddev *mddev, sector_t done)
+{
+	struct md_sync_ctl *ctl = &mddev->sync_ctl;
+
+	ctl->rate = speed_min(mddev);
+	ctl->reason = "starting";
+	ctl->latency_us = 0;
+	ctl->tick = jiffies;
+	ctl->tick_done = done;
+	md_sync_ctl_member_latency(mddev);
+	ctl->fg_sectors = md_sync_ctl_fg_sectors(mddev);
+}
+
+static void md_sync_ctl_adjust(struct mddev *mddev, sector_t done)
+{
+	struct md_sync_ctl *ctl = &mddev->sync_ctl;
+	unsigned int target = mddev->sync_latency_target;
+	unsigned int lo = speed_min(mddev), hi = speed_max(mddev);
+	unsigned int step = max(hi / 16, lo);
+	unsigned long fg, elapsed;
+	unsigned int lat, speed;
+	unsigned int rate = ctl->rate;
+	const char *reason;
+	bool idle = false, unknown = false;
+
+	elapsed = jiffies - ctl->tick;
+	if (!elapsed)
+		elapsed = 1;
+	speed = (unsigned long)(done - ctl->tick_done) / 2 * HZ / elapsed;
+
+	lat = md_sync_ctl_member_latency(mddev);
+	fg = md_sync_ctl_fg_sectors(mddev);
+	if (!lat) {
+		/* members may have come or gone, ignore what looks odd */
+		if (fg < ctl->fg_sectors)
+			unknown = true;
+		else if (fg - ctl->fg_sectors <= MD_SYNC_CTL_IDLE)
+			idle = true;
+		else
+			unknown = true;
+	}
+	ctl->fg_sectors = fg;
+	ctl->latency_us = lat;
+
+	if (idle) {
+		rate += step;
+		reason = "idle";
+	} else if (unknown) {
+		/* foreground io, but too little to measure: hold */
+		reason = "too few samples";
+	} else if (lat > target) {
+		rate -= rate / 4;
+		reason = "latency above target";
+	} else if (lat > target - target / 4) {
+		reason = "latency at target";
+	} else if (speed * 2 < rate) {
+		/* not using what we have, don't grow it further */
+		reason = "limited by devices";
+	} else {
+		rate += step;
+		reason = "latency below target";
+	}
+	if (rate >= hi) {
+		rate = hi;
+		reason = "sync_speed_max";
+	} else if (rate <= lo) {
+		rate = lo;
+		reason = "sync_speed_min";
+	}
+	ctl->rate = rate;
+	ctl->reason = reason;
+	ctl->tick = jiffies;
+	ctl->tick_done = done;
+}
+
+/* returns true if resync is ahead of the allowed rate and should wait */
+static bool md_sync_ctl_throttle(struct mddev *mddev, sector_t done)
+{
+	struct md_sync_ctl *ctl = &mddev->sync_ctl;
+	u64 allowed;
+
+	if (time_after_eq(jiffies, ctl->tick + MD_SYNC_CTL_TICK))
+		md_sync_ctl_adjust(mddev, done);
+	/* in sectors, with one jiffy of slack */
+	allowed = div_u64((u64)ctl->rate * 2 * (jiffies - ctl->tick + 1), HZ);
+	return done - ctl->tick_done > allowed;
+}
+
 static int is_mddev_idle(struct mddev *mddev, int init)
 {
 	struct md_rdev *rdev;
@@ -7913,10 +8444,7 @@ bool md_write_start(struct mddev *mddev, struct bio *bi)
 		sysfs_notify_dirent_safe(mddev->sysfs_state);
 	if (!mddev->has_superblocks)
 		return true;
-	wait_event(mddev->sb_wait,
-		   !test_bit(MD_SB_CHANGE_PENDING, &mddev->sb_flags) ||
-		   mddev->suspended);
-	if (test_bit(MD_SB_CHANGE_PENDING, &mddev->sb_flags)) {
+	if (!md_wait_for_sb_update(mddev, true)) {
 		percpu_ref_put(&mddev->writes_pending);
 		return false;
 	}
@@ -8152,6 +8680,7 @@ void md_do_sync(struct md_thread *thread)
 		 speed_max(mddev), desc);
 
 	is_mddev_idle(mddev, 1); /* this initializes IO event counters */
+	md_sync_ctl_init(mddev, 0);
 
 	io_sectors = 0;
 	for (m = 0; m < SYNC_MARKS; m++) {
@@ -8286,7 +8815,17 @@ void md_do_sync(struct md_thread *thread)
 		currspeed = ((unsigned long)(recovery_done - mddev->resync_mark_cnt))/2
 			/((jiffies-mddev->resync_mark)/HZ +1) +1;
 
-		if (currspeed > speed_min(mddev)) {
+		if (mddev->sync_latency_target) {
+			if (md_sync_ctl_throttle(mddev, recovery_done) &&
+			    currspeed > speed_min(mddev)) {
+				msleep(jiffies_to_msecs(MD_SYNC_CTL_TICK) / 4 ?: 1);
+				goto repeat;
+			}
+			if (currspeed > speed_max(mddev)) {
+				msleep(500);
+				goto repeat;
+			}
+		} else if (currspeed > speed_min(mddev)) {
 			bool check = false;
 			if (mddev->queue && !is_mddev_idle(mddev, 0) &&
 				!blk_queue_nonrot(mddev->queue))
@@ -8782,7 +9321,15 @@ int rdev_set_badblocks(struct md_rdev *rdev, sector_t s, int sectors,
 		s += rdev->new_data_offset;
 	else
 		s += rdev->data_offset;
-	rv = badblocks_set(&rdev->badblocks, s, sectors, 0);
+	if (md_bb_index_used(&rdev->bb_index))
+		rv = 1;
+	else
+		rv = badblocks_set(&rdev->badblocks, s, sectors, 0);
+	if (rv && (md_bb_index_used(&rdev->bb_index) ||
+		   !md_bb_index_absorb(&rdev->bb_index, &rdev->badblocks)))
+		/* The table is full, the index takes it from here */
+		rv = md_bb_index_set(&rdev->bb_index, s, sectors,
+				     rdev->badblocks.shift, false);
 	if (rv == 0) {
 		/* Make sure they get written out promptly */
 		if (test_bit(ExternalBbl, &rdev->flags))
@@ -8807,6 +9354,9 @@ int rdev_clear_badblocks(struct md_rdev *rdev, sector_t s, int sectors,
 	else
 		s += rdev->data_offset;
 	rv = badblocks_clear(&rdev->badblocks, s, sectors);
+	if (rv == 0)
+		rv = md_bb_index_clear(&rdev->bb_index, s, sectors,
+				       rdev->badblocks.shift);
 	if ((rv == 0) && test_bit(ExternalBbl, &rdev->flags))
 		sysfs_notify(&rdev->kobj, NULL, "bad_blocks");
 	return rv;
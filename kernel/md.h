@@ -21,9 +21,11 @@
 #include <linux/list.h>
 #include <linux/mm.h>
 #include <linux/mutex.h>
+#include <linux/sched.h>
 #include <linux/timer.h>
 #include <linux/wait.h>
 #include <linux/workqueue.h>
+#include "md-badblocks.h"
 
 #define MaxSector (~(sector_t)0)
 
@@ -120,6 +122,7 @@ struct md_rdev {
 					   * sysfs entry */
 
 	struct badblocks badblocks;
+	struct md_bb_index bb_index;	/* ranges that don't fit in badblocks */
 
 	struct {
 		short offset;	/* Offset from superblock to start of PPL.
@@ -206,16 +209,22 @@ enum flag_bits {
 static inline int is_badblock(struct md_rdev *rdev, sector_t s, int sectors,
 			      sector_t *first_bad, int *bad_sectors)
 {
-	if (unlikely(rdev->badblocks.count)) {
-		int rv = badblocks_check(&rdev->badblocks, rdev->data_offset + s,
-					sectors,
-					first_bad, bad_sectors);
+	if (unlikely(rdev->badblocks.count ||
+		     md_bb_index_used(&rdev->bb_index))) {
+		int rv = md_badblocks_check(rdev, rdev->data_offset + s,
+					    sectors,
+					    first_bad, bad_sectors);
 		if (rv)
 			*first_bad -= rdev->data_offset;
 		return rv;
 	}
 	return 0;
 }
+static inline bool rdev_has_unacked_badblocks(struct md_rdev *rdev)
+{
+	return rdev->badblocks.unacked_exist ||
+		md_bb_index_unacked(&rdev->bb_index);
+}
 extern int rdev_set_badblocks(struct md_rdev *rdev, sector_t s, int sectors,
 			      int is_new);
 extern int rdev_clear_badblocks(struct md_rdev *rdev, sector_t s, int sectors,
@@ -230,6 +239,45 @@ enum mddev_sb_flags {
 	MD_SB_NEED_REWRITE,	/* metadata write needs to be repeated */
 };
 
+/*
+ * Stages of request handling whose latency is recorded per array, see
+ * md_lat_record() and md/latency.
+ */
+enum md_lat_stage {
+	MD_LAT_BARRIER,		/* raid1/raid10 wait_barrier() */
+	MD_LAT_STRIPE,		/* raid5 stripe_head allocation */
+	MD_LAT_HANDLE_STRIPE,	/* raid5 handle_stripe() */
+	MD_LAT_BITMAP_START,	/* bitmap_startwrite() */
+	MD_LAT_BITMAP_UNPLUG,	/* bitmap_unplug() */
+	MD_LAT_JOURNAL,		/* raid5 journal io_unit write */
+	MD_LAT_FLUSH,		/* md_flush_request() until data submission */
+	MD_LAT_MEMBER_WRITE,	/* raid1/raid10 write to a member */
+	MD_LAT_MEMBER_READ,	/* raid1/raid10 read from a member */
+	MD_LAT_NR,
+};
+
+/* slot n > 0 counts latencies in [2^(n-1), 2^n) usecs */
+#define MD_LAT_SLOTS	24
+
+struct md_lat_stats {
+	unsigned long	count[MD_LAT_NR][MD_LAT_SLOTS];
+	u64		total_ns[MD_LAT_NR];
+};
+
+/*
+ * Resync rate controller state, used by md_do_sync() when
+ * sync_latency_target is set.  See md_sync_ctl_adjust().
+ */
+struct md_sync_ctl {
+	unsigned int	rate;		/* KB/sec currently allowed */
+	const char	*reason;	/* why it is what it is */
+	unsigned int	latency_us;	/* foreground latency last seen */
+	unsigned long	tick;		/* jiffies of last adjustment */
+	sector_t	tick_done;	/* resync progress at 'tick' */
+	unsigned long	lat_snap[MD_LAT_SLOTS]; /* member io histogram */
+	unsigned long	fg_sectors;	/* member non-resync sectors */
+};
+
 struct mddev {
 	void				*private;
 	struct md_personality		*pers;
@@ -250,7 +298,7 @@ struct mddev {
 	unsigned long			sb_flags;
 
 	int				suspended;
-	atomic_t			active_io;
+	struct percpu_ref		active_io;
 	int				ro;
 	int				sysfs_active; /* set when sysfs deletes
 						       * are happening, so run/
@@ -344,6 +392,8 @@ struct mddev {
 	/* if zero, use the system-wide default */
 	int				sync_speed_min;
 	int				sync_speed_max;
+	unsigned int			sync_latency_target; /* usecs, 0 = off */
+	struct md_sync_ctl		sync_ctl;
 
 	/* resync even though the same disks are shared among md-devices */
 	int				parallel_resync;
@@ -425,7 +475,7 @@ struct mddev {
 	struct work_struct del_work;	/* used for delayed sysfs removal */
 
 	/* "lock" protects:
-	 *   flush_bio transition from NULL to !NULL
+	 *   flush_bios, flush_pending_bios, flush_running
 	 *   rdev superblocks, events
 	 *   clearing MD_CHANGE_*
 	 *   in_sync - and related safemode and MD_CHANGE changes
@@ -438,6 +488,16 @@ struct mddev {
 	spinlock_t			lock;
 	wait_queue_head_t		sb_wait;	/* for waiting on superblock updates */
 	atomic_t			pending_writes;	/* number of active superblock writes */
+	unsigned long			sb_gen_started;	/* superblock update generations, */
+	unsigned long			sb_gen_done;	/* see md_wait_for_sb_update() */
+	bool				sb_written_clean; /* in_sync of the last update */
+	sector_t			sb_written_recovery_cp;
+	atomic64_t			sb_stat_updates; /* completed md_update_sb() passes */
+	atomic64_t			sb_stat_writes;	/* member superblock writes issued */
+	atomic64_t			sb_stat_waits;	/* writers that waited for an update */
+	atomic64_t			sb_stat_wait_us; /* and how long they waited */
+
+	struct md_lat_stats __percpu	*lat_stats;
 
 	unsigned int			safemode;	/* if set, update "clean" superblock
 							 * when no writes pending.
@@ -483,13 +543,16 @@ struct mddev {
 
 	/* Generic flush handling.
 	 * The last to finish preflush schedules a worker to submit
-	 * the rest of the request (without the REQ_PREFLUSH flag).
+	 * the rest of the requests (without the REQ_PREFLUSH flag).
+	 * Requests arriving while a flush is running are queued on
+	 * flush_pending_bios and share the next flush generation.
 	 */
-	struct bio *flush_bio;
+	struct bio_list flush_bios;	/* in the running generation */
+	struct bio_list flush_pending_bios; /* waiting for the next one */
+	bool flush_running;
+	u64 flush_pending_since;	/* arrival of the oldest queued bio */
+	u64 flush_since;		/* same, for the running generation */
 	atomic_t flush_pending;
-	ktime_t start_flush, last_flush; /* last_flush is when the last completed
-					  * flush was started.
-					  */
 	struct work_struct flush_work;
 	struct work_struct event_work;	/* used by dm to report failure event */
 	void (*sync_super)(struct mddev *mddev, struct md_rdev *rdev);
@@ -682,7 +745,11 @@ extern int mddev_congested(struct mddev *mddev, int bits);
 extern void md_flush_request(struct mddev *mddev, struct bio *bio);
 extern void md_super_write(struct mddev *mddev, struct md_rdev *rdev,
 			   sector_t sector, int size, struct page *page);
+extern int md_super_write_pages(struct mddev *mddev, struct md_rdev *rdev,
+				sector_t sector, struct page **pages, int nr,
+				int last_size);
 extern int md_super_wait(struct mddev *mddev);
+extern bool md_wait_for_sb_update(struct mddev *mddev, bool stop_on_suspend);
 extern int sync_page_io(struct md_rdev *rdev, sector_t sector, int size,
 			struct page *page, int rw, bool metadata_op);
 extern void md_do_sync(struct md_thread *thread);
@@ -695,7 +762,16 @@ extern int md_integrity_register(struct mddev *mddev);
 extern int md_integrity_add_rdev(struct md_rdev *rdev, struct mddev *mddev);
 extern int strict_strtoul_scaled(const char *cp, unsigned long *res, int scale);
 
-extern void mddev_init(struct mddev *mddev);
+extern int mddev_init(struct mddev *mddev);
+extern void mddev_destroy(struct mddev *mddev);
+
+/* start/end a timed stage: u64 t = md_lat_start(); ... md_lat_record() */
+static inline u64 md_lat_start(void)
+{
+	return local_clock();
+}
+extern void md_lat_record(struct mddev *mddev, enum md_lat_stage stage,
+			  u64 start);
 extern int md_run(struct mddev *mddev);
 extern int md_start(struct mddev *mddev);
 extern void md_stop(struct mddev *mddev);
@@ -609,6 +609,15 @@ int dm_bm_flush(struct dm_block_manager *bm)
 }
 EXPORT_SYMBOL_GPL(dm_bm_flush);
 
+void dm_bm_start_flush(struct dm_block_manager *bm)
+{
+	if (bm->read_only)
+		return;
+
+	dm_bufio_write_dirty_buffers_async(bm->bufio);
+}
+EXPORT_SYMBOL_GPL(dm_bm_start_flush);
+
 void dm_bm_prefetch(struct dm_block_manager *bm, dm_block_t b)
 {
 	dm_bufio_prefetch(bm->bufio, b, 1);
@@ -107,6 +107,13 @@ void dm_bm_unlock(struct dm_block *b);
  */
 int dm_bm_flush(struct dm_block_manager *bm);
 
+/*
+ * Starts writing out dirty blocks without waiting for them.  Blocks
+ * may be dirtied again while the io is in flight, so this is only a
+ * head start for a later dm_bm_flush().
+ */
+void dm_bm_start_flush(struct dm_block_manager *bm);
+
 /*
  * Request data is prefetched into the cache.
  */
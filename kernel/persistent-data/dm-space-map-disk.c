@@ -161,25 +161,79 @@ static int sm_disk_dec_block(struct dm_space_map *sm, dm_block_t b)
 	return r;
 }
 
-static int sm_disk_new_block(struct dm_space_map *sm, dm_block_t *b)
+/*
+ * A block is only free if it is unused in both the last committed
+ * transaction and the current one.  new_block_near() can hand out blocks
+ * below smd->begin, so the old_ll search alone is not enough.
+ */
+static int sm_disk_find_free(struct sm_disk *smd, dm_block_t begin,
+			     dm_block_t end, dm_block_t *b)
+{
+	int r;
+	uint32_t count;
+
+	while (begin < end) {
+		r = sm_ll_find_free_block(&smd->old_ll, begin, end, b);
+		if (r)
+			return r;
+
+		r = sm_ll_lookup(&smd->ll, *b, &count);
+		if (r)
+			return r;
+
+		if (!count)
+			return 0;
+
+		begin = *b + 1;
+	}
+
+	return -ENOSPC;
+}
+
+static int sm_disk_alloc(struct sm_disk *smd, dm_block_t b)
 {
 	int r;
 	enum allocation_event ev;
+
+	r = sm_ll_inc(&smd->ll, b, &ev);
+	if (!r) {
+		BUG_ON(ev != SM_ALLOC);
+		smd->nr_allocated_this_transaction++;
+	}
+
+	return r;
+}
+
+static int sm_disk_new_block(struct dm_space_map *sm, dm_block_t *b)
+{
+	int r;
 	struct sm_disk *smd = container_of(sm, struct sm_disk, sm);
 
 	/* FIXME: we should loop round a couple of times */
-	r = sm_ll_find_free_block(&smd->old_ll, smd->begin, smd->old_ll.nr_blocks, b);
+	r = sm_disk_find_free(smd, smd->begin, smd->old_ll.nr_blocks, b);
 	if (r)
 		return r;
 
 	smd->begin = *b + 1;
-	r = sm_ll_inc(&smd->ll, *b, &ev);
-	if (!r) {
-		BUG_ON(ev != SM_ALLOC);
-		smd->nr_allocated_this_transaction++;
-	}
+	return sm_disk_alloc(smd, *b);
+}
 
-	return r;
+static int sm_disk_new_block_near(struct dm_space_map *sm, dm_block_t hint,
+				  dm_block_t *b)
+{
+	int r;
+	struct sm_disk *smd = container_of(sm, struct sm_disk, sm);
+
+	if (hint >= smd->old_ll.nr_blocks)
+		hint = 0;
+
+	r = sm_disk_find_free(smd, hint, smd->old_ll.nr_blocks, b);
+	if (r == -ENOSPC && hint)
+		r = sm_disk_find_free(smd, 0, hint, b);
+	if (r)
+		return r;
+
+	return sm_disk_alloc(smd, *b);
 }
 
 static int sm_disk_commit(struct dm_space_map *sm)
@@ -245,6 +299,7 @@ static struct dm_space_map ops = {
 	.inc_block = sm_disk_inc_block,
 	.dec_block = sm_disk_dec_block,
 	.new_block = sm_disk_new_block,
+	.new_block_near = sm_disk_new_block_near,
 	.commit = sm_disk_commit,
 	.root_size = sm_disk_root_size,
 	.copy_root = sm_disk_copy_root,
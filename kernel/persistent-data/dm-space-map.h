@@ -54,6 +54,13 @@ struct dm_space_map {
 	 */
 	int (*new_block)(struct dm_space_map *sm, dm_block_t *b);
 
+	/*
+	 * new_block_near allocates hint if it is free, otherwise the next
+	 * free block after it, wrapping round.  Optional.
+	 */
+	int (*new_block_near)(struct dm_space_map *sm, dm_block_t hint,
+			      dm_block_t *b);
+
 	/*
 	 * The root contains all the information needed to fix the space map.
 	 * Generally this info is small, so squirrel it away in a disk block
@@ -132,6 +139,15 @@ static inline int dm_sm_new_block(struct dm_space_map *sm, dm_block_t *b)
 	return sm->new_block(sm, b);
 }
 
+static inline int dm_sm_new_block_near(struct dm_space_map *sm,
+				       dm_block_t hint, dm_block_t *b)
+{
+	if (!sm->new_block_near)
+		return sm->new_block(sm, b);
+
+	return sm->new_block_near(sm, hint, b);
+}
+
 static inline int dm_sm_root_size(struct dm_space_map *sm, size_t *result)
 {
 	return sm->root_size(sm, result);
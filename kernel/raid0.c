@@ -276,6 +276,34 @@ static int create_strip_zones(struct mddev *mddev, struct r0conf **private_conf)
 			 (unsigned long long)smallest->sectors);
 	}
 
+	/*
+	 * Precompute what mapping needs per zone so the I/O path gets by
+	 * with shifts, or a single division per bio, instead of several
+	 * sector_div()s per chunk.  The member disk of a chunk is picked
+	 * by its array-wide chunk number, so zones that do not start on a
+	 * stripe boundary see their disks rotated by disk_rot.
+	 */
+	c = mddev->chunk_sectors;
+	conf->chunk_shift = is_power_of_2(c) ? ffz(~c) : -1;
+	curr_zone_end = 0;
+	for (i = 0; i < conf->nr_strip_zones; i++) {
+		sector_t first_chunk = curr_zone_end;
+
+		zone = conf->strip_zone + i;
+		zone->stripe_sectors = zone->nb_dev * c;
+		zone->stripe_shift = is_power_of_2(zone->stripe_sectors) ?
+			ffz(~zone->stripe_sectors) : -1;
+		sector_div(first_chunk, c);
+		zone->disk_rot = sector_div(first_chunk, zone->nb_dev);
+		zone->dev = conf->devlist + i * mddev->raid_disks;
+		curr_zone_end = zone->zone_end;
+	}
+	/*
+	 * Without merge_bvec_fn members to honour, bios may span chunks
+	 * and are fanned out to one bio per member.
+	 */
+	conf->fanout = !conf->has_merge_bvec;
+
 	pr_debug("md/raid0:%s: done.\n", mdname(mddev));
 	*private_conf = conf;
 
@@ -308,40 +336,60 @@ static struct strip_zone *find_zone(struct r0conf *conf,
 }
 
 /*
- * remaps the bio to the target device. we separate two flows.
- * power 2 flow and a general flow for the sake of perfromance
-*/
+ * Split an offset in the zone into the stripe row, the position of the
+ * chunk in that row and the offset inside the chunk, using the shifts
+ * precomputed for power of 2 geometries.
+ */
+static sector_t zone_row(struct r0conf *conf, struct strip_zone *zone,
+			 unsigned int chunk_sects, sector_t zone_offset,
+			 unsigned int *pos, unsigned int *sect_in_chunk)
+{
+	sector_t row = zone_offset;
+	unsigned int in_stripe;
+
+	if (zone->stripe_shift >= 0) {
+		in_stripe = zone_offset & (zone->stripe_sectors - 1);
+		row >>= zone->stripe_shift;
+	} else
+		in_stripe = sector_div(row, zone->stripe_sectors);
+
+	if (conf->chunk_shift >= 0) {
+		*pos = in_stripe >> conf->chunk_shift;
+		*sect_in_chunk = in_stripe & (chunk_sects - 1);
+	} else {
+		*pos = in_stripe / chunk_sects;
+		*sect_in_chunk = in_stripe - *pos * chunk_sects;
+	}
+	return row;
+}
+
+/* member slot of the chunk at position 'pos' of a row in this zone */
+static inline unsigned int zone_disk(struct strip_zone *zone,
+				     unsigned int pos)
+{
+	pos += zone->disk_rot;
+	if (pos >= zone->nb_dev)
+		pos -= zone->nb_dev;
+	return pos;
+}
+
+/*
+ * remaps an offset in the zone to the target device.
+ *  real sector = chunk in device + starting of zone
+ *	+ the position in the chunk
+ */
 static struct md_rdev *map_sector(struct mddev *mddev, struct strip_zone *zone,
-				sector_t sector, sector_t *sector_offset)
+				  sector_t *sector_offset)
 {
-	unsigned int sect_in_chunk;
-	sector_t chunk;
 	struct r0conf *conf = mddev->private;
-	int raid_disks = conf->strip_zone[0].nb_dev;
 	unsigned int chunk_sects = mddev->chunk_sectors;
+	unsigned int pos, sect_in_chunk;
+	sector_t row;
 
-	if (is_power_of_2(chunk_sects)) {
-		int chunksect_bits = ffz(~chunk_sects);
-		/* find the sector offset inside the chunk */
-		sect_in_chunk  = sector & (chunk_sects - 1);
-		sector >>= chunksect_bits;
-		/* chunk in zone */
-		chunk = *sector_offset;
-		/* quotient is the chunk in real device*/
-		sector_div(chunk, zone->nb_dev << chunksect_bits);
-	} else{
-		sect_in_chunk = sector_div(sector, chunk_sects);
-		chunk = *sector_offset;
-		sector_div(chunk, chunk_sects * zone->nb_dev);
-	}
-	/*
-	*  position the bio over the real device
-	*  real sector = chunk in device + starting of zone
-	*	+ the position in the chunk
-	*/
-	*sector_offset = (chunk * chunk_sects) + sect_in_chunk;
-	return conf->devlist[(zone - conf->strip_zone)*raid_disks
-			     + sector_div(sector, zone->nb_dev)];
+	row = zone_row(conf, zone, chunk_sects, *sector_offset,
+		       &pos, &sect_in_chunk);
+	*sector_offset = row * chunk_sects + sect_in_chunk;
+	return zone->dev[zone_disk(zone, pos)];
 }
 
 /**
@@ -366,6 +414,10 @@ static int raid0_mergeable_bvec(struct mddev *mddev,
 	struct md_rdev *rdev;
 	struct request_queue *subq;
 
+	if (conf->fanout)
+		/* raid0_make_request() fans out bios that span chunks */
+		return biovec->bv_len;
+
 	if (is_power_of_2(chunk_sectors))
 		max =  (chunk_sectors - ((sector & (chunk_sectors-1))
 						+ bio_sectors)) << 9;
@@ -383,9 +435,8 @@ static int raid0_mergeable_bvec(struct mddev *mddev,
 		return max;
 
 	/* May need to check subordinate device */
-	sector = sector_offset;
 	zone = find_zone(mddev->private, &sector_offset);
-	rdev = map_sector(mddev, zone, sector, &sector_offset);
+	rdev = map_sector(mddev, zone, &sector_offset);
 	subq = bdev_get_queue(rdev->bdev);
 	if (subq->merge_bvec_fn) {
 		bvm->bi_bdev = rdev->bdev;
@@ -437,7 +488,9 @@ static int raid0_run(struct mddev *mddev)
 		struct md_rdev *rdev;
 		bool discard_supported = false;
 
-		blk_queue_max_hw_sectors(mddev->queue, mddev->chunk_sectors);
+		/* with fanout only the members limit the bio size */
+		blk_queue_max_hw_sectors(mddev->queue, conf->fanout ?
+					 UINT_MAX : mddev->chunk_sectors);
 		blk_queue_max_write_same_sectors(mddev->queue, mddev->chunk_sectors);
 		blk_queue_max_discard_sectors(mddev->queue, UINT_MAX);
 
@@ -684,9 +737,170 @@ static void raid0_handle_discard(struct mddev *mddev, struct bio *bio)
 	bio_endio(bio, 0);
 }
 
+/* walks the bio_vecs of a bio by byte offset from the bio start */
+struct r0_bvec_cursor {
+	unsigned short	idx;
+	unsigned int	base;	/* bytes in front of bi_io_vec[idx] */
+};
+
+struct r0_member_bio {
+	struct bio	*bio;
+	struct md_rdev	*rdev;
+	sector_t	sector;	/* next member sector to fill */
+	int		max_vecs;
+};
+
+static void r0_member_submit(struct bio *parent, struct r0_member_bio *mb)
+{
+	struct bio *bio = mb->bio;
+
+	if (!bio)
+		return;
+	mb->bio = NULL;
+	bio_chain(bio, parent);
+	generic_make_request(bio);
+}
+
+/*
+ * Append 'len' bytes of the parent at byte offset 'off' to the member
+ * bio, starting a new member bio whenever the current one is full.
+ */
+static void r0_member_add(struct mddev *mddev, struct bio *parent,
+			  struct r0_member_bio *mb, struct r0_bvec_cursor *cur,
+			  unsigned int off, unsigned int len)
+{
+	while (cur->base + parent->bi_io_vec[cur->idx].bv_len <= off) {
+		cur->base += parent->bi_io_vec[cur->idx].bv_len;
+		cur->idx++;
+	}
+
+	while (len) {
+		struct bio_vec *bv = &parent->bi_io_vec[cur->idx];
+		unsigned int skip = off - cur->base;
+		unsigned int take = min(bv->bv_len - skip, len);
+		struct bio *bio = mb->bio;
+
+		if (bio && bio->bi_vcnt == mb->max_vecs)
+			r0_member_submit(parent, mb);
+		if (!mb->bio) {
+			bio = bio_alloc_mddev(GFP_NOIO, mb->max_vecs, mddev);
+			bio->bi_rw = parent->bi_rw;
+			bio->bi_bdev = mb->rdev->bdev;
+			bio->bi_sector = mb->sector;
+			mb->bio = bio;
+		}
+
+		bio->bi_io_vec[bio->bi_vcnt].bv_page = bv->bv_page;
+		bio->bi_io_vec[bio->bi_vcnt].bv_len = take;
+		bio->bi_io_vec[bio->bi_vcnt].bv_offset = bv->bv_offset + skip;
+		bio->bi_vcnt++;
+		bio->bi_size += take;
+		mb->sector += take >> 9;
+
+		off += take;
+		len -= take;
+		if (skip + take == bv->bv_len) {
+			cur->base += bv->bv_len;
+			cur->idx++;
+		}
+	}
+}
+
+/*
+ * Map the part [off, off + sectors) of a bio, which lies in one zone
+ * and starts at zone offset 'zone_offset', as one bio per member: the
+ * chunks a member holds are contiguous on it, one per stripe row.
+ */
+static void raid0_fanout_zone(struct mddev *mddev, struct bio *bio,
+			      struct strip_zone *zone, sector_t zone_offset,
+			      unsigned int off, unsigned int sectors)
+{
+	struct r0conf *conf = mddev->private;
+	unsigned int chunk_sects = mddev->chunk_sectors;
+	unsigned int stripe = zone->stripe_sectors;
+	unsigned int pos0, sect_in_chunk, nr_members, k;
+	struct r0_bvec_cursor start = { .idx = bio->bi_idx, .base = 0 };
+	unsigned int covered = 0;
+	sector_t row0;
+
+	row0 = zone_row(conf, zone, chunk_sects, zone_offset,
+			&pos0, &sect_in_chunk);
+	nr_members = min_t(unsigned int, zone->nb_dev,
+			   DIV_ROUND_UP(sect_in_chunk + sectors, chunk_sects));
+
+	for (k = 0; k < nr_members; k++) {
+		struct r0_bvec_cursor cur = start;
+		struct r0_member_bio mb;
+		struct request_queue *q;
+		unsigned int pos = pos0 + k;
+		sector_t row = row0;
+		unsigned int chunk, rel, len;
+
+		if (pos >= zone->nb_dev) {
+			pos -= zone->nb_dev;
+			row++;
+		}
+		mb.bio = NULL;
+		mb.rdev = zone->dev[zone_disk(zone, pos)];
+		q = bdev_get_queue(mb.rdev->bdev);
+		mb.max_vecs = min_t(int, BIO_MAX_PAGES, queue_max_segments(q));
+		mb.sector = row * chunk_sects + zone->dev_start +
+			mb.rdev->data_offset;
+
+		if (k == 0)
+			mb.sector += sect_in_chunk;
+
+		/*
+		 * The member's chunks start at k * chunk_sects + n * stripe
+		 * from the start of the first chunk, which is sect_in_chunk
+		 * before the range; only member 0's first one is cut short.
+		 */
+		for (chunk = k * chunk_sects; ; chunk += stripe) {
+			rel = chunk > sect_in_chunk ? chunk - sect_in_chunk : 0;
+			if (rel >= sectors)
+				break;
+			len = min(chunk + chunk_sects - sect_in_chunk,
+				  sectors) - rel;
+			r0_member_add(mddev, bio, &mb, &cur,
+				      (off + rel) << 9, len << 9);
+			covered += len;
+		}
+		r0_member_submit(bio, &mb);
+	}
+
+	/* the chunks are disjoint, so this means all of them were mapped */
+	WARN_ON_ONCE(covered != sectors);
+}
+
+/*
+ * A bio spanning several chunks would otherwise be split at every
+ * chunk boundary.  Instead, build one bio per member from the pieces
+ * of the parent that land on it and chain them all to the parent.
+ */
+static void raid0_fanout(struct mddev *mddev, struct bio *bio)
+{
+	struct r0conf *conf = mddev->private;
+	unsigned int sectors = bio_sectors(bio);
+	unsigned int off = 0;
+
+	while (off < sectors) {
+		sector_t zone_offset = bio->bi_sector + off;
+		struct strip_zone *zone = find_zone(conf, &zone_offset);
+		sector_t zone_sectors = zone->zone_end -
+			(zone == conf->strip_zone ? 0 : zone[-1].zone_end);
+		unsigned int len;
+
+		len = min_t(sector_t, sectors - off,
+			    zone_sectors - zone_offset);
+		raid0_fanout_zone(mddev, bio, zone, zone_offset, off, len);
+		off += len;
+	}
+	bio_endio(bio, 0);
+}
 
 static bool raid0_make_request(struct mddev *mddev, struct bio *bio)
 {
+	struct r0conf *conf = mddev->private;
 	unsigned int chunk_sects;
 	sector_t sector_offset;
 	struct strip_zone *zone;
@@ -706,9 +920,32 @@ static bool raid0_make_request(struct mddev *mddev, struct bio *bio)
 	if (unlikely(!is_io_in_chunk_boundary(mddev, chunk_sects, bio))) {
 		sector_t sector = bio->bi_sector;
 		struct bio_pair *bp;
+
+		if (conf->fanout && !bio_integrity(bio) &&
+		    !(bio->bi_rw & REQ_WRITE_SAME)) {
+			raid0_fanout(mddev, bio);
+			return true;
+		}
 		/* Sanity check -- queue functions should prevent this happening */
-		if (bio_segments(bio) > 1)
-			goto bad_map;
+		if (bio_segments(bio) > 1) {
+			struct bio_pair2 *bp2;
+
+			if (!conf->fanout)
+				goto bad_map;
+			/* integrity payloads only follow a real split */
+			sector = chunk_sects - (conf->chunk_shift >= 0 ?
+				 sector & (chunk_sects - 1) :
+				 sector_div(sector, chunk_sects));
+			bp2 = bio_split2(bio, sector);
+			if (!bp2) {
+				bio_io_error(bio);
+				return true;
+			}
+			generic_make_request(bp2->bio1);
+			generic_make_request(bp2->bio2);
+			bio_pair2_release(bp2);
+			return true;
+		}
 		/* This is a one page bio that upper layers
 		 * refuse to split for us, so we need to split it.
 		 */
@@ -725,9 +962,8 @@ static bool raid0_make_request(struct mddev *mddev, struct bio *bio)
 	}
 
 	sector_offset = bio->bi_sector;
-	zone = find_zone(mddev->private, &sector_offset);
-	tmp_dev = map_sector(mddev, zone, bio->bi_sector,
-			     &sector_offset);
+	zone = find_zone(conf, &sector_offset);
+	tmp_dev = map_sector(mddev, zone, &sector_offset);
 	bio->bi_bdev = tmp_dev->bdev;
 	bio->bi_sector = sector_offset + zone->dev_start +
 		tmp_dev->data_offset;
@@ -5,6 +5,11 @@ struct strip_zone {
 	sector_t zone_end;	/* Start of the next zone (in sectors) */
 	sector_t dev_start;	/* Zone offset in real dev (in sectors) */
 	int	 nb_dev;	/* # of devices attached to the zone */
+	/* mapping tables, filled in by create_strip_zones() */
+	unsigned int stripe_sectors;	/* nb_dev * chunk_sectors */
+	int	 stripe_shift;	/* ilog2(stripe_sectors), -1 if not pow2 */
+	int	 disk_rot;	/* (zone start / chunk) % nb_dev */
+	struct md_rdev **dev;	/* this zone's part of devlist */
 };
 
 struct r0conf {
@@ -14,6 +19,10 @@ struct r0conf {
 	int			nr_strip_zones;
 	int			has_merge_bvec;	/* at least one member has
 						 * a merge_bvec_fn */
+	int			chunk_shift;	/* ilog2(chunk_sectors),
+						 * -1 if not pow2 */
+	int			fanout;		/* bios may span chunks, see
+						 * raid0_fanout() */
 };
 
 #endif
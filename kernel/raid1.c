@@ -342,6 +342,8 @@ static void raid1_end_read_request(struct bio *bio, int error)
 	struct r1conf *conf = r1_bio->mddev->private;
 	struct md_rdev *rdev = conf->mirrors[r1_bio->read_disk].rdev;
 
+	md_lat_record(r1_bio->mddev, MD_LAT_MEMBER_READ, r1_bio->start_time);
+
 	/*
 	 * this branch is our 'one mirror IO has finished' event handler:
 	 */
@@ -438,6 +440,7 @@ static void raid1_end_write_request(struct bio *bio, int error)
 	struct md_rdev *rdev = conf->mirrors[mirror].rdev;
 	bool discard_error;
 
+	md_lat_record(r1_bio->mddev, MD_LAT_MEMBER_WRITE, r1_bio->start_time);
 	discard_error = !uptodate && bio_op(bio) == REQ_OP_DISCARD;
 
 	/*
@@ -1271,6 +1274,7 @@ read_again:
 	    test_bit(R1BIO_FailFast, &r1_bio->state))
 		read_bio->bi_rw |= MD_FAILFAST;
 	read_bio->bi_private = r1_bio;
+	r1_bio->start_time = md_lat_start();
 
 	if (max_sectors < r1_bio->sectors) {
 		/*
@@ -1314,6 +1318,7 @@ static bool raid1_write_request(struct mddev *mddev, struct bio *bio,
 	int first_clone;
 	int sectors_handled;
 	int max_sectors;
+	u64 start;
 
 	/*
 	 * Register the new request and wait if the reconstruction
@@ -1347,7 +1352,9 @@ static bool raid1_write_request(struct mddev *mddev, struct bio *bio,
 
 	disks = conf->raid_disks * 2;
  retry_write:
+	start = md_lat_start();
 	wait_barrier(conf, r1_bio->sector);
+	md_lat_record(mddev, MD_LAT_BARRIER, start);
 	blocked_rdev = NULL;
 	rcu_read_lock();
 	max_sectors = r1_bio->sectors;
@@ -1437,6 +1444,7 @@ static bool raid1_write_request(struct mddev *mddev, struct bio *bio,
 	atomic_set(&r1_bio->remaining, 1);
 	atomic_set(&r1_bio->behind_remaining, 0);
 
+	r1_bio->start_time = md_lat_start();
 	first_clone = 1;
 	for (i = 0; i < disks; i++) {
 		struct bio *mbio;
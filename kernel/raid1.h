@@ -150,6 +150,8 @@ struct r1bio {
 	int			sectors;
 	unsigned long		state;
 	struct mddev		*mddev;
+	u64			start_time;	/* of member io, for
+						 * md_lat_record() */
 	/*
 	 * original bio going to /dev/mdx
 	 */
@@ -392,6 +392,8 @@ static void raid10_end_read_request(struct bio *bio, int error)
 	struct md_rdev *rdev;
 	struct r10conf *conf = r10_bio->mddev->private;
 
+	md_lat_record(r10_bio->mddev, MD_LAT_MEMBER_READ, r10_bio->start_time);
+
 	slot = r10_bio->read_slot;
 	rdev = r10_bio->devs[slot].rdev;
 	/*
@@ -488,6 +490,7 @@ static void raid10_end_write_request(struct bio *bio, int error)
 	struct bio *to_put = NULL;
 	bool discard_error;
 
+	md_lat_record(r10_bio->mddev, MD_LAT_MEMBER_WRITE, r10_bio->start_time);
 	discard_error = !uptodate && bio_op(bio) == REQ_OP_DISCARD;
 
 	dev = find_bio_disk(conf, r10_bio, bio, &slot, &repl);
@@ -1271,6 +1274,7 @@ read_again:
 	    test_bit(R10BIO_FailFast, &r10_bio->state))
 		read_bio->bi_rw |= MD_FAILFAST;
 	read_bio->bi_private = r10_bio;
+	r10_bio->start_time = md_lat_start();
 
 	if (max_sectors < r10_bio->sectors) {
 		/* Could not read all from this device, so we will
@@ -1395,8 +1399,8 @@ static void raid10_write_request(struct mddev *mddev, struct bio *bio,
 		set_mask_bits(&mddev->sb_flags, 0,
 			      BIT(MD_SB_CHANGE_DEVS) | BIT(MD_SB_CHANGE_PENDING));
 		md_wakeup_thread(mddev->thread);
-		wait_event(mddev->sb_wait,
-			   !test_bit(MD_SB_CHANGE_PENDING, &mddev->sb_flags));
+		/* reshape_safe must not pass what is on disk */
+		md_wait_for_sb_update(mddev, false);
 
 		conf->reshape_safe = mddev->reshape_position;
 	}
@@ -1545,6 +1549,7 @@ retry_write:
 	atomic_set(&r10_bio->remaining, 1);
 	bitmap_startwrite(mddev->bitmap, r10_bio->sector, r10_bio->sectors, 0);
 
+	r10_bio->start_time = md_lat_start();
 	for (i = 0; i < conf->copies; i++) {
 		if (r10_bio->devs[i].bio)
 			raid10_write_one_disk(mddev, r10_bio, bio, false,
@@ -1591,6 +1596,7 @@ static bool raid10_make_request(struct mddev *mddev, struct bio * bio)
 	sector_t chunk_mask = (conf->geo.chunk_mask & conf->prev.chunk_mask);
 	int chunk_sects = chunk_mask + 1;
 	int sectors;
+	u64 start;
 
 	if (unlikely(bio->bi_rw & REQ_FLUSH)) {
 		md_flush_request(mddev, bio);
@@ -1650,7 +1656,9 @@ static bool raid10_make_request(struct mddev *mddev, struct bio * bio)
 	 * thread has put up a bar for new requests.
 	 * Continue immediately if no resync is active currently.
 	 */
+	start = md_lat_start();
 	wait_barrier(conf);
+	md_lat_record(mddev, MD_LAT_BARRIER, start);
 
 	sectors = bio_sectors(bio);
 	while (test_bit(MD_RECOVERY_RESHAPE, &mddev->recovery) &&
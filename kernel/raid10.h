@@ -117,6 +117,8 @@ struct r10bio {
 	int			sectors;
 	unsigned long		state;
 	struct mddev		*mddev;
+	u64			start_time;	/* of member io, for
+						 * md_lat_record() */
 	/*
 	 * original bio going to /dev/mdx
 	 */
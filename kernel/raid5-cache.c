@@ -229,6 +229,7 @@ struct r5l_io_unit {
 	u64 seq;		/* seq number of the metablock */
 	sector_t log_start;	/* where the io_unit starts */
 	sector_t log_end;	/* where the io_unit ends */
+	u64 start_time;		/* when it was started, for md_lat_record() */
 	struct list_head log_sibling; /* log->running_ios */
 	struct list_head stripe_list; /* stripes added to the io_unit */
 
@@ -583,6 +584,7 @@ static void r5l_log_endio(struct bio *bio, int error)
 
 	if (error)
 		md_error(log->rdev->mddev, log->rdev);
+	md_lat_record(log->rdev->mddev, MD_LAT_JOURNAL, io->start_time);
 
 	bio_put(bio);
 
@@ -790,6 +792,7 @@ static struct r5l_io_unit *r5l_new_meta(struct r5l_log *log)
 	memset(io, 0, sizeof(*io));
 
 	io->log = log;
+	io->start_time = md_lat_start();
 	INIT_LIST_HEAD(&io->log_sibling);
 	INIT_LIST_HEAD(&io->stripe_list);
 	bio_list_init(&io->flush_barriers);
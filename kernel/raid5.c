@@ -4669,6 +4669,7 @@ static void handle_stripe(struct stripe_head *sh)
 	int prexor;
 	int disks = sh->disks;
 	struct r5dev *pdev, *qdev;
+	u64 start;
 
 	clear_bit(STRIPE_HANDLE, &sh->state);
 	if (test_and_set_bit_lock(STRIPE_ACTIVE, &sh->state)) {
@@ -4683,6 +4684,7 @@ static void handle_stripe(struct stripe_head *sh)
 		return;
 	}
 
+	start = md_lat_start();
 	if (test_and_clear_bit(STRIPE_BATCH_ERR, &sh->state))
 		break_stripe_batch_list(sh, 0);
 
@@ -5051,6 +5053,7 @@ finish:
 			md_wakeup_thread(conf->mddev->thread);
 	}
 
+	md_lat_record(conf->mddev, MD_LAT_HANDLE_STRIPE, start);
 	clear_bit_unlock(STRIPE_ACTIVE, &sh->state);
 }
 
@@ -5610,6 +5613,7 @@ static bool raid5_make_request(struct mddev *mddev, struct bio * bi)
 	DEFINE_WAIT(w);
 	bool do_prepare;
 	bool do_flush = false;
+	u64 start;
 
 	if (unlikely(bi->bi_rw & REQ_FLUSH)) {
 		int ret = r5l_handle_flush_request(conf->log, bi);
@@ -5696,8 +5700,10 @@ static bool raid5_make_request(struct mddev *mddev, struct bio * bi)
 			(unsigned long long)new_sector,
 			(unsigned long long)logical_sector);
 
+		start = md_lat_start();
 		sh = raid5_get_active_stripe(conf, new_sector, previous,
 				       (bi->bi_rw&RWA_MASK), 0);
+		md_lat_record(mddev, MD_LAT_STRIPE, start);
 		if (sh) {
 			if (unlikely(previous)) {
 				/* expansion might have moved on while waiting for a
@@ -0,0 +1,377 @@
+/*
+ * dm-table-bench: userspace microbenchmark of the two dm table lookups
+ * in kernel/dm-table.c, the btree walk and the Eytzinger descent used
+ * from EYTZINGER_MIN_TARGETS to EYTZINGER_MAX_TARGETS targets.
+ *
+ * The index builders and both lookups below are copies of the kernel
+ * code with the kernel types stubbed out; keep them in step with
+ * dm_table_build_index() and dm_table_find_target().
+ *
+ * For each table size the benchmark builds both indexes over targets
+ * of random length, checks that they agree on every lookup, then times
+ *
+ *   thru	independent lookups of random sectors, the way a stream
+ *		of unrelated bios hits the table;
+ *   lat	lookups where each sector depends on the previous result,
+ *		so nothing overlaps and the full miss chain is paid.
+ *
+ * Build and run:  make && ./dm-table-bench [lookups]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <time.h>
+
+typedef uint64_t sector_t;
+
+#define L1_CACHE_BYTES 64
+#define prefetch(x) __builtin_prefetch(x)
+#define dm_div_up(n, sz) (((n) + (sz) - 1) / (sz))
+#define dm_round_up(n, sz) (dm_div_up((n), (sz)) * (sz))
+
+#define MAX_DEPTH 16
+#define NODE_SIZE L1_CACHE_BYTES
+#define KEYS_PER_NODE (NODE_SIZE / sizeof(sector_t))
+#define CHILDREN_PER_NODE (KEYS_PER_NODE + 1)
+
+struct dm_target {
+	sector_t begin;
+	sector_t len;
+};
+
+struct dm_table {
+	unsigned int depth;
+	unsigned int counts[MAX_DEPTH];
+	sector_t *index[MAX_DEPTH];
+
+	sector_t *eyt_highs;
+	unsigned int *eyt_targets;
+
+	unsigned int num_targets;
+	unsigned int num_allocated;
+	sector_t *highs;
+	struct dm_target *targets;
+};
+
+static void *xalloc(size_t size)
+{
+	void *p;
+
+	/* the kernel side is vmalloc'ed, so page aligned */
+	if (posix_memalign(&p, 4096, size ? size : 1)) {
+		perror("posix_memalign");
+		exit(1);
+	}
+	memset(p, 0, size);
+	return p;
+}
+
+/* ---- copied from kernel/dm-table.c ---- */
+
+static unsigned int int_log(unsigned int n, unsigned int base)
+{
+	int result = 0;
+
+	while (n > 1) {
+		n = dm_div_up(n, base);
+		result++;
+	}
+
+	return result;
+}
+
+static inline unsigned int get_child(unsigned int n, unsigned int k)
+{
+	return (n * CHILDREN_PER_NODE) + k;
+}
+
+static inline sector_t *get_node(struct dm_table *t,
+				 unsigned int l, unsigned int n)
+{
+	return t->index[l] + (n * KEYS_PER_NODE);
+}
+
+static sector_t high(struct dm_table *t, unsigned int l, unsigned int n)
+{
+	for (; l < t->depth - 1; l++)
+		n = get_child(n, CHILDREN_PER_NODE - 1);
+
+	if (n >= t->counts[l])
+		return (sector_t) - 1;
+
+	return get_node(t, l, n)[KEYS_PER_NODE - 1];
+}
+
+static int setup_btree_index(unsigned int l, struct dm_table *t)
+{
+	unsigned int n, k;
+	sector_t *node;
+
+	for (n = 0U; n < t->counts[l]; n++) {
+		node = get_node(t, l, n);
+
+		for (k = 0U; k < KEYS_PER_NODE; k++)
+			node[k] = high(t, l + 1, get_child(n, k));
+	}
+
+	return 0;
+}
+
+static int setup_indexes(struct dm_table *t)
+{
+	int i;
+	unsigned int total = 0;
+	sector_t *indexes;
+
+	for (i = t->depth - 2; i >= 0; i--) {
+		t->counts[i] = dm_div_up(t->counts[i + 1], CHILDREN_PER_NODE);
+		total += t->counts[i];
+	}
+
+	indexes = xalloc((size_t)total * NODE_SIZE);
+
+	for (i = t->depth - 2; i >= 0; i--) {
+		t->index[i] = indexes;
+		indexes += (KEYS_PER_NODE * t->counts[i]);
+		setup_btree_index(i, t);
+	}
+
+	return 0;
+}
+
+static void setup_eytzinger(struct dm_table *t, unsigned int *i,
+			    unsigned int k)
+{
+	if (k > t->num_targets)
+		return;
+
+	setup_eytzinger(t, i, 2 * k);
+	t->eyt_highs[k] = t->highs[*i];
+	t->eyt_targets[k] = (*i)++;
+	setup_eytzinger(t, i, 2 * k + 1);
+}
+
+static int build_eytzinger_index(struct dm_table *t)
+{
+	unsigned int i = 0;
+
+	t->eyt_highs = xalloc((t->num_targets + 1) * sizeof(sector_t));
+	t->eyt_targets = xalloc((t->num_targets + 1) * sizeof(unsigned int));
+
+	setup_eytzinger(t, &i, 1);
+	return 0;
+}
+
+static int build_btree_index(struct dm_table *t)
+{
+	int r = 0;
+	unsigned int leaf_nodes;
+
+	leaf_nodes = dm_div_up(t->num_targets, KEYS_PER_NODE);
+	t->depth = 1 + int_log(leaf_nodes, CHILDREN_PER_NODE);
+
+	t->counts[t->depth - 1] = leaf_nodes;
+	t->index[t->depth - 1] = t->highs;
+
+	if (t->depth >= 2)
+		r = setup_indexes(t);
+
+	return r;
+}
+
+static inline struct dm_target *eytzinger_find_target(struct dm_table *t,
+						       sector_t sector)
+{
+	sector_t *highs = t->eyt_highs;
+	unsigned int k = 1;
+
+	while (k <= t->num_targets) {
+		prefetch(highs + k * KEYS_PER_NODE);
+		k = 2 * k + (highs[k] < sector);
+	}
+	k >>= ffs(~k);
+
+	return &t->targets[k ? t->eyt_targets[k] : t->num_targets];
+}
+
+static inline struct dm_target *btree_find_target(struct dm_table *t,
+						   sector_t sector)
+{
+	unsigned int l, n = 0, k = 0;
+	sector_t *node;
+
+	for (l = 0; l < t->depth; l++) {
+		n = get_child(n, k);
+		node = get_node(t, l, n);
+
+		for (k = 0; k < KEYS_PER_NODE; k++)
+			if (node[k] >= sector)
+				break;
+	}
+
+	return &t->targets[(KEYS_PER_NODE * n) + k];
+}
+
+/* ---- end of copy ---- */
+
+static uint64_t rnd_state = 88172645463325252ULL;
+
+static inline uint64_t rnd(void)
+{
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 7;
+	rnd_state ^= rnd_state << 17;
+	return rnd_state;
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * Like dm_table_add_target() + dm_table_complete(): targets of 1..2048
+ * sectors laid end to end, highs[] padded with -1 to a whole node.
+ */
+static void make_table(struct dm_table *t, unsigned int num_targets)
+{
+	sector_t start = 0;
+	unsigned int i;
+
+	memset(t, 0, sizeof(*t));
+	t->num_targets = num_targets;
+	t->num_allocated = dm_round_up(num_targets, KEYS_PER_NODE);
+	t->highs = xalloc(t->num_allocated * sizeof(sector_t));
+	memset(t->highs, -1, t->num_allocated * sizeof(sector_t));
+	t->targets = xalloc((t->num_allocated + 1) * sizeof(struct dm_target));
+
+	for (i = 0; i < num_targets; i++) {
+		t->targets[i].begin = start;
+		t->targets[i].len = 1 + rnd() % 2048;
+		start += t->targets[i].len;
+		t->highs[i] = start - 1;
+	}
+
+	build_btree_index(t);
+	build_eytzinger_index(t);
+}
+
+static void free_table(struct dm_table *t)
+{
+	if (t->depth >= 2)
+		free(t->index[t->depth - 2]);
+	free(t->eyt_highs);
+	free(t->eyt_targets);
+	free(t->highs);
+	free(t->targets);
+}
+
+static sector_t table_len(struct dm_table *t)
+{
+	return t->highs[t->num_targets - 1] + 1;
+}
+
+static void check(struct dm_table *t, sector_t *keys, unsigned int nr)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr; i++) {
+		struct dm_target *a = btree_find_target(t, keys[i]);
+		struct dm_target *b = eytzinger_find_target(t, keys[i]);
+
+		if (a != b || keys[i] < a->begin ||
+		    keys[i] >= a->begin + a->len) {
+			fprintf(stderr, "mismatch: %u targets, sector %llu\n",
+				t->num_targets, (unsigned long long)keys[i]);
+			exit(1);
+		}
+	}
+
+	/*
+	 * One past the end must land on the spare, invalid target.  The
+	 * btree is not checked: past the end it steps into a leaf beyond
+	 * highs[], so it is only ever fed sectors inside the table.
+	 */
+	if (eytzinger_find_target(t, table_len(t)) != &t->targets[t->num_targets]) {
+		fprintf(stderr, "end of device: %u targets\n", t->num_targets);
+		exit(1);
+	}
+}
+
+#define BENCH(name, find)						\
+static double name##_thru(struct dm_table *t, sector_t *keys,		\
+			  unsigned int nr)				\
+{									\
+	sector_t sum = 0;						\
+	double start = now_ns();					\
+	unsigned int i;							\
+									\
+	for (i = 0; i < nr; i++)					\
+		sum += find(t, keys[i])->len;				\
+	__asm__ volatile("" : : "r"(sum));				\
+	return (now_ns() - start) / nr;					\
+}									\
+									\
+static double name##_lat(struct dm_table *t, sector_t *keys,		\
+			 unsigned int nr)				\
+{									\
+	sector_t prev = 0;						\
+	double start = now_ns();					\
+	unsigned int i;							\
+									\
+	for (i = 0; i < nr; i++)					\
+		prev = find(t, keys[i] & ~(prev & 1))->len;		\
+	__asm__ volatile("" : : "r"(prev));				\
+	return (now_ns() - start) / nr;					\
+}
+
+BENCH(btree, btree_find_target)
+BENCH(eyt, eytzinger_find_target)
+
+static double best(double (*fn)(struct dm_table *, sector_t *, unsigned int),
+		   struct dm_table *t, sector_t *keys, unsigned int nr)
+{
+	double r, min = 1e30;
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		r = fn(t, keys, nr);
+		if (r < min)
+			min = r;
+	}
+
+	return min;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int nr = argc > 1 ? strtoul(argv[1], NULL, 0) : 1U << 20;
+	sector_t *keys = xalloc((size_t)nr * sizeof(*keys));
+	unsigned int n, i;
+	struct dm_table t;
+
+	printf("%10s %6s %10s %10s %10s %10s\n", "targets", "depth",
+	       "btree thru", "eyt thru", "btree lat", "eyt lat");
+
+	for (n = 1; n <= 1U << 22; n *= 2) {
+		make_table(&t, n);
+		for (i = 0; i < nr; i++)
+			keys[i] = rnd() % table_len(&t);
+		check(&t, keys, nr);
+
+		printf("%10u %6u %10.1f %10.1f %10.1f %10.1f\n", n, t.depth,
+		       best(btree_thru, &t, keys, nr),
+		       best(eyt_thru, &t, keys, nr),
+		       best(btree_lat, &t, keys, nr),
+		       best(eyt_lat, &t, keys, nr));
+		free_table(&t);
+	}
+
+	free(keys);
+	return 0;
+}